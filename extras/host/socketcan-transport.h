@@ -0,0 +1,107 @@
+#pragma once
+
+// SocketCAN controller for host (Linux) builds, for example:
+//   SocketCanTransport can0("can0"), can1("vcan1");
+//   BusRouter::transportSet(0, &can0);
+//   BusRouter::transportSet(1, &can1);
+// Each bus' receive loop calls BusRouter::poll(bus), the decoding loop BusRouter::decode().
+// CAN FD: SocketCanTransport can0("vcan0", true), with the library built with MRM_CAN_FD=1. A virtual FD interface for tests:
+//   ip link add dev vcan0 type vcan && ip link set vcan0 mtu 72 && ip link set up vcan0
+
+#include <cstring>
+#include <fcntl.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "mrm-board.h"
+
+class SocketCanTransport : public CanTransport{
+	int socketHandle = -1;
+	bool fd = false;
+
+public:
+	/**
+	@param interfaceName - like "can0" or "vcan0"
+	@param fdEnable - use CAN FD frames. The interface's MTU must be 72.
+	*/
+	SocketCanTransport(const char* interfaceName, bool fdEnable = false){
+		socketHandle = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+		if (socketHandle < 0) {
+			sprintf(errorMessage, "No socket for %s", interfaceName);
+			return;
+		}
+		struct ifreq request = {};
+		strncpy(request.ifr_name, interfaceName, IFNAMSIZ - 1);
+		struct sockaddr_can address = {};
+		address.can_family = AF_CAN;
+		if (ioctl(socketHandle, SIOCGIFINDEX, &request) < 0 ||
+			(address.can_ifindex = request.ifr_ifindex, bind(socketHandle, (struct sockaddr*)&address, sizeof(address))) < 0) {
+			sprintf(errorMessage, "No interface %s", interfaceName);
+			close(socketHandle);
+			socketHandle = -1;
+			return;
+		}
+		fcntl(socketHandle, F_SETFL, O_NONBLOCK);
+		if (fdEnable) {
+			int enable = 1;
+			fd = setsockopt(socketHandle, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable, sizeof(enable)) == 0;
+			if (!fd)
+				sprintf(errorMessage, "No CAN FD on %s", interfaceName);
+		}
+	}
+
+	~SocketCanTransport(){
+		if (socketHandle >= 0)
+			close(socketHandle);
+	}
+
+	bool fdCapable(){ return fd; }
+
+	bool receive(CANMessage& message){
+		if (fd) { // The socket may deliver FD frames, read them whole.
+			CANFDMessage fdMessage;
+			if (!receiveFD(fdMessage))
+				return false;
+			message = fdMessage.classic();
+			return true;
+		}
+		struct can_frame frame;
+		if (socketHandle < 0 || read(socketHandle, &frame, sizeof(frame)) != sizeof(frame))
+			return false;
+		message.id = frame.can_id & CAN_SFF_MASK;
+		message.dlc = frame.can_dlc > 8 ? 8 : frame.can_dlc;
+		memcpy(message.data, frame.data, message.dlc);
+		return true;
+	}
+
+	bool receiveFD(CANFDMessage& message){
+		struct canfd_frame frame;
+		ssize_t bytes = socketHandle < 0 ? -1 : read(socketHandle, &frame, sizeof(frame));
+		if (bytes != CANFD_MTU && bytes != CAN_MTU)
+			return false;
+		message.id = frame.can_id & CAN_SFF_MASK;
+		message.length = frame.len > MRM_CAN_FD_BYTES ? MRM_CAN_FD_BYTES : frame.len;
+		memcpy(message.data, frame.data, message.length);
+		return true;
+	}
+
+	bool send(CANMessage& message){
+		struct can_frame frame = {};
+		frame.can_id = message.id;
+		frame.can_dlc = message.dlc;
+		memcpy(frame.data, message.data, message.dlc);
+		return socketHandle >= 0 && write(socketHandle, &frame, sizeof(frame)) == sizeof(frame);
+	}
+
+	bool sendFD(CANFDMessage& message){
+		struct canfd_frame frame = {};
+		frame.can_id = message.id;
+		frame.len = message.length;
+		frame.flags = CANFD_BRS;
+		memcpy(frame.data, message.data, message.length);
+		return fd && write(socketHandle, &frame, sizeof(frame)) == sizeof(frame);
+	}
+};
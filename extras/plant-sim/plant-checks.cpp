@@ -0,0 +1,331 @@
+// Checks of bus features against simulated devices, without a robot. Each scenario prints what it measured and exits with 1 if
+// a check failed.
+//
+// Build like plant-sim:
+//   g++ -O2 -std=gnu++17 -I../../src -I<host-arduino> plant-checks.cpp ../../src/*.cpp -o plant-checks
+// Usage:
+//   plant-checks <scenario>
+// Scenarios:
+//   can-test - canTest() round trips while each echo is repeated 5 ms later: every probe counted once, duplicates ignored
+//   duplicates - duplicatesScan() finds 2 motors sharing an id, while motors lose frames sent less than 1 ms apart after the 4th
+//   topology - Topology::restore() confirms each saved device, with a paced sweep, and rejects a blob with any invalid board
+//   decode - encoder frames decoded through MotorBoard's per-mode table and by hand-coded shifts: same values, time per frame of each
+//   telemetry - 1000 records of 8 streaming motors, with text carrying false magics between them and a device added between keyframes:
+//     every record decoded, bytes per record
+//   config - ConfigBatch swaps 2 motors' ids, moves 1, refuses an id an unregistered motor has, changes PnP and resets, with 0 - 30%
+//     of frames lost in each direction, 20 runs at each loss: every step ends as it should up to 10%. Above, runs that end wrong are
+//     only counted: with MRM_CONFIG_TRIES and MRM_CONFIG_PINGS of 3, a command lost 3 times, or all the pings of a taken id, which
+//     then looks silent, become likely.
+//   time-sync - 20 s of timeSync() with a motor whose clock runs 80 ppm fast: drift, and readings' acquisition time against decoding time
+
+#include <chrono>
+#include <vector>
+#include "plant-sim.h"
+#include "mrm-board-config.h"
+#include "mrm-board-telemetry.h"
+
+static PlantSim plant;
+
+uint32_t millis(){ return plant.nowUs() / 1000; }
+uint32_t micros(){ return plant.nowUs(); }
+
+void BoardHost::delayMs(uint16_t ms){ plant.run(ms); }
+void BoardHost::end(){}
+void BoardHost::errorAdd(CANMessage& message, uint8_t errorCode, bool peripheral, bool printNow){}
+void BoardHost::messagePrint(CANMessage& message, Board* board, uint8_t deviceNumber, bool outbound, bool clientInitiated, std::string postfix){}
+void BoardHost::messageSend(CANMessage& message, uint8_t deviceNumber){ plant.frameSent(message); }
+void BoardHost::noLoopWithoutThis(){}
+uint16_t BoardHost::serialReadNumber(uint16_t timeoutFirst, uint16_t timeoutBetween, bool onlySingleDigitInput, uint16_t limit, bool printWarnings){ return 0xFFFF; }
+bool BoardHost::setup(){ return true; }
+bool BoardHost::userBreak(){ return false; }
+
+/** Report a check
+@param passed - result
+@param what - description
+@return - passed
+*/
+static bool check(bool passed, const char* what){
+	printf("%s: %s\n", passed ? "ok" : "FAILED", what);
+	return passed;
+}
+
+/** A motor board with simulated motors, scanned
+@param board - board
+@param count - motors
+@param canIdBase - first motor's canIdIn
+*/
+static void motorsAdd(MotorBoard& board, uint8_t count, uint16_t canIdBase){
+	for (uint8_t i = 0; i < count; i++) {
+		char name[16];
+		snprintf(name, sizeof(name), "%s-%i", board.name().c_str(), i);
+		board.add(name, canIdBase + 2 * i, canIdBase + 2 * i + 1);
+		plant.motorAdd(canIdBase + 2 * i, canIdBase + 2 * i + 1);
+	}
+	board.devicesScan();
+	plant.run(5); // Late answers
+}
+
+static bool canTest(){
+	MotorBoard mot4x36(4, "mot", 1, Board::ID_MRM_MOT4X3_6CAN);
+	motorsAdd(mot4x36, 1, 0x0230);
+	plant.echoCopies = 2;
+	mot4x36.canTest(&mot4x36.devices[0], 100, 2);
+	LatencyProbe::Result result = Board::latencyProbe.result();
+	bool passed = check(result.count == 100, "100 probes, 200 echoes, 100 samples");
+	return check(result.minimumUs >= plant.busLatencyUs && result.p99Us < plant.busLatencyUs + 1000, "round trips match the simulated latency") && passed;
+}
+
+static bool duplicates(){
+	MotorBoard mot4x36(4, "mot", 2, Board::ID_MRM_MOT4X3_6CAN);
+	motorsAdd(mot4x36, 7, 0x0230);
+	plant.motorAdd(0x0234, 0x0235); // Shares mot-2's id
+	plant.rxBurst = 4;
+	bool passed = check(Board::duplicatesScan() == 1, "1 conflicting id among 7");
+	passed = check(mot4x36.devices[2].duplicateSignaturesCount == 2, "2 distinct echoes for mot-2") && passed;
+	bool allEchoed = true;
+	for (Device& device : mot4x36.devices)
+		allEchoed &= device.duplicateEchoes >= 1;
+	return check(allEchoed, "every device pinged, though motors take only 4 frames a ms") && passed;
+}
+
+/** CRC-16/CCITT, as Topology's
+@param buffer - data
+@param length - number of bytes
+@return - CRC
+*/
+static uint16_t crc16(const uint8_t* buffer, uint16_t length){
+	uint16_t crc = 0xFFFF;
+	for (uint16_t i = 0; i < length; i++) {
+		crc ^= buffer[i] << 8;
+		for (uint8_t bit = 0; bit < 8; bit++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+static bool topology(){
+	MotorBoard mot4x36(4, "mot", 2, Board::ID_MRM_MOT4X3_6CAN);
+	motorsAdd(mot4x36, 5, 0x0230);
+	MotorBoard bldc(4, "bldc", 1, Board::ID_MRM_BLDC4x2_5);
+	motorsAdd(bldc, 1, 0x0240);
+	bldc.add("bldc-1", 0x0242, 0x0243); // Silent when saved
+	plant.rxBurst = 4;
+	const char* fileName = "plant-checks-topology";
+	bool passed = check(Topology::save(fileName) && Topology::restore(fileName), "6 devices confirmed by a paced sweep");
+
+	plant.motorGet(0x0232)->canIdIn = 0x07F0; // mot-1 gone
+	plant.motorAdd(0x0242, 0x0243); // bldc-1 answers now
+	passed = check(!Topology::restore(fileName) && strstr(errorMessage, "mot-1") != NULL, "a missing device and a new one do not cancel out") && passed;
+
+	// The second board's configuration is invalid, so the first one's must not be applied either.
+	uint8_t blob[MRM_TOPOLOGY_BYTES];
+	uint16_t length = Topology::serialize(blob, sizeof(blob));
+	uint8_t* motConfig = blob + 10 + 3;
+	uint8_t* bldcConfig = motConfig + blob[12] + 6 * mot4x36.devices.size() + 3;
+	motConfig[0] = 2;
+	bldcConfig[0] = 7;
+	uint16_t payloadCrc = crc16(blob + 10, length - 10);
+	blob[8] = payloadCrc & 0xFF;
+	blob[9] = payloadCrc >> 8;
+	return check(!Topology::deserialize(blob, length) && mot4x36.measuringModeGet() == 0, "an invalid board changes no board") && passed;
+}
+
+/** Acquisition time errors of encoder readings
+*/
+struct AcquisitionErrors{
+	SimMotor* motor;
+	uint32_t fromUs; // Errors are taken after this
+	uint32_t stampedMaxUs; // Device::readingsUs
+	uint32_t decodedMaxUs; // Decoding time
+};
+
+/** ReadingCallback comparing a reading's estimated acquisition time to the simulated one
+*/
+static void acquisitionCompare(Board* board, Device& device, uint8_t subsensor, int32_t value, void* context){
+	AcquisitionErrors* errors = (AcquisitionErrors*)context;
+	if ((int32_t)(micros() - errors->fromUs) < 0)
+		return;
+	uint32_t stampedUs = abs((int32_t)(device.readingsUs - errors->motor->acquiredUs));
+	uint32_t decodedUs = micros() - errors->motor->acquiredUs;
+	errors->stampedMaxUs = std::max(errors->stampedMaxUs, stampedUs);
+	errors->decodedMaxUs = std::max(errors->decodedMaxUs, decodedUs);
+}
+
+static bool timeSync(){
+	MotorBoard mot4x36(4, "mot", 1, Board::ID_MRM_MOT4X3_6CAN);
+	motorsAdd(mot4x36, 1, 0x0230);
+	Device& device = mot4x36.devices[0];
+	SimMotor* motor = plant.motorGet(0x0230);
+	motor->timeStamps = true;
+	motor->clockPpm = 80;
+	motor->clockOffsetUs = 123456;
+	AcquisitionErrors errors = { motor, plant.nowUs() + 2000000, 0, 0 }; // After 2 syncs, drift is known.
+	mot4x36.subscribe(device, acquisitionCompare, &errors);
+	mot4x36.start(&device, 0, 5);
+	for (uint8_t second = 0; second < 20; second++) {
+		mot4x36.timeSync(&device);
+		plant.run(1000);
+	}
+	printf("drift %.1f ppm, acquisition time off by up to %u us, decoding time by up to %u us\n", device.clock.driftPpm, errors.stampedMaxUs,
+		errors.decodedMaxUs);
+	bool passed = check(fabsf(device.clock.driftPpm - 80) < 1, "drift of an 80 ppm clock measured within 1 ppm");
+	return check(errors.stampedMaxUs < errors.decodedMaxUs / 2, "time-stamped readings closer to their acquisition than decoding time") && passed;
+}
+
+/** TelemetryWriter appending to a byte vector
+*/
+static void telemetryStore(const uint8_t* data, uint16_t length, void* context){
+	std::vector<uint8_t>* stream = (std::vector<uint8_t>*)context;
+	stream->insert(stream->end(), data, data + length);
+}
+
+static bool telemetry(){
+	const uint16_t RECORDS = 1000;
+	MotorBoard mot4x36(4, "mot", 2, Board::ID_MRM_MOT4X3_6CAN);
+	motorsAdd(mot4x36, 8, 0x0230);
+	mot4x36.start(nullptr, 0, 5);
+	MotorBoard bldc(4, "bldc", 1, Board::ID_MRM_BLDC4x2_5); // Its device comes between keyframes, growing the alive bitmap
+	std::vector<uint8_t> stream;
+	Telemetry telemetry(telemetryStore, &stream);
+	uint8_t channels = telemetry.channelsAddAll();
+	std::vector<uint32_t> encoders; // Sent, 8 per record
+	uint32_t textBytes = 0;
+	for (uint16_t record = 0; record < RECORDS; record++) {
+		if (record % 100 == 0)
+			for (uint8_t i = 0; i < 8; i++)
+				mot4x36.speedSet(i, (int8_t)((record / 100 * 37 + i * 23) % 255 - 127));
+		plant.run(20);
+		if (record == 510) { // As Discovery::sweep() adds an answering device
+			bldc.add("bldc-0", 0x0240, 0x0241);
+			bldc.devices[0].alive = true;
+		}
+		if (record % 50 == 25) { // print() text with a byte that looks like a delta's header, claiming the next record's first bytes
+			const uint8_t text[] = { 'o', 'k', MRM_TELEMETRY_MAGIC, TELEMETRY_DELTA, 0, 6, 0, '\n' };
+			stream.insert(stream.end(), text, text + sizeof(text));
+			textBytes += sizeof(text);
+		}
+		telemetry.snapshot();
+		for (uint8_t i = 0; i < 8; i++)
+			encoders.push_back(mot4x36.readingGet(mot4x36.devices[i]).value);
+	}
+
+	static TelemetryDecoder decoder; // Too big for the stack
+	uint16_t decoded = 0;
+	bool matched = true;
+	for (uint8_t byte : stream)
+		if (decoder.feed(byte)) {
+			for (uint8_t i = 0; i < 8 && decoded < RECORDS; i++)
+				matched &= (uint32_t)decoder.values[4 * i] == encoders[decoded * 8 + i]; // channelsAddAll(): encoder, frames, errors and FPS of each motor
+			decoded++;
+		}
+	printf("%i channels, %u records, %.1f bytes each, %u false magics\n", channels, RECORDS, (float)telemetry.bytesWritten / RECORDS, decoder.corrupted);
+	bool passed = check(decoded == RECORDS && decoder.lost == 0, "every record decoded, though text claimed some records' first bytes");
+	return check(matched, "every decoded encoder count as the board had it") && passed;
+}
+
+/** Gives the checks MotorBoard's decode table
+*/
+class MotorDecode : public MotorBoard{
+public:
+	/** Decode an encoder frame through the table, as messageDecode() does
+	@param message - frame
+	@param device - device, its measuringMode selects the table
+	@return - encoder count
+	*/
+	static uint32_t table(const CANMessage& message, const Device& device){
+		int32_t readings[1];
+		int32_t deviceTime = -1;
+		readingsDecode(encoderLayouts, message, device, readings, &deviceTime);
+		return readings[0] + deviceTime;
+	}
+};
+
+static bool decode(){
+	const uint32_t FRAMES = 20000000;
+	MotorBoard mot4x36(4, "mot", 1, Board::ID_MRM_MOT4X3_6CAN);
+	mot4x36.add("mot-0", 0x0230, 0x0231);
+	Device& device = mot4x36.devices[0];
+	uint8_t data[8] = { COMMAND_SENSORS_MEASURE_SENDING };
+	uint32_t sums[2] = { 0, 0 };
+	double nsPerFrame[2];
+	for (uint8_t pass = 0; pass < 2; pass++) {
+		CANMessage message(0x0231, data, 7);
+		auto startTime = std::chrono::steady_clock::now();
+		for (uint32_t i = 0; i < FRAMES; i++) {
+			message.data[1 + (i & 3)] = i; // Vary the count, so the loop cannot be folded
+			device.measuringMode = (i >> 2) % MRM_MEASURING_MODES;
+			if (pass == 0) // As the encoder frame was decoded before the tables
+				sums[0] += ((message.data[4] << 24) | (message.data[3] << 16) | (message.data[2] << 8) | message.data[1]) +
+					(message.dlc >= 7 ? message.data[5] | (message.data[6] << 8) : -1);
+			else
+				sums[1] += MotorDecode::table(message, device);
+		}
+		nsPerFrame[pass] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - startTime).count() / FRAMES;
+	}
+	printf("encoder frame: %.2f ns hand-coded, %.2f ns by table\n", nsPerFrame[0], nsPerFrame[1]);
+	return check(sums[0] == sums[1], "the table decodes the same counts and times as the hand-coded decode");
+}
+
+static bool config(){
+	const uint8_t RUNS = 20;
+	bool passed = true;
+	for (uint8_t percent = 0; percent <= 30; percent += 10) {
+		uint8_t correct = 0;
+		uint32_t durationMs = 0;
+		for (uint8_t run = 0; run < RUNS; run++) {
+			plant.clear(0x9E3779B9 + 7919 * run);
+			plant.lossShare = 0;
+			MotorBoard mot4x36(4, "mot", 1, Board::ID_MRM_MOT4X3_6CAN);
+			motorsAdd(mot4x36, 4, 0x0230);
+			MotorBoard bldc(4, "bldc", 1, Board::ID_MRM_BLDC4x2_5);
+			motorsAdd(bldc, 3, 0x0240);
+			SimMotor* stranger = plant.motorAdd(0x023E, 0x023F); // Unregistered, on mot's number 7
+			SimMotor* simMotors[4] = { plant.motorGet(0x0230), plant.motorGet(0x0232), plant.motorGet(0x0234), plant.motorGet(0x0236) };
+			SimMotor* simBldc[3] = { plant.motorGet(0x0240), plant.motorGet(0x0242), plant.motorGet(0x0244) };
+			plant.lossShare = percent / 100.0;
+
+			ConfigBatch::clear();
+			ConfigBatch::idChange(&mot4x36, 0, 1); // Swap
+			ConfigBatch::idChange(&mot4x36, 1, 0);
+			ConfigBatch::idChange(&mot4x36, 2, 5);
+			ConfigBatch::idChange(&mot4x36, 3, 7); // Taken
+			ConfigBatch::pnpSet(&bldc, 0, false);
+			ConfigBatch::pnpSet(&bldc, 1, false);
+			ConfigBatch::reset(&bldc, 2);
+			uint32_t startUs = plant.nowUs();
+			uint8_t done = ConfigBatch::run();
+			durationMs += (plant.nowUs() - startUs) / 1000;
+
+			bool ok = done == 6 && ConfigBatch::step(3).state == CONFIG_FAILED;
+			const uint16_t expected[4] = { 0x0232, 0x0230, 0x023A, 0x0236 };
+			for (uint8_t i = 0; i < 4; i++)
+				ok &= simMotors[i]->canIdIn == expected[i] && mot4x36.devices[i].canIdIn == expected[i] && mot4x36.devices[i].canIdOut == expected[i] + 1;
+			ok &= stranger->canIdIn == 0x023E && simBldc[0]->pnp == 0 && simBldc[1]->pnp == 0 && simBldc[2]->pnp == 1 && simBldc[2]->resets >= 1;
+			correct += ok;
+		}
+		printf("%i%% lost: %i of %i runs correct, %u ms each\n", percent, correct, RUNS, durationMs / RUNS);
+		if (percent <= 10) {
+			char what[64];
+			snprintf(what, sizeof(what), "every step ends as it should with %i%% of frames lost", percent);
+			passed = check(correct == RUNS, what) && passed;
+		}
+	}
+	plant.lossShare = 0;
+	return passed;
+}
+
+int main(int argc, char* argv[]){
+	static const struct{
+		const char* name;
+		bool (*run)();
+	} scenarios[] = {{"can-test", canTest}, {"duplicates", duplicates}, {"topology", topology}, {"decode", decode}, {"telemetry", telemetry}, {"config", config},
+		{"time-sync", timeSync}};
+	for (auto& scenario : scenarios)
+		if (argc > 1 && strcmp(argv[1], scenario.name) == 0)
+			return scenario.run() ? 0 : 1;
+	printf("Usage: %s <scenario>, scenarios:", argv[0]);
+	for (auto& scenario : scenarios)
+		printf(" %s", scenario.name);
+	printf("\n");
+	return 1;
+}
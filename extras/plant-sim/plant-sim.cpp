@@ -0,0 +1,70 @@
+// Drives a simulated omni-wheel robot to a target through the real MotorBoard and MotorGroupStar::goToEliminateErrors(), with the
+// library's Mrm_pid controllers, to tune position control and measure control latency without a robot. The gains found here are the
+// robot's: errors are in mm and degrees, as goToEliminateErrors() gets them there. Runs much faster than real time.
+//
+// Build on Linux, with a host Arduino compatibility layer providing Arduino.h, but not millis() and micros(), which come from the simulator:
+//   g++ -O2 -std=gnu++17 -I../../src -I<host-arduino> plant-sim.cpp ../../src/*.cpp -o plant-sim
+// Usage:
+//   plant-sim [x-y P] [x-y D] [x-y I] [rotation P] [rotation D] [bus latency us] [refresh ms]
+
+#include <chrono>
+#include "plant-sim.h"
+
+static PlantSim plant;
+
+uint32_t millis(){ return plant.nowUs() / 1000; }
+uint32_t micros(){ return plant.nowUs(); }
+
+void BoardHost::delayMs(uint16_t ms){ plant.run(ms); }
+void BoardHost::end(){}
+void BoardHost::errorAdd(CANMessage& message, uint8_t errorCode, bool peripheral, bool printNow){}
+void BoardHost::messagePrint(CANMessage& message, Board* board, uint8_t deviceNumber, bool outbound, bool clientInitiated, std::string postfix){}
+void BoardHost::messageSend(CANMessage& message, uint8_t deviceNumber){ plant.frameSent(message); }
+void BoardHost::noLoopWithoutThis(){}
+uint16_t BoardHost::serialReadNumber(uint16_t timeoutFirst, uint16_t timeoutBetween, bool onlySingleDigitInput, uint16_t limit, bool printWarnings){ return 0xFFFF; }
+bool BoardHost::setup(){ return true; }
+bool BoardHost::userBreak(){ return false; }
+
+int main(int argc, char* argv[]){
+	Mrm_pid pidXY(argc > 1 ? atof(argv[1]) : 0.5, argc > 2 ? atof(argv[2]) : 100, argc > 3 ? atof(argv[3]) : 0); // Speed from mm of error
+	Mrm_pid pidRotation(argc > 4 ? atof(argv[4]) : 2, argc > 5 ? atof(argv[5]) : 100, 0); // Rotation from degrees of error
+	plant.busLatencyUs = argc > 6 ? atoi(argv[6]) : 300;
+	uint16_t refreshMs = argc > 7 ? atoi(argv[7]) : 5;
+
+	MotorBoard mot4x36(4, "mrm-mot4x3.6can", 1, Board::ID_MRM_MOT4X3_6CAN);
+	for (uint8_t i = 0; i < 4; i++) {
+		char name[10];
+		snprintf(name, sizeof(name), "mot4x3-%i", i);
+		mot4x36.add(name, 0x0230 + 2 * i, 0x0231 + 2 * i);
+		plant.motorAdd(0x0230 + 2 * i, 0x0231 + 2 * i);
+	}
+	MotorGroupStar group(&mot4x36, 0, &mot4x36, 1, &mot4x36, 2, &mot4x36, 3);
+
+	mot4x36.devicesScan();
+	mot4x36.start(NULL, 0, refreshMs);
+	plant.run(20);
+
+	const float targetX = 0.5, targetY = 0.8; // m
+	uint32_t reachedMs = 0;
+	uint32_t startMs = millis();
+	auto startTime = std::chrono::steady_clock::now();
+	while (millis() - startMs < 5000) {
+		float errorX = targetX - plant.pose.x;
+		float errorY = targetY - plant.pose.y;
+		group.goToEliminateErrors(errorX * 1000, errorY * 1000, -plant.pose.heading, &pidXY, &pidRotation);
+		if (sqrtf(errorX * errorX + errorY * errorY) < 0.01 && reachedMs == 0)
+			reachedMs = millis() - startMs;
+		plant.run(refreshMs);
+	}
+	group.stop();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+	printf("Pose (%.3f, %.3f) m, %.1f deg, target (%.3f, %.3f)\n", plant.pose.x, plant.pose.y, plant.pose.heading, targetX, targetY);
+	if (reachedMs == 0)
+		printf("Within 1 cm: never\n");
+	else
+		printf("Within 1 cm: %u ms\n", reachedMs);
+	printf("Command to reading: %u us\n", plant.commandToReadingUs());
+	printf("5 s simulated in %.3f s, %.0fx real time\n", seconds, 5 / seconds);
+	return 0;
+}
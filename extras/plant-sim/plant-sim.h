@@ -0,0 +1,337 @@
+#pragma once
+
+// Closed-loop plant simulator for host (Linux) builds. Virtual motors answer the real frames MotorBoard sends (start, stop, speedSet),
+// integrate a first-order DC motor model and stream encoder counts back, while a rigid-body chassis integrates the robot's pose
+// from the wheel speeds. Time is simulated, so control loops run as fast as the host allows.
+//
+// The application's BoardHost forwards to the simulator and the host build takes its clock from it:
+//   void BoardHost::messageSend(CANMessage& message, uint8_t deviceNumber){ plant.frameSent(message); }
+//   void BoardHost::delayMs(uint16_t ms){ plant.run(ms); }
+//   uint32_t millis(){ return plant.nowUs() / 1000; }
+//   uint32_t micros(){ return plant.nowUs(); }
+// See plant-sim.cpp and plant-checks.cpp.
+
+#include <math.h>
+#include <algorithm>
+#include <deque>
+#include "mrm-board-discovery.h"
+
+#define MRM_SIM_MOTORS 8
+#define MRM_SIM_STEP_US 250 // Physics integration step
+
+/** DC or BLDC motor with a wheel: torque proportional to command, viscous losses, inertia. The defaults model a small geared DC motor:
+50 rad/s (about 480 rpm) at full command and a 50 ms time constant, so a speed change settles well within the 200 ms a control loop
+or MotorBoard::characterise() waits by default.
+*/
+struct SimMotor{
+	uint16_t canIdIn = 0; // Frames from MotorBoard
+	uint16_t canIdOut = 0; // Frames to MotorBoard
+	float gain = 1000; // Angular acceleration at full command with the motor stopped, rad/s^2
+	float damping = 20; // Back-EMF and friction, 1/s. No-load speed at full command is gain / damping rad/s, time constant 1 / damping s.
+	float countsPerRadian = 100;
+	uint8_t deadBand = 0; // Commands with a smaller magnitude don't overcome friction
+	float omega = 0; // rad/s
+	float angle = 0; // rad
+	int8_t command = 0; // -127 to 127, as sent by speedSet()
+	uint16_t refreshMs = 0; // 0 - not streaming
+	uint32_t nextReadingUs = 0;
+	uint32_t acquiredUs = 0; // Simulation's time of the last encoder frame
+	uint32_t commandUs = 0; // When the last changed command arrived, 0 - already answered
+	int32_t clockOffsetUs = 0; // Motor controller's clock minus simulation's at 0
+	float clockPpm = 0; // How much faster the controller's clock runs
+	bool timeStamps = false; // Answer time sync and append acquisition time to encoder frames
+	uint32_t serial = 0; // Distinguishes motors sharing an id, see COMMAND_DUPLICATE_ID_ECHO
+	uint8_t pnp = 1; // COMMAND_PNP_ENABLE or DISABLE state
+	uint16_t movingCanIdIn = 0; // After COMMAND_ID_CHANGE_REQUEST, the ids once stored, 0 - none
+	uint32_t movingUs = 0; // When they are stored
+	uint32_t rebootedUs = 0; // After COMMAND_RESET, the motor is silent until then
+	uint8_t resets = 0; // COMMAND_RESET received
+
+	/** Controller's micros()
+	@param us - simulation's time
+	*/
+	uint32_t clockUs(uint32_t us){ return us + clockOffsetUs + (int32_t)(clockPpm * us / 1e6f); }
+};
+
+enum SimChassisType {SIM_CHASSIS_STAR, SIM_CHASSIS_DIFFERENTIAL};
+
+/** Robot's pose in the field. x to the right, y forward at heading 0, heading in degrees, positive to the right.
+*/
+struct SimPose{
+	float x = 0;
+	float y = 0;
+	float heading = 0;
+};
+
+class PlantSim{
+	SimMotor motors[MRM_SIM_MOTORS];
+	uint8_t motorsCount = 0;
+	uint32_t now = 0; // us
+	struct Pending{
+		uint32_t dueUs;
+		CANMessage message;
+	};
+	std::deque<Pending> pending; // Frames on their way to MotorBoard
+	uint32_t latencySum = 0;
+	uint32_t latencyCount = 0;
+	uint32_t rxWindowUs = 0; // Start of the current rxBurst window
+	uint8_t rxCount = 0; // Frames in it
+	uint32_t lossState = 1; // Random generator for lossShare
+
+	/** Whether to lose a frame, see lossShare
+	@return - lost
+	*/
+	bool lost(){
+		if (lossShare <= 0)
+			return false;
+		lossState ^= lossState << 13; // xorshift32
+		lossState ^= lossState >> 17;
+		lossState ^= lossState << 5;
+		return lossState < lossShare * 4294967296.0;
+	}
+
+	/** Wheel's linear speed
+	@param i - wheel, in MotorGroup's order
+	@return - m/s
+	*/
+	float wheelSpeed(uint8_t i){ return i < motorsCount ? motors[i].omega * wheelRadius : 0; }
+
+	/** Integrate the chassis' pose from wheel speeds, in the wheel order MotorGroupStar and MotorGroupDifferential use
+	@param dt - s
+	*/
+	void chassisStep(float dt){
+		float forward, right, yawRate; // m/s and rad/s, yaw positive to the right
+		if (chassisType == SIM_CHASSIS_STAR) { // Inverse of MotorGroupStar::go(): wheels at 45, 135, -135 and -45 degrees
+			float rotation = (wheelSpeed(0) + wheelSpeed(1) + wheelSpeed(2) + wheelSpeed(3)) / 4;
+			float sinTheta = (wheelSpeed(0) - wheelSpeed(2)) / 2;
+			float cosTheta = (wheelSpeed(3) - wheelSpeed(1)) / 2;
+			float direction = atan2f(sinTheta, cosTheta) - 135 * M_PI / 180;
+			float speed = sqrtf(sinTheta * sinTheta + cosTheta * cosTheta);
+			forward = speed * cosf(direction);
+			right = speed * sinf(direction);
+			yawRate = rotation / chassisRadius;
+		}
+		else { // Motors 0 and 1 left, 2 and 3 right and mounted mirrored
+			float left = (wheelSpeed(0) + wheelSpeed(1)) / 2;
+			float rightWheels = -(wheelSpeed(2) + wheelSpeed(3)) / 2;
+			forward = (left + rightWheels) / 2;
+			right = 0;
+			yawRate = (left - rightWheels) / (2 * chassisRadius);
+		}
+		float headingRadians = pose.heading * M_PI / 180;
+		pose.x += (forward * sinf(headingRadians) + right * cosf(headingRadians)) * dt;
+		pose.y += (forward * cosf(headingRadians) - right * sinf(headingRadians)) * dt;
+		pose.heading = angleNormalized(pose.heading + yawRate * dt * 180 / M_PI);
+	}
+
+	/** Put a frame on the bus towards MotorBoard
+	@param canId - id
+	@param data - payload
+	@param dlc - length
+	*/
+	void reply(uint16_t canId, uint8_t* data, uint8_t dlc){ schedule(now + busLatencyUs, CANMessage(canId, data, dlc)); }
+
+	/** Queue a frame towards MotorBoard, in arrival order
+	@param dueUs - arrival
+	@param message - frame
+	*/
+	void schedule(uint32_t dueUs, const CANMessage& message){
+		if (lost())
+			return;
+		auto later = std::find_if(pending.begin(), pending.end(), [dueUs](const Pending& frame){ return (int32_t)(frame.dueUs - dueUs) > 0; });
+		pending.insert(later, {dueUs, message});
+	}
+
+public:
+	SimChassisType chassisType = SIM_CHASSIS_STAR;
+	float chassisRadius = 0.08; // Wheel to centre for star, half of track for differential, m
+	float wheelRadius = 0.025; // m
+	uint32_t busLatencyUs = 300; // Frame's time in controllers' queues and on the bus
+	uint8_t rxBurst = 0; // Frames the motors take in 1 ms, later ones are lost as by devices that miss frames sent back to back. 0 - no limit.
+	uint8_t echoCopies = 1; // COMMAND_CAN_TEST echoes for each probe, more emulate late duplicates
+	float lossShare = 0; // Frames lost at random in both directions, 0 - 1
+
+	/** Remove all the motors and the frames on their way, keeping the time
+	@param lossSeed - random generator's start for lossShare, not 0
+	*/
+	void clear(uint32_t lossSeed = 1){
+		motorsCount = 0;
+		pending.clear();
+		lossState = lossSeed;
+	}
+	SimPose pose;
+
+	/** Add a motor. The order must match MotorGroup's wheel order.
+	@param canIdIn - device's canIdIn, as in MotorBoard::add()
+	@param canIdOut - device's canIdOut
+	@return - motor, for setting its parameters
+	*/
+	SimMotor* motorAdd(uint16_t canIdIn, uint16_t canIdOut){
+		if (motorsCount >= MRM_SIM_MOTORS) {
+			sprintf(errorMessage, "Max. %i sim. motors", MRM_SIM_MOTORS);
+			return NULL;
+		}
+		SimMotor& motor = motors[motorsCount++];
+		motor = SimMotor();
+		motor.canIdIn = canIdIn;
+		motor.canIdOut = canIdOut;
+		motor.serial = 0x5EB0 + motorsCount;
+		return &motor;
+	}
+
+	/** A motor
+	@param canIdIn - its canIdIn
+	@return - the first one with the id, NULL - none
+	*/
+	SimMotor* motorGet(uint16_t canIdIn){
+		for (uint8_t i = 0; i < motorsCount; i++)
+			if (motors[i].canIdIn == canIdIn)
+				return &motors[i];
+		return NULL;
+	}
+
+	/** Average time from a changed speed command to the first encoder frame decoded after it, a measure of control latency
+	@return - us, 0 - no data
+	*/
+	uint32_t commandToReadingUs(){ return latencyCount == 0 ? 0 : latencySum / latencyCount; }
+
+	/** A frame MotorBoard sent, forwarded by BoardHost::messageSend(). All the motors with the frame's id take it.
+	@param message - frame
+	*/
+	void frameSent(CANMessage& message){
+		if (rxBurst != 0) {
+			if (now - rxWindowUs >= 1000) {
+				rxWindowUs = now;
+				rxCount = 0;
+			}
+			if (++rxCount > rxBurst)
+				return;
+		}
+		if (lost())
+			return;
+		for (uint8_t i = 0; i < motorsCount; i++)
+			if (motors[i].canIdIn == message.id && (int32_t)(now - motors[i].rebootedUs) >= 0)
+				motorFrame(&motors[i], message);
+	}
+
+	/** A motor takes a frame
+	@param motor - motor
+	@param message - frame
+	*/
+	void motorFrame(SimMotor* motor, CANMessage& message){
+		uint8_t data[8] = {message.data[0]};
+		switch (message.data[0]) {
+		case COMMAND_REPORT_ALIVE:
+			reply(motor->canIdOut, data, 1);
+			break;
+		case COMMAND_SENSORS_MEASURE_CONTINUOUS:
+		case COMMAND_SENSORS_MEASURE_CONTINUOUS_VERSION_2:
+		case COMMAND_SENSORS_MEASURE_CONTINUOUS_VERSION_3:
+			motor->refreshMs = message.dlc >= 3 ? (message.data[1] | (message.data[2] << 8)) : 10;
+			if (motor->refreshMs == 0)
+				motor->refreshMs = 10;
+			motor->nextReadingUs = now;
+			break;
+		case COMMAND_SENSORS_MEASURE_STOP:
+			motor->refreshMs = 0;
+			break;
+		case COMMAND_DUPLICATE_ID_PING: // Answers with its serial number
+			data[0] = COMMAND_DUPLICATE_ID_ECHO;
+			memcpy(data + 1, &motor->serial, 4);
+			reply(motor->canIdOut, data, 5);
+			break;
+		case COMMAND_CAN_TEST: // Echoed unchanged, repeats arrive later
+			for (uint8_t i = 0; i < echoCopies; i++)
+				schedule(now + busLatencyUs + i * 5000, CANMessage(motor->canIdOut, message.data, message.dlc));
+			break;
+		case COMMAND_TIME_SYNC_REQUEST:
+			if (motor->timeStamps) {
+				uint16_t turnaroundUs = 40;
+				uint32_t deviceUs = motor->clockUs(now + busLatencyUs / 2 + turnaroundUs);
+				uint8_t answer[8] = {COMMAND_TIME_SYNC_SENDING, (uint8_t)deviceUs, (uint8_t)(deviceUs >> 8), (uint8_t)(deviceUs >> 16), (uint8_t)(deviceUs >> 24),
+					(uint8_t)turnaroundUs, (uint8_t)(turnaroundUs >> 8)};
+				schedule(now + busLatencyUs + turnaroundUs, CANMessage(motor->canIdOut, answer, 7));
+			}
+			break;
+		case COMMAND_ID_CHANGE_REQUEST: { // Stored after 10 ms, still answering on the old ids meanwhile
+			uint8_t product = productIndex(motor->canIdIn);
+			if (product != 0xFF && message.dlc >= 2 && message.data[1] < MRM_PRODUCT_DEVICES) {
+				motor->movingCanIdIn = products[product].canIdBase + 2 * message.data[1];
+				motor->movingUs = now + 10000;
+			}
+			break;
+		}
+		case COMMAND_PNP_ENABLE:
+		case COMMAND_PNP_DISABLE:
+			motor->pnp = message.data[0] == COMMAND_PNP_ENABLE;
+			break;
+		case COMMAND_PNP_REQUEST:
+			data[0] = COMMAND_PNP_SENDING;
+			data[1] = motor->pnp;
+			reply(motor->canIdOut, data, 2);
+			break;
+		case COMMAND_RESET: // Reboots in 300 ms
+			motor->rebootedUs = now + 300000;
+			motor->refreshMs = 0;
+			motor->command = 0;
+			motor->resets++;
+			break;
+		case COMMAND_SPEED_SET: {
+			int8_t command = (int16_t)message.data[1] - 128;
+			if (command != motor->command && motor->commandUs == 0)
+				motor->commandUs = now;
+			motor->command = command;
+			break;
+		}
+		}
+	}
+
+	/** Current simulated time
+	@return - us
+	*/
+	uint32_t nowUs(){ return now; }
+
+	/** Advance the simulation, delivering due frames to the boards
+	@param ms - simulated time
+	*/
+	void run(uint16_t ms){
+		uint32_t end = now + ms * 1000;
+		while ((int32_t)(end - now) > 0) {
+			float dt = MRM_SIM_STEP_US / 1e6;
+			for (uint8_t i = 0; i < motorsCount; i++) {
+				SimMotor& motor = motors[i];
+				int8_t command = abs(motor.command) < motor.deadBand ? 0 : motor.command;
+				motor.omega += (motor.gain * command / 127 - motor.damping * motor.omega) * dt;
+				motor.angle += motor.omega * dt;
+				if (motor.movingCanIdIn != 0 && (int32_t)(now - motor.movingUs) >= 0) {
+					motor.canIdIn = motor.movingCanIdIn;
+					motor.canIdOut = motor.movingCanIdIn + 1;
+					motor.movingCanIdIn = 0;
+				}
+				if (motor.refreshMs != 0 && (int32_t)(now - motor.nextReadingUs) >= 0) {
+					motor.nextReadingUs += motor.refreshMs * 1000;
+					int32_t count = (int32_t)(motor.angle * motor.countsPerRadian);
+					motor.acquiredUs = now;
+					uint32_t acquiredUs = motor.clockUs(now);
+					uint8_t data[8] = {COMMAND_SENSORS_MEASURE_SENDING, (uint8_t)count, (uint8_t)(count >> 8), (uint8_t)(count >> 16), (uint8_t)(count >> 24),
+						(uint8_t)acquiredUs, (uint8_t)(acquiredUs >> 8)};
+					reply(motor.canIdOut, data, motor.timeStamps ? 7 : 5);
+				}
+			}
+			chassisStep(dt);
+			now += MRM_SIM_STEP_US;
+
+			while (!pending.empty() && (int32_t)(now - pending.front().dueUs) >= 0) {
+				CANMessage message = pending.front().message;
+				pending.pop_front();
+				for (uint8_t i = 0; i < motorsCount; i++)
+					if (motors[i].canIdOut == message.id && motors[i].commandUs != 0 && message.data[0] == COMMAND_SENSORS_MEASURE_SENDING) {
+						latencySum += now - motors[i].commandUs;
+						latencyCount++;
+						motors[i].commandUs = 0;
+					}
+				Board::messageDecodeAll(message);
+			}
+		}
+	}
+};
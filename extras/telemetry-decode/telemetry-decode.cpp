@@ -0,0 +1,73 @@
+// Decodes a binary telemetry stream (Telemetry) into CSV: robot's time in ms, alive devices, then a column for each channel.
+// Reads a file or, with "-", standard input, so a robot's serial port can be decoded live. Bytes that are not records,
+// like print() text on the same port, are skipped.
+//
+// Build on Linux, with a host Arduino compatibility layer providing Arduino.h, millis() and micros():
+//   g++ -O2 -std=gnu++17 -I../../src -I<host-arduino> telemetry-decode.cpp ../../src/*.cpp -o telemetry-decode
+// Usage:
+//   telemetry-decode <file | -> [every Nth record]
+//   stty -F /dev/ttyUSB0 115200 raw && telemetry-decode - < /dev/ttyUSB0
+
+#include "mrm-board-telemetry.h"
+
+// Quiet host: no boards are used, only the decoder.
+void BoardHost::delayMs(uint16_t ms){}
+void BoardHost::end(){}
+void BoardHost::errorAdd(CANMessage& message, uint8_t errorCode, bool peripheral, bool printNow){}
+void BoardHost::messagePrint(CANMessage& message, Board* board, uint8_t deviceNumber, bool outbound, bool clientInitiated, std::string postfix){}
+void BoardHost::messageSend(CANMessage& message, uint8_t deviceNumber){}
+void BoardHost::noLoopWithoutThis(){}
+uint16_t BoardHost::serialReadNumber(uint16_t timeoutFirst, uint16_t timeoutBetween, bool onlySingleDigitInput, uint16_t limit, bool printWarnings){ return 0xFFFF; }
+bool BoardHost::setup(){ return true; }
+bool BoardHost::userBreak(){ return false; }
+
+static TelemetryDecoder decoder;
+
+int main(int argc, char* argv[]){
+	if (argc < 2) {
+		printf("Usage: %s <file | -> [every Nth record]\n", argv[0]);
+		return 1;
+	}
+	FILE* file = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "rb");
+	if (file == NULL) {
+		printf("Cannot open %s\n", argv[1]);
+		return 1;
+	}
+	uint32_t every = argc > 2 ? atoi(argv[2]) : 1;
+	if (every == 0)
+		every = 1;
+
+	uint32_t records = 0;
+	uint64_t bytes = 0;
+	int byte;
+	while ((byte = fgetc(file)) != EOF) {
+		bytes++;
+		if (!decoder.feed(byte))
+			continue;
+		if (decoder.catalogChanged) { // Header line
+			decoder.catalogChanged = false;
+			printf("ms,alive");
+			for (uint8_t i = 0; i < decoder.channelsCount; i++) {
+				char name[32];
+				decoder.channelName(i, name);
+				printf(",%s", name);
+			}
+			printf("\n");
+		}
+		if (records++ % every != 0)
+			continue;
+		uint8_t alive = 0;
+		for (uint8_t i = 0; i < decoder.devicesCount; i++)
+			alive += decoder.isAlive(i);
+		printf("%u,%u", decoder.timeMs, alive);
+		for (uint8_t i = 0; i < decoder.channelsCount; i++)
+			printf(",%i", decoder.values[i]);
+		printf("\n");
+		if (file == stdin)
+			fflush(stdout);
+	}
+	fprintf(stderr, "%u records, %.1f bytes each, %u lost, %u corrupted\n", records, records == 0 ? 0 : (double)bytes / records, decoder.lost, decoder.corrupted);
+	if (file != stdin)
+		fclose(file);
+	return 0;
+}
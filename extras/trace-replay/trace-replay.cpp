@@ -0,0 +1,102 @@
+// Replays a binary frame trace (FrameTrace::dump()) through Board decoders on a host computer, at full speed.
+// Used to reproduce field incidents and to benchmark decoding on real traffic.
+//
+// Build on Linux, with a host Arduino compatibility layer providing Arduino.h, millis() and micros():
+//   g++ -O2 -std=gnu++17 -I../../src -I<host-arduino> trace-replay.cpp ../../src/*.cpp -o trace-replay
+// Usage:
+//   trace-replay <trace file> [repeats] [topology blob]
+// The boards are built from the traced robot's topology blob (Topology::save()). Without one, a board of every product with a
+// registered class (Discovery::factoryRegister(), motor controllers by default) gets all its ids on all buses.
+
+#include <chrono>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "mrm-board.h"
+#include "mrm-board-discovery.h"
+
+static uint32_t errors = 0;
+
+// Quiet host: nothing is sent, nothing is printed, errors are only counted.
+void BoardHost::delayMs(uint16_t ms){}
+void BoardHost::end(){}
+void BoardHost::errorAdd(CANMessage& message, uint8_t errorCode, bool peripheral, bool printNow){ errors++; }
+void BoardHost::messagePrint(CANMessage& message, Board* board, uint8_t deviceNumber, bool outbound, bool clientInitiated, std::string postfix){}
+void BoardHost::messageSend(CANMessage& message, uint8_t deviceNumber){}
+void BoardHost::noLoopWithoutThis(){}
+uint16_t BoardHost::serialReadNumber(uint16_t timeoutFirst, uint16_t timeoutBetween, bool onlySingleDigitInput, uint16_t limit, bool printWarnings){ return 0xFFFF; }
+bool BoardHost::setup(){ return true; }
+bool BoardHost::userBreak(){ return false; }
+
+int main(int argc, char* argv[]){
+	if (argc < 2) {
+		printf("Usage: %s <trace file> [repeats] [topology blob]\n", argv[0]);
+		return 1;
+	}
+	uint32_t repeats = argc > 2 ? atoi(argv[2]) : 1;
+
+	int file = open(argv[1], O_RDONLY);
+	struct stat status;
+	if (file < 0 || fstat(file, &status) != 0) {
+		printf("Cannot open %s\n", argv[1]);
+		return 1;
+	}
+	const uint8_t* buffer = (const uint8_t*)mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	if (buffer == MAP_FAILED) {
+		printf("Cannot map %s\n", argv[1]);
+		return 1;
+	}
+
+	// Boards to decode with
+	if (argc > 3) {
+		static uint8_t blob[MRM_TOPOLOGY_BYTES];
+		FILE* topology = fopen(argv[3], "rb");
+		if (topology == NULL) {
+			printf("Cannot open %s\n", argv[3]);
+			return 1;
+		}
+		uint16_t length = fread(blob, 1, MRM_TOPOLOGY_BYTES, topology);
+		fclose(topology);
+		uint8_t expected = length > 5 ? blob[5] : 0;
+		uint8_t created = Topology::boardsCreate(blob, length);
+		if (created != expected || created == 0) {
+			printf("%s: %s\n", argv[3], errorMessage);
+			if (created == 0)
+				return 1;
+		}
+		else if (!Topology::deserialize(blob, length))
+			printf("%s not applied, devices keep their ids\n", argv[3]);
+	}
+	else
+		for (uint8_t i = 0; i < productsCount; i++) {
+			Board* board = Discovery::boardCreate(products[i]);
+			if (board != NULL)
+				for (uint8_t bus = 0; bus < MRM_CAN_BUSES; bus++)
+					for (uint8_t n = 0; n < MRM_PRODUCT_DEVICES; n++)
+						Discovery::deviceAdd(board, i, n, bus);
+		}
+	Board** boards = Board::boards;
+	uint8_t boardsCount = Board::boardsCount;
+	printf("%i boards,", boardsCount);
+	for (uint8_t i = 0; i < boardsCount; i++)
+		printf(" %s (%i)", boards[i]->name().c_str(), (int)boards[i]->devices.size());
+	printf("\n");
+
+	uint32_t replayed = 0;
+	uint32_t unclaimed = 0;
+	auto startTime = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < repeats; i++)
+		replayed += FrameTrace::replay(buffer, status.st_size, boards, boardsCount, &unclaimed);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+	if (replayed == 0) {
+		printf("%s is not a valid trace\n", argv[1]);
+		return 1;
+	}
+	printf("%u inbound frames, %u unclaimed (last pass), %u decode errors\n", replayed, unclaimed, errors);
+	printf("%.3f s, %.0f frames/s, %.1f ns/frame\n", seconds, replayed / seconds, seconds * 1e9 / replayed);
+	munmap((void*)buffer, status.st_size);
+	close(file);
+	return 0;
+}
@@ -0,0 +1,124 @@
+#include "mrm-board-bus.h"
+#include "mrm-board.h"
+#include <algorithm>
+
+/** Utilisation, refreshed each MRM_BUS_LOAD_WINDOW_MS. Any thread may call it: the one that ends a window computes it.
+@return - 0 - 1000, 1000 is a saturated bus
+*/
+uint16_t BusLoad::loadPerMille(){
+	uint32_t nowMs = millis();
+	uint32_t startMs = windowStartMs.load(std::memory_order_relaxed);
+	uint32_t elapsedMs = nowMs - startMs;
+	if (elapsedMs >= MRM_BUS_LOAD_WINDOW_MS && windowStartMs.compare_exchange_strong(startMs, nowMs, std::memory_order_relaxed)) { // This thread ends the window.
+		uint64_t windowBits = bits.exchange(0, std::memory_order_relaxed);
+		uint64_t load = windowBits * 1000 * 1000 / ((uint64_t)MRM_CAN_BITRATE * elapsedMs);
+		_loadPerMille.store(load > 1000 ? 1000 : load, std::memory_order_relaxed);
+	}
+	return _loadPerMille.load(std::memory_order_relaxed);
+}
+
+
+/** Restart streaming of all alive devices of governed boards with calculated refresh periods. Non-blocking: the frames leave
+through the paced queue, so follow with poll() until it returns 0.
+@param targetPerMille - target load, 0 - 1000
+@return - number of devices restarted
+*/
+uint16_t BusGovernor::apply(uint16_t targetPerMille){
+	if (budgetPerMille == 0)
+		budgetPerMille = targetPerMille;
+	// Each bus' bandwidth is shared only by the devices on it.
+	uint32_t weightsSum[MRM_CAN_BUSES] = {};
+	for (uint8_t i = 0; i < Board::boardsCount; i++)
+		for (Device& device : Board::boards[i]->devices)
+			if (device.alive)
+				weightsSum[device.bus] += Board::boards[i]->busWeight;
+
+	uint16_t restarted = 0;
+	for (uint8_t i = 0; i < Board::boardsCount; i++) {
+		Board* board = Board::boards[i];
+		if (board->busWeight == 0)
+			continue;
+		// A board's devices on the same bus get the same period, so one batch per bus.
+		for (uint8_t bus = 0; bus < MRM_CAN_BUSES; bus++) {
+			Device* first = nullptr;
+			for (Device& device : board->devices)
+				if (device.alive && device.bus == bus) {
+					if (first == nullptr)
+						first = &device;
+					restarted++;
+				}
+			if (first != nullptr)
+				board->startBatch(first->measuringMode, refreshMs(board->busWeight, weightsSum[bus], budgetPerMille), bus);
+		}
+	}
+	return restarted;
+}
+
+/** Advance the batch starts apply() queued. Non-blocking, call it from the loop.
+@return - devices still pending
+*/
+uint16_t BusGovernor::poll(){
+	uint16_t pending = 0;
+	for (uint8_t i = 0; i < Board::boardsCount; i++)
+		if (Board::boards[i]->busWeight != 0)
+			pending += Board::boards[i]->startPoll();
+	return pending;
+}
+
+/** Compare the busiest bus' measured load to the target and, if off by more than 10 %, correct the budget and apply() again. Call it periodically.
+@param targetPerMille - target load, 0 - 1000
+@return - reapplied
+*/
+bool BusGovernor::adapt(uint16_t targetPerMille){
+	uint16_t measured = 0;
+	for (uint8_t bus = 0; bus < MRM_CAN_BUSES; bus++) {
+		uint16_t load = Board::busLoad[bus].loadPerMille();
+		if (load > measured)
+			measured = load;
+	}
+	if (measured == 0 || budgetPerMille == 0 || abs((int32_t)measured - targetPerMille) * 10 < targetPerMille)
+		return false;
+	uint32_t corrected = (uint32_t)budgetPerMille * targetPerMille / measured;
+	budgetPerMille = corrected < 10 ? 10 : (corrected > 1000 ? 1000 : corrected);
+	apply(targetPerMille);
+	return true;
+}
+
+/** Refresh period for a device of a board
+@param weight - board's weight
+@param weightsSum - sum of weights of all the governed devices on the same bus
+@param budgetPerMille - load to share
+@return - ms
+*/
+uint16_t BusGovernor::refreshMs(uint8_t weight, uint32_t weightsSum, uint16_t budgetPerMille){
+	// Device's share in bits/s, for full 8-byte readings frames.
+	uint64_t bitsPerSecond = (uint64_t)MRM_CAN_BITRATE * budgetPerMille / 1000 * weight / weightsSum;
+	if (bitsPerSecond == 0)
+		return maximumRefreshMs;
+	uint64_t refresh = (BusLoad::frameBits(8) * 1000 + bitsPerSecond - 1) / bitsPerSecond;
+	if (refresh < minimumRefreshMs)
+		return minimumRefreshMs;
+	else if (refresh > maximumRefreshMs)
+		return maximumRefreshMs;
+	else
+		return refresh;
+}
+
+
+/** Statistics of the samples taken while the load was in a range
+@param loadFromPerMille - lowest load, inclusive
+@param loadToPerMille - highest load, exclusive. 1001 includes a saturated bus.
+@return - count 0 if there are no such samples
+*/
+LatencyProbe::Result LatencyProbe::result(uint16_t loadFromPerMille, uint16_t loadToPerMille){
+	uint32_t sorted[MRM_LATENCY_SAMPLES];
+	uint16_t n = 0;
+	uint16_t published = count.load(std::memory_order_acquire);
+	for (uint16_t i = 0; i < published; i++)
+		if (samples[i].loadPerMille >= loadFromPerMille && samples[i].loadPerMille < loadToPerMille)
+			sorted[n++] = samples[i].roundTripUs;
+	if (n == 0)
+		return {0, 0, 0, 0};
+	std::sort(sorted, sorted + n);
+	return {n, sorted[0], sorted[n / 2], sorted[(n * 99 - 1) / 100]};
+}
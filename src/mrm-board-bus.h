@@ -0,0 +1,170 @@
+#pragma once
+
+#include "Arduino.h"
+#include <atomic>
+#include <cstring>
+
+// CAN Bus utilisation estimate, from the frames actually sent and decoded, and a governor that assigns refresh rates to devices.
+
+#ifndef MRM_CAN_BITRATE
+#define MRM_CAN_BITRATE 1000000 // bits/s
+#endif
+#ifndef MRM_CAN_FD_DATA_BITRATE
+#define MRM_CAN_FD_DATA_BITRATE 2000000 // bits/s, data phase of CAN FD frames, with bit rate switching
+#endif
+#define MRM_BUS_LOAD_WINDOW_MS 100 // Utilisation is averaged over this period
+#ifndef MRM_LATENCY_SAMPLES
+#define MRM_LATENCY_SAMPLES 128 // Round-trip samples kept by LatencyProbe
+#endif
+
+struct Device;
+
+/** Bus utilisation estimator
+*/
+class BusLoad{
+	std::atomic<uint32_t> bits; // In the current window
+	std::atomic<uint32_t> windowStartMs;
+	std::atomic<uint16_t> _loadPerMille; // Last complete window
+
+public:
+	BusLoad(){
+		bits.store(0, std::memory_order_relaxed);
+		windowStartMs.store(0, std::memory_order_relaxed);
+		_loadPerMille.store(0, std::memory_order_relaxed);
+	}
+
+	/** Count a frame, sent or received
+	@param dlc - data length
+	*/
+	void add(uint8_t dlc){ bits.fetch_add(frameBits(dlc), std::memory_order_relaxed); }
+
+	/** Bits on the wire for a classic frame with an 11-bit id: 47 overhead bits, data and worst-case bit stuffing.
+	@param dlc - data length
+	@return - bits
+	*/
+	static uint16_t frameBits(uint8_t dlc){ return 47 + 8 * dlc + (34 + 8 * dlc - 1) / 4; }
+
+	/** Count a CAN FD frame, sent or received
+	@param length - payload length, 0 - 64
+	*/
+	void addFD(uint8_t length){ bits.fetch_add(frameBitsFD(length), std::memory_order_relaxed); }
+
+	/** Bus time of a CAN FD frame with an 11-bit id, in nominal bit times. Arbitration and the tail (34 bits with stuffing) run at
+	MRM_CAN_BITRATE; ESI, DLC, data, stuff count and CRC (17 bits up to 16 bytes, 21 above) run at MRM_CAN_FD_DATA_BITRATE, with worst-case
+	stuffing of the data and the fixed stuff bits of the CRC.
+	@param length - payload length, 0 - 64
+	@return - bits
+	*/
+	static uint16_t frameBitsFD(uint8_t length){
+		uint16_t crcBits = length > 16 ? 21 : 17;
+		uint32_t dataBits = 5 + 8 * length + (4 + 8 * length) / 4 + 4 + crcBits + (4 + crcBits) / 4;
+		return 34 + ((uint64_t)dataBits * MRM_CAN_BITRATE + MRM_CAN_FD_DATA_BITRATE - 1) / MRM_CAN_FD_DATA_BITRATE;
+	}
+
+	/** Utilisation, refreshed each MRM_BUS_LOAD_WINDOW_MS. Any thread may call it: the one that ends a window computes it.
+	@return - 0 - 1000, 1000 is a saturated bus
+	*/
+	uint16_t loadPerMille();
+};
+
+/** Assigns refresh rates to devices of all the boards, so that streaming readings stays under a target utilisation of each bus.
+Each board's share is proportional to its Board::busWeight. Boards with weight 0 are not governed.
+*/
+class BusGovernor{
+	uint16_t budgetPerMille = 0; // Load used for calculation, corrected by adapt()
+
+public:
+	uint16_t minimumRefreshMs = 1;
+	uint16_t maximumRefreshMs = 1000;
+
+	/** Restart streaming of all alive devices of governed boards with calculated refresh periods. Non-blocking: the frames leave
+	through the paced queue, so follow with poll() until it returns 0.
+	@param targetPerMille - target load, 0 - 1000
+	@return - number of devices restarted
+	*/
+	uint16_t apply(uint16_t targetPerMille);
+
+	/** Compare the busiest bus' measured load to the target and, if off by more than 10 %, correct the budget and apply() again. Call it periodically.
+	@param targetPerMille - target load, 0 - 1000
+	@return - reapplied
+	*/
+	bool adapt(uint16_t targetPerMille);
+
+	/** Advance the batch starts apply() queued. Non-blocking, call it from the loop.
+	@return - devices still pending
+	*/
+	uint16_t poll();
+
+	/** Refresh period for a device of a board
+	@param weight - board's weight
+	@param weightsSum - sum of weights of all the governed devices on the same bus
+	@param budgetPerMille - load to share
+	@return - ms
+	*/
+	uint16_t refreshMs(uint8_t weight, uint32_t weightsSum, uint16_t budgetPerMille);
+};
+
+/** Round-trip times of COMMAND_CAN_TEST frames, echoed by a device, with the bus load at the time of each sample. The thread sending probes
+and the one decoding echoes, a DecodeShards worker, may differ: outstanding probes and the samples' count are atomic.
+*/
+class LatencyProbe{
+	struct Sample{
+		uint32_t roundTripUs;
+		uint16_t loadPerMille;
+	};
+	Sample samples[MRM_LATENCY_SAMPLES];
+	std::atomic<uint16_t> count{0}; // Samples published to result()
+	std::atomic<uint32_t> outstanding[8] = {}; // Bit for each sequence number sent and not echoed yet
+
+public:
+	struct Result{
+		uint16_t count;
+		uint32_t minimumUs;
+		uint32_t medianUs;
+		uint32_t p99Us;
+	};
+
+	Device* device = NULL; // Device being probed, NULL - probe inactive
+	uint8_t sequence = 0; // Last sent probe's sequence number
+
+	/** Store a sample, if there is room. Only the thread decoding the probed device's frames calls it.
+	@param roundTripUs - round-trip time
+	@param loadPerMille - bus load
+	*/
+	void add(uint32_t roundTripUs, uint16_t loadPerMille){
+		uint16_t n = count.load(std::memory_order_relaxed);
+		if (n < MRM_LATENCY_SAMPLES) {
+			samples[n] = {roundTripUs, loadPerMille};
+			count.store(n + 1, std::memory_order_release);
+		}
+	}
+
+	/** Forget samples and outstanding probes. Call it before probing, not while echoes are decoded.
+	*/
+	void clear(){
+		count.store(0, std::memory_order_relaxed);
+		for (std::atomic<uint32_t>& word : outstanding)
+			word.store(0, std::memory_order_relaxed);
+	}
+
+	/** Match an echo to its probe, once
+	@param sequence - echoed sequence number
+	@return - the probe is outstanding. False for duplicates and echoes of probes from before clear().
+	*/
+	bool echoed(uint8_t sequence){
+		uint32_t bit = 1u << (sequence & 31);
+		return outstanding[sequence >> 5].fetch_and(~bit, std::memory_order_relaxed) & bit;
+	}
+
+	/** Mark a probe as waiting for its echo
+	@param sequence - its sequence number
+	*/
+	void sent(uint8_t sequence){ outstanding[sequence >> 5].fetch_or(1u << (sequence & 31), std::memory_order_relaxed); }
+
+	/** Statistics of the samples taken while the load was in a range
+	@param loadFromPerMille - lowest load, inclusive
+	@param loadToPerMille - highest load, exclusive. 1001 includes a saturated bus.
+	@return - count 0 if there are no such samples
+	*/
+	Result result(uint16_t loadFromPerMille = 0, uint16_t loadToPerMille = 1001);
+};
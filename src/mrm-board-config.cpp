@@ -0,0 +1,402 @@
+#include "mrm-board-config.h"
+
+ConfigStep ConfigBatch::steps[MRM_CONFIG_STEPS];
+uint8_t ConfigBatch::stepsCount = 0;
+bool (*ConfigBatch::previousDecode)(CANMessage& message) = NULL;
+
+/** Queue a step
+@param board - board
+@param deviceNumber - device
+@param operation - ConfigOperation
+@param argument - new device number or PnP state
+@return - the step, NULL if the queue is full or there is no such device
+*/
+ConfigStep* ConfigBatch::add(Board* board, uint8_t deviceNumber, ConfigOperation operation, uint8_t argument){
+	if (stepsCount >= MRM_CONFIG_STEPS) {
+		sprintf(errorMessage, "Max. %i config steps", MRM_CONFIG_STEPS);
+		return NULL;
+	}
+	if (board == NULL || board->deviceGet(deviceNumber) == nullptr) {
+		sprintf(errorMessage, "Config: no device %i", deviceNumber);
+		return NULL;
+	}
+	ConfigStep& step = steps[stepsCount++];
+	step = ConfigStep();
+	step.board = board;
+	step.deviceNumber = deviceNumber;
+	step.operation = operation;
+	step.argument = argument;
+	step.state = CONFIG_SEND;
+	step.failure = "";
+	return &step;
+}
+
+/** Device holding a step's new id, other than step's device
+@param step - step
+@return - holder, nullptr - none
+*/
+Device* ConfigBatch::holderGet(ConfigStep& step){
+	Device* device = step.board->deviceGet(step.deviceNumber);
+	for (uint8_t i = 0; i < Board::boardsCount; i++)
+		for (Device& other : Board::boards[i]->devices)
+			if (other.canIdIn == step.canIdIn && other.bus == device->bus && &other != device)
+				return &other;
+	return nullptr;
+}
+
+/** Queue a change of device's number. On success, device's CAN Bus ids are updated. If DecodeShards are used, call their assign() after.
+The new number may be another device's, if that one's number is changed in the same batch, for example to swap 2 devices.
+@param board - board
+@param deviceNumber - device
+@param newNumber - new device number, selecting ids in its product's range, 0 - MRM_PRODUCT_DEVICES - 1
+@return - queued
+*/
+bool ConfigBatch::idChange(Board* board, uint8_t deviceNumber, uint8_t newNumber){
+	Device* device = board == NULL ? nullptr : board->deviceGet(deviceNumber);
+	if (device == nullptr) {
+		sprintf(errorMessage, "Config: no device %i", deviceNumber);
+		return false;
+	}
+	uint8_t product = productIndex(device->canIdIn);
+	if (product == 0xFF || newNumber >= MRM_PRODUCT_DEVICES) {
+		sprintf(errorMessage, "%s: no id %i", device->name.c_str(), newNumber);
+		return false;
+	}
+	uint16_t canIdIn = products[product].canIdBase + 2 * newNumber;
+
+	// No other step may request the same ids. Ids of another device are checked in run(), as that one's change may be queued later.
+	for (uint8_t i = 0; i < stepsCount; i++)
+		if (steps[i].operation == CONFIG_ID_CHANGE && (steps[i].canIdIn == canIdIn || steps[i].finalCanIdIn == canIdIn) &&
+			steps[i].state != CONFIG_FAILED) {
+			sprintf(errorMessage, "%s: id already requested", device->name.c_str());
+			return false;
+		}
+
+	ConfigStep* step = add(board, deviceNumber, CONFIG_ID_CHANGE, newNumber);
+	if (step == NULL)
+		return false;
+	step->canIdIn = canIdIn;
+	step->state = canIdIn == device->canIdIn ? CONFIG_DONE : CONFIG_CHECK;
+	return true;
+}
+
+/** Queued id change of a device
+@param device - device
+@return - step, NULL - none
+*/
+ConfigStep* ConfigBatch::idChangeGet(Device& device){
+	for (uint8_t i = 0; i < stepsCount; i++)
+		if (steps[i].operation == CONFIG_ID_CHANGE && steps[i].board->deviceGet(steps[i].deviceNumber) == &device)
+			return &steps[i];
+	return NULL;
+}
+
+/** Catches answers from ids no board has, installed as Board::unclaimedDecode during run()
+*/
+bool ConfigBatch::messageDecode(CANMessage& message){
+	if (message.data[0] == COMMAND_REPORT_ALIVE)
+		for (uint8_t i = 0; i < stepsCount; i++)
+			if (steps[i].operation == CONFIG_ID_CHANGE && message.id == steps[i].canIdIn + 1u &&
+				(steps[i].state == CONFIG_CHECK || steps[i].state == CONFIG_VERIFY) &&
+				(Board::rxBus == 0xFF || Board::rxBus == steps[i].board->devices[steps[i].deviceNumber].bus)) {
+				steps[i].answered = true;
+				return true;
+			}
+	return previousDecode != NULL && previousDecode(message);
+}
+
+/** Queue a PnP change
+@param board - board
+@param deviceNumber - device
+@param enable - PnP on or off
+@return - queued
+*/
+bool ConfigBatch::pnpSet(Board* board, uint8_t deviceNumber, bool enable){
+	return add(board, deviceNumber, CONFIG_PNP, enable) != NULL;
+}
+
+/** Print the steps and their results
+*/
+void ConfigBatch::print(){
+	static const char* operations[] = {"id change", "PnP", "reset"};
+	static const char* states[] = {"wait", "check", "send", "settle", "verify", "done", "failed"};
+	for (uint8_t i = 0; i < stepsCount; i++) {
+		ConfigStep& step = steps[i];
+		Device* device = step.board->deviceGet(step.deviceNumber);
+		::print("%s %s %i: %s, %i tries %s\n\r", device == nullptr ? "?" : device->name.c_str(), operations[step.operation], step.argument,
+			states[step.state], step.tries, step.failure);
+	}
+}
+
+/** Send a frame to an id no device may have yet
+@param canId - id
+@param data - payload
+@param dlc - length
+@param bus - bus index
+*/
+void ConfigBatch::rawSend(uint16_t canId, uint8_t* data, uint8_t dlc, uint8_t bus){
+	CANMessage message(canId, data, dlc);
+	if (BusRouter::transportExists(bus))
+		BusRouter::transportSend(message, bus);
+	else
+		BoardHost::messageSend(message, 0xFF);
+}
+
+/** Queue a reset
+@param board - board
+@param deviceNumber - device
+@return - queued
+*/
+bool ConfigBatch::reset(Board* board, uint8_t deviceNumber){
+	return add(board, deviceNumber, CONFIG_RESET, 0) != NULL;
+}
+
+/** Process all the queued steps concurrently, until all are done or failed
+@param timeoutMs - give up the rest after this
+@return - steps done
+*/
+uint8_t ConfigBatch::run(uint32_t timeoutMs){
+	previousDecode = Board::unclaimedDecode;
+	Board::unclaimedDecode = messageDecode;
+	uint32_t startMs = millis();
+	for (uint8_t i = 0; i < stepsCount; i++) {
+		steps[i].untilMs = startMs;
+		Device* holder = steps[i].operation == CONFIG_ID_CHANGE && steps[i].state == CONFIG_CHECK ? holderGet(steps[i]) : nullptr;
+		if (holder != nullptr) { // Taken: through a temporary id, if the holder moves too
+			ConfigStep* holderStep = idChangeGet(*holder);
+			if (holderStep == NULL || holderStep->state == CONFIG_DONE || holderStep->state == CONFIG_FAILED) {
+				steps[i].state = CONFIG_FAILED;
+				steps[i].failure = "id taken";
+			}
+			else if (!temporaryMove(steps[i])) {
+				steps[i].state = CONFIG_FAILED;
+				steps[i].failure = "no free temporary id";
+			}
+		}
+	}
+	while (true) {
+		uint8_t pending = 0;
+		uint8_t sent = 0;
+		for (uint8_t i = 0; i < stepsCount; i++)
+			if (steps[i].state != CONFIG_DONE && steps[i].state != CONFIG_FAILED) {
+				pending++;
+				if (sent < MRM_CONFIG_BURST) // Others wait for the next round
+					sent += stepRun(steps[i], millis());
+			}
+		if (pending == 0)
+			break;
+		if (millis() - startMs > timeoutMs) {
+			for (uint8_t i = 0; i < stepsCount; i++)
+				if (steps[i].state != CONFIG_DONE && steps[i].state != CONFIG_FAILED) {
+					steps[i].state = CONFIG_FAILED;
+					steps[i].failure = "timeout";
+				}
+			break;
+		}
+		BoardHost::delayMs(1); // Answers are decoded meanwhile.
+	}
+	Board::unclaimedDecode = previousDecode;
+
+	uint8_t done = 0;
+	for (uint8_t i = 0; i < stepsCount; i++)
+		done += steps[i].state == CONFIG_DONE;
+	return done;
+}
+
+/** Advance a step
+@param step - step
+@param nowMs - millis()
+@return - frames sent
+*/
+uint8_t ConfigBatch::stepRun(ConfigStep& step, uint32_t nowMs){
+	Device& device = *step.board->deviceGet(step.deviceNumber);
+	switch (step.state) {
+	case CONFIG_WAIT: { // On a temporary id, until the requested one's holder moves away
+		Device* holder = holderGet(step);
+		if (holder == nullptr)
+			step.state = CONFIG_CHECK;
+		else {
+			ConfigStep* holderStep = idChangeGet(*holder);
+			if (holderStep == NULL || holderStep->state == CONFIG_DONE || holderStep->state == CONFIG_FAILED) {
+				step.state = CONFIG_FAILED;
+				step.failure = "id taken";
+			}
+		}
+		return 0;
+	}
+	case CONFIG_CHECK: // Must be silent: new ids before an id change, old ones just after a reset
+		if (step.pings > 0 && (step.operation == CONFIG_RESET ? device.alive : step.answered)) {
+			if (step.operation == CONFIG_RESET)
+				step.state = CONFIG_SEND; // Did not reboot
+			else {
+				step.state = CONFIG_FAILED;
+				step.failure = "new id answers";
+			}
+			return 0;
+		}
+		if ((int32_t)(nowMs - step.untilMs) < 0)
+			return 0;
+		if (step.pings < (step.operation == CONFIG_RESET ? 1 : MRM_CONFIG_PINGS)) {
+			uint8_t data[1] = {COMMAND_REPORT_ALIVE};
+			step.answered = false;
+			step.pings++;
+			step.untilMs = nowMs + MRM_CONFIG_ANSWER_MS;
+			if (step.operation == CONFIG_RESET) {
+				device.alive = false;
+				step.board->messageSend(data, 1, step.deviceNumber);
+			}
+			else
+				rawSend(step.canIdIn, data, 1, device.bus);
+			return 1;
+		}
+		step.pings = 0;
+		if (step.operation == CONFIG_RESET) {
+			step.state = CONFIG_SETTLE;
+			step.untilMs = nowMs + MRM_CONFIG_RESET_MS - MRM_CONFIG_ANSWER_MS;
+		}
+		else
+			step.state = CONFIG_SEND;
+		return 0;
+	case CONFIG_SEND: {
+		if (step.tries >= MRM_CONFIG_TRIES) {
+			step.state = CONFIG_FAILED;
+			step.failure = "not verified";
+			return 0;
+		}
+		uint8_t data[2];
+		uint8_t dlc = 1;
+		switch (step.operation) {
+		case CONFIG_ID_CHANGE:
+			data[0] = COMMAND_ID_CHANGE_REQUEST;
+			data[1] = step.argument;
+			dlc = 2;
+			break;
+		case CONFIG_PNP:
+			data[0] = step.argument ? COMMAND_PNP_ENABLE : COMMAND_PNP_DISABLE;
+			data[1] = step.argument;
+			dlc = 2;
+			break;
+		default:
+			data[0] = COMMAND_RESET;
+		}
+		step.board->messageSend(data, dlc, step.deviceNumber); // Old ids: after a lost verification the device may have moved already, harmless
+		step.tries++;
+		step.pings = 0;
+		if (step.operation == CONFIG_RESET) {
+			step.state = CONFIG_CHECK;
+			step.untilMs = nowMs + MRM_CONFIG_RESET_SILENT_MS;
+		}
+		else {
+			step.state = CONFIG_SETTLE;
+			step.untilMs = nowMs + MRM_CONFIG_SETTLE_MS;
+		}
+		return 1;
+	}
+	case CONFIG_SETTLE:
+		if ((int32_t)(nowMs - step.untilMs) < 0)
+			return 0;
+		step.state = CONFIG_VERIFY;
+		step.untilMs = nowMs + MRM_CONFIG_ANSWER_MS;
+		return verify(step);
+	case CONFIG_VERIFY: {
+		bool verified = false;
+		switch (step.operation) {
+		case CONFIG_ID_CHANGE:
+			verified = step.answered;
+			break;
+		case CONFIG_PNP:
+			verified = device.pnp == step.argument;
+			if (device.pnp != 0xFF && !verified) { // Answered, but not changed
+				step.state = CONFIG_SEND;
+				return 0;
+			}
+			break;
+		default:
+			verified = device.alive;
+		}
+		if (verified) {
+			if (step.operation == CONFIG_ID_CHANGE) {
+				device.canIdIn = step.canIdIn;
+				device.canIdOut = step.canIdIn + 1;
+				device.alive = true;
+				if (step.finalCanIdIn != 0) { // On the temporary id, now to the requested one
+					step.canIdIn = step.finalCanIdIn;
+					step.argument = step.finalNumber;
+					step.finalCanIdIn = 0;
+					step.tries = 0;
+					step.pings = 0;
+					step.state = CONFIG_WAIT;
+					return 0;
+				}
+			}
+			step.state = CONFIG_DONE;
+			return 0;
+		}
+		if ((int32_t)(nowMs - step.untilMs) < 0)
+			return 0;
+		if (step.pings >= MRM_CONFIG_PINGS) {
+			step.state = CONFIG_SEND; // Command lost, resend
+			return 0;
+		}
+		step.untilMs = nowMs + MRM_CONFIG_ANSWER_MS;
+		return verify(step);
+	}
+	default:
+		return 0;
+	}
+}
+
+/** Move a step's device to a free id first, its requested id being taken
+@param step - step
+@return - a free id found
+*/
+bool ConfigBatch::temporaryMove(ConfigStep& step){
+	Device& device = *step.board->deviceGet(step.deviceNumber);
+	uint16_t canIdBase = products[productIndex(step.canIdIn)].canIdBase;
+	for (int8_t number = MRM_PRODUCT_DEVICES - 1; number >= 0; number--) { // From the top, devices are seldom numbered there
+		uint16_t canIdIn = canIdBase + 2 * number;
+		bool free = true;
+		for (uint8_t i = 0; i < Board::boardsCount && free; i++)
+			for (Device& other : Board::boards[i]->devices)
+				if (other.canIdIn == canIdIn && other.bus == device.bus)
+					free = false;
+		for (uint8_t i = 0; i < stepsCount && free; i++)
+			if (steps[i].operation == CONFIG_ID_CHANGE && (steps[i].canIdIn == canIdIn || steps[i].finalCanIdIn == canIdIn))
+				free = false;
+		if (free) { // Still pinged in CONFIG_CHECK, as unregistered devices may have it
+			step.finalCanIdIn = step.canIdIn;
+			step.finalNumber = step.argument;
+			step.canIdIn = canIdIn;
+			step.argument = number;
+			return true;
+		}
+	}
+	return false;
+}
+
+/** Send a verification request
+@param step - step
+@return - frames sent
+*/
+uint8_t ConfigBatch::verify(ConfigStep& step){
+	Device& device = *step.board->deviceGet(step.deviceNumber);
+	uint8_t data[1];
+	step.answered = false;
+	step.pings++;
+	switch (step.operation) {
+	case CONFIG_ID_CHANGE:
+		data[0] = COMMAND_REPORT_ALIVE;
+		rawSend(step.canIdIn, data, 1, device.bus);
+		break;
+	case CONFIG_PNP:
+		device.pnp = 0xFF;
+		data[0] = COMMAND_PNP_REQUEST;
+		step.board->messageSend(data, 1, step.deviceNumber);
+		break;
+	default:
+		device.alive = false;
+		data[0] = COMMAND_REPORT_ALIVE;
+		step.board->messageSend(data, 1, step.deviceNumber);
+	}
+	return 1;
+}
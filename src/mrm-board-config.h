@@ -0,0 +1,166 @@
+#pragma once
+
+#include "mrm-board-discovery.h"
+
+// Verified configuration. Steps are queued, then run() processes all of them concurrently: each command is sent, its result
+// verified and, if that fails, the command is sent again, up to MRM_CONFIG_TRIES times:
+//   id change - the new ids, from the product's range (see products), must be silent before; after, the device must answer there.
+//     Ids held by another device are reached through a free temporary id, waiting until their holder's own step moved it, so
+//     devices can swap ids.
+//   PnP - the device must report the requested state (COMMAND_PNP_REQUEST)
+//   reset - the device must stop answering, then answer again after rebooting
+// run() blocks, like Discovery::sweep(); the host must pass received frames to Board::messageDecodeAll() meanwhile.
+//
+//   ConfigBatch::idChange(&mot4x36, 0, 2);
+//   ConfigBatch::pnpSet(&mot4x36, 1, false);
+//   if (ConfigBatch::run() != ConfigBatch::count()) ConfigBatch::print();
+
+#ifndef MRM_CONFIG_STEPS
+#define MRM_CONFIG_STEPS 32
+#endif
+#ifndef MRM_CONFIG_TRIES
+#define MRM_CONFIG_TRIES 3 // Commands sent for one step
+#endif
+#ifndef MRM_CONFIG_PINGS
+#define MRM_CONFIG_PINGS 3 // Verification requests after each command
+#endif
+#ifndef MRM_CONFIG_ANSWER_MS
+#define MRM_CONFIG_ANSWER_MS 20 // Wait for an answer to a ping or request
+#endif
+#ifndef MRM_CONFIG_SETTLE_MS
+#define MRM_CONFIG_SETTLE_MS 50 // After an id or PnP change, the device stores it
+#endif
+#ifndef MRM_CONFIG_RESET_MS
+#define MRM_CONFIG_RESET_MS 500 // Reboot
+#endif
+#ifndef MRM_CONFIG_RESET_SILENT_MS
+#define MRM_CONFIG_RESET_SILENT_MS 5 // After a reset command, a rebooting device no longer answers
+#endif
+#ifndef MRM_CONFIG_BURST
+#define MRM_CONFIG_BURST 8 // Frames sent before letting the bus drain for 1 ms
+#endif
+
+enum ConfigOperation{CONFIG_ID_CHANGE, CONFIG_PNP, CONFIG_RESET};
+enum ConfigState{CONFIG_WAIT, CONFIG_CHECK, CONFIG_SEND, CONFIG_SETTLE, CONFIG_VERIFY, CONFIG_DONE, CONFIG_FAILED};
+
+struct ConfigStep{
+	Board* board;
+	uint8_t deviceNumber;
+	uint8_t operation; // ConfigOperation
+	uint8_t argument; // New device number or PnP state
+	uint8_t state; // ConfigState
+	uint8_t tries; // Commands sent
+	uint8_t pings; // Verification requests after the last command
+	bool answered; // Answer to the last ping or request arrived
+	uint16_t canIdIn; // New id for CONFIG_ID_CHANGE
+	uint16_t finalCanIdIn; // Requested id while moving to a temporary one, 0 - none
+	uint8_t finalNumber; // Requested device number while moving to a temporary id
+	uint32_t untilMs; // End of the current wait
+	const char* failure; // Why CONFIG_FAILED
+};
+
+class ConfigBatch{
+	static ConfigStep steps[MRM_CONFIG_STEPS];
+	static uint8_t stepsCount;
+	static bool (*previousDecode)(CANMessage& message); // unclaimedDecode before run()
+
+	/** Queue a step
+	@param board - board
+	@param deviceNumber - device
+	@param operation - ConfigOperation
+	@param argument - new device number or PnP state
+	@return - the step, NULL if the queue is full or there is no such device
+	*/
+	static ConfigStep* add(Board* board, uint8_t deviceNumber, ConfigOperation operation, uint8_t argument);
+
+	/** Device holding a step's new id, other than step's device
+	@param step - step
+	@return - holder, nullptr - none
+	*/
+	static Device* holderGet(ConfigStep& step);
+
+	/** Queued id change of a device
+	@param device - device
+	@return - step, NULL - none
+	*/
+	static ConfigStep* idChangeGet(Device& device);
+
+	/** Catches answers from ids no board has, installed as Board::unclaimedDecode during run()
+	*/
+	static bool messageDecode(CANMessage& message);
+
+	/** Send a frame to an id no device may have yet
+	@param canId - id
+	@param data - payload
+	@param dlc - length
+	@param bus - bus index
+	*/
+	static void rawSend(uint16_t canId, uint8_t* data, uint8_t dlc, uint8_t bus);
+
+	/** Advance a step
+	@param step - step
+	@param nowMs - millis()
+	@return - frames sent
+	*/
+	static uint8_t stepRun(ConfigStep& step, uint32_t nowMs);
+
+	/** Move a step's device to a free id first, its requested id being taken
+	@param step - step
+	@return - a free id found
+	*/
+	static bool temporaryMove(ConfigStep& step);
+
+	/** Send a verification request
+	@param step - step
+	@return - frames sent
+	*/
+	static uint8_t verify(ConfigStep& step);
+
+public:
+	/** Remove all the steps
+	*/
+	static void clear(){ stepsCount = 0; }
+
+	/** Number of queued steps
+	*/
+	static uint8_t count(){ return stepsCount; }
+
+	/** Queue a change of device's number. On success, device's CAN Bus ids are updated. If DecodeShards are used, call their assign() after.
+	The new number may be another device's, if that one's number is changed in the same batch, for example to swap 2 devices.
+	@param board - board
+	@param deviceNumber - device
+	@param newNumber - new device number, selecting ids in its product's range, 0 - MRM_PRODUCT_DEVICES - 1
+	@return - queued
+	*/
+	static bool idChange(Board* board, uint8_t deviceNumber, uint8_t newNumber);
+
+	/** Queue a PnP change
+	@param board - board
+	@param deviceNumber - device
+	@param enable - PnP on or off
+	@return - queued
+	*/
+	static bool pnpSet(Board* board, uint8_t deviceNumber, bool enable);
+
+	/** Print the steps and their results
+	*/
+	static void print();
+
+	/** Queue a reset
+	@param board - board
+	@param deviceNumber - device
+	@return - queued
+	*/
+	static bool reset(Board* board, uint8_t deviceNumber);
+
+	/** Process all the queued steps concurrently, until all are done or failed
+	@param timeoutMs - give up the rest after this
+	@return - steps done
+	*/
+	static uint8_t run(uint32_t timeoutMs = 5000);
+
+	/** A step's result
+	@param i - step's index, in the queuing order
+	*/
+	static ConfigStep& step(uint8_t i){ return steps[i]; }
+};
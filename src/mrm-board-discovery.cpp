@@ -0,0 +1,160 @@
+#include "mrm-board-discovery.h"
+
+#define DISCOVERY_BURST 16 // Frames sent before letting the bus drain for 1 ms
+
+uint8_t Discovery::responded[MRM_CAN_BUSES][productsCount];
+Discovery::FactoryEntry Discovery::factory[MRM_FACTORY_ENTRIES];
+uint8_t Discovery::factoryCount = 0;
+
+#if MRM_BOARD_STATIC
+alignas(MotorBoard) static uint8_t motorBoardsArena[MRM_DISCOVERY_MOTOR_BOARDS * sizeof(MotorBoard)]; // No heap in static mode
+static uint8_t motorBoardsCount = 0;
+#endif
+
+static Board* motorBoardCreate(const Product& product){
+#if MRM_BOARD_STATIC
+	if (motorBoardsCount >= MRM_DISCOVERY_MOTOR_BOARDS) {
+		sprintf(errorMessage, "Max. %i discovered motor boards", MRM_DISCOVERY_MOTOR_BOARDS);
+		return NULL;
+	}
+	return new (motorBoardsArena + sizeof(MotorBoard) * motorBoardsCount++)
+		MotorBoard(product.devicesOnABoard, product.name, MRM_PRODUCT_DEVICES / product.devicesOnABoard, product.id);
+#else
+	return new MotorBoard(product.devicesOnABoard, product.name, MRM_PRODUCT_DEVICES / product.devicesOnABoard, product.id);
+#endif
+}
+
+/** Create a board for a product through the factory. Motor controllers are registered by default, as MotorBoard.
+@param product - product
+@return - board, NULL if no Board class is registered for the product's type or it could not be created, see errorMessage
+*/
+Board* Discovery::boardCreate(const Product& product){
+	defaultsRegister();
+	for (uint8_t i = 0; i < factoryCount; i++)
+		if (factory[i].id == product.id && product.id != Board::ID_ANY)
+			return factory[i].create(product);
+	strcpy(errorMessage, "no Board class");
+	return NULL;
+}
+
+/** Register MotorBoard for the motor controllers that have no other class registered
+*/
+void Discovery::defaultsRegister(){
+	const Board::BoardId motorBoards[] = {Board::ID_MRM_MOT4X3_6CAN, Board::ID_MRM_BLDC4x2_5, Board::ID_MRM_MOT4X10, Board::ID_MRM_MOT2X50};
+	for (Board::BoardId id : motorBoards) {
+		bool registered = false;
+		for (uint8_t i = 0; i < factoryCount; i++)
+			registered |= factory[i].id == id;
+		if (!registered)
+			factoryRegister(id, motorBoardCreate);
+	}
+}
+
+/** Add a product's device to a board, named as sweep() names them
+@param board - board
+@param product - index in products
+@param number - device's number in the product's range, 0 - MRM_PRODUCT_DEVICES - 1
+@param bus - bus index
+@return - the device, nullptr if it was not added
+*/
+Device* Discovery::deviceAdd(Board* board, uint8_t product, uint8_t number, uint8_t bus){
+	if (product >= productsCount || number >= MRM_PRODUCT_DEVICES || bus >= MRM_CAN_BUSES)
+		return nullptr;
+	char name[10];
+	if (bus == 0)
+		snprintf(name, sizeof(name), "%.7s%i", products[product].name + 4, number); // Without "mrm-"
+	else
+		snprintf(name, sizeof(name), "%.5s%i-%i", products[product].name + 4, bus, number);
+	uint16_t canIdIn = products[product].canIdBase + 2 * number;
+	board->add(name, canIdIn, canIdIn + 1, bus);
+	Device* device = board->deviceGet(board->devices.size() - 1);
+	return device != nullptr && device->canIdIn == canIdIn && device->bus == bus ? device : nullptr;
+}
+
+/** Register a Board subclass for a product type. Motor controllers are registered by default, as MotorBoard.
+@param id - board type
+@param create - function returning a new board, NULL if it cannot. With MRM_BOARD_STATIC, it must not use the heap.
+*/
+void Discovery::factoryRegister(Board::BoardId id, BoardCreate create){
+	for (uint8_t i = 0; i < factoryCount; i++)
+		if (factory[i].id == id) {
+			factory[i].create = create;
+			return;
+		}
+	if (factoryCount < MRM_FACTORY_ENTRIES)
+		factory[factoryCount++] = {id, create};
+	else
+		strcpy(errorMessage, "Factory full");
+}
+
+/** Collects answers during the sweep, installed as Board::unclaimedDecode. Frames of an unknown bus count for bus 0.
+*/
+bool Discovery::messageDecode(CANMessage& message){
+	uint8_t product = productIndex(message.id);
+	if (product == 0xFF || message.data[0] != COMMAND_REPORT_ALIVE || ((message.id - products[product].canIdBase) & 1) == 0)
+		return false;
+	responded[Board::rxBus < MRM_CAN_BUSES ? Board::rxBus : 0][product] |= 1 << ((message.id - products[product].canIdBase) / 2);
+	return true;
+}
+
+/** Ping all ids of all products in one pipelined sweep, create missing boards through the factory and add() the responding devices.
+Boards already constructed by the user are reused. The host must pass received frames to Board::messageDecodeAll(), or BusRouter::decode().
+Bus 0 and every bus with a registered transport are swept, and devices are added on the bus they answered on.
+@param windowMs - time to wait for the last answers
+@return - number of devices found
+*/
+uint8_t Discovery::sweep(uint16_t windowMs){
+	defaultsRegister();
+
+	// Devices already added answer to their boards and become alive. Only the unknown ones reach messageDecode().
+	memset(responded, 0, sizeof(responded));
+	for (uint8_t i = 0; i < Board::boardsCount; i++)
+		Board::boards[i]->aliveSet(false);
+	Board::unclaimedDecode = messageDecode;
+
+	uint8_t data[1] = {COMMAND_REPORT_ALIVE};
+	uint16_t sent = 0;
+	for (uint8_t i = 0; i < productsCount; i++)
+		for (uint8_t n = 0; n < MRM_PRODUCT_DEVICES; n++)
+			for (uint8_t bus = 0; bus < MRM_CAN_BUSES; bus++) { // Buses in turn, each gets its own paced stream
+				CANMessage message(products[i].canIdBase + 2 * n, data, 1);
+				if (BusRouter::transportExists(bus))
+					BusRouter::transportSend(message, bus);
+				else if (bus == 0)
+					BoardHost::messageSend(message, 0xFF);
+				else
+					continue;
+				if (++sent % DISCOVERY_BURST == 0)
+					BoardHost::delayMs(1); // Answers are decoded meanwhile.
+			}
+	BoardHost::delayMs(windowMs);
+	Board::unclaimedDecode = NULL;
+
+	uint8_t found = 0;
+	for (uint8_t i = 0; i < Board::boardsCount; i++)
+		found += Board::boards[i]->aliveCount();
+	for (uint8_t bus = 0; bus < MRM_CAN_BUSES; bus++) {
+		for (uint8_t i = 0; i < productsCount; i++) {
+			if (responded[bus][i] == 0)
+				continue;
+			Board* board = NULL;
+			for (uint8_t j = 0; j < Board::boardsCount && board == NULL; j++)
+				if (Board::boards[j]->id() == products[i].id && products[i].id != Board::ID_ANY)
+					board = Board::boards[j];
+			if (board == NULL)
+				board = boardCreate(products[i]);
+			if (board == NULL) {
+				print("%s: found, %s\n\r", products[i].name, errorMessage);
+				continue;
+			}
+			for (uint8_t n = 0; n < MRM_PRODUCT_DEVICES; n++)
+				if ((responded[bus][i] >> n) & 1) {
+					Device* device = deviceAdd(board, i, n, bus);
+					if (device != nullptr)
+						board->aliveSet(true, device);
+					found++;
+				}
+		}
+	}
+	return found;
+}
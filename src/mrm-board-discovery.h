@@ -0,0 +1,108 @@
+#pragma once
+
+#include "mrm-board.h"
+
+// Automatic discovery. A constant table maps each product to its CAN Bus address range (see the list in mrm-board.h).
+// One pipelined sweep pings every id of every range and a factory instantiates the Board subclasses of the responding devices.
+// Within a range, device n uses canIdIn = base + 2 * n and canIdOut = base + 2 * n + 1.
+
+#define MRM_PRODUCT_DEVICES 8 // Devices in a product's address range
+#ifndef MRM_FACTORY_ENTRIES
+#define MRM_FACTORY_ENTRIES 16
+#endif
+#ifndef MRM_DISCOVERY_MOTOR_BOARDS
+#define MRM_DISCOVERY_MOTOR_BOARDS 2 // MotorBoards the default factory can create in static-allocation mode, preallocated
+#endif
+
+struct Product{
+	uint16_t canIdBase;
+	const char* name;
+	Board::BoardId id; // ID_ANY - no Board subclass in this library set
+	uint8_t devicesOnABoard;
+};
+
+constexpr Product products[] = {
+	{0x0110, "mrm-bldc2x125", Board::ID_ANY, 2},
+	{0x0150, "mrm-lid-can-b2", Board::ID_MRM_LID_CAN_B2, 1},
+	{0x0160, "mrm-ref-can", Board::ID_MRM_REF_CAN, 1},
+	{0x0170, "mrm-node", Board::ID_MRM_NODE, 1},
+	{0x0180, "mrm-lid-can-b", Board::ID_MRM_LID_CAN_B, 1},
+	{0x0200, "mrm-8x8a", Board::ID_MRM_8x8A, 1},
+	{0x0210, "mrm-therm-b-can", Board::ID_MRM_THERM_B_CAN, 1},
+	{0x0230, "mrm-mot4x3.6can", Board::ID_MRM_MOT4X3_6CAN, 4},
+	{0x0240, "mrm-bldc4x2.5", Board::ID_MRM_BLDC4x2_5, 4},
+	{0x0250, "mrm-mot4x10", Board::ID_MRM_MOT4X10, 4},
+	{0x0260, "mrm-mot2x50", Board::ID_MRM_MOT2X50, 2},
+	{0x0270, "mrm-lid-can-b2", Board::ID_MRM_LID_CAN_B2, 1},
+	{0x0280, "mrm-lid-can-b", Board::ID_MRM_LID_CAN_B, 1},
+	{0x0290, "mrm-ir-finder-can", Board::ID_MRM_IR_FINDER_CAN, 1},
+	{0x0300, "mrm-us", Board::ID_MRM_US, 1},
+	{0x0310, "mrm-col-can", Board::ID_MRM_COL_CAN, 1},
+	{0x0320, "mrm-us-a", Board::ID_ANY, 1},
+	{0x0330, "mrm-ir-finder3", Board::ID_MRM_IR_FINDER3, 1},
+	{0x0350, "mrm-fet-can", Board::ID_MRM_FET_CAN, 1},
+	{0x0360, "mrm-us-b", Board::ID_MRM_US_B, 1},
+	{0x0370, "mrm-us1", Board::ID_MRM_US1, 1},
+	{0x0380, "mrm-col-b", Board::ID_MRM_COL_B, 1},
+	{0x0390, "mrm-lid-d", Board::ID_MRM_LID_D, 1},
+	{0x0400, "mrm-lid-d", Board::ID_MRM_LID_D, 1}
+};
+constexpr uint8_t productsCount = sizeof(products) / sizeof(Product);
+
+/** Product whose range contains a CAN Bus id
+@param canId - in or out id
+@return - index in products, 0xFF - none
+*/
+constexpr uint8_t productIndex(uint16_t canId, uint8_t i = 0){
+	return i >= productsCount ? 0xFF : 
+		(canId >= products[i].canIdBase && canId < products[i].canIdBase + 2 * MRM_PRODUCT_DEVICES ? i : productIndex(canId, i + 1));
+}
+
+typedef Board* (*BoardCreate)(const Product& product);
+
+class Discovery{
+	static uint8_t responded[MRM_CAN_BUSES][productsCount]; // Bit n - device n answered on the bus
+	static struct FactoryEntry{
+		Board::BoardId id;
+		BoardCreate create;
+	} factory[MRM_FACTORY_ENTRIES];
+	static uint8_t factoryCount;
+
+	/** Register MotorBoard for the motor controllers that have no other class registered
+	*/
+	static void defaultsRegister();
+
+	/** Collects answers during the sweep, installed as Board::unclaimedDecode. Frames of an unknown bus count for bus 0.
+	*/
+	static bool messageDecode(CANMessage& message);
+
+public:
+	/** Create a board for a product through the factory. Motor controllers are registered by default, as MotorBoard.
+	@param product - product
+	@return - board, NULL if no Board class is registered for the product's type or it could not be created, see errorMessage
+	*/
+	static Board* boardCreate(const Product& product);
+
+	/** Add a product's device to a board, named as sweep() names them
+	@param board - board
+	@param product - index in products
+	@param number - device's number in the product's range, 0 - MRM_PRODUCT_DEVICES - 1
+	@param bus - bus index
+	@return - the device, nullptr if it was not added
+	*/
+	static Device* deviceAdd(Board* board, uint8_t product, uint8_t number, uint8_t bus);
+
+	/** Register a Board subclass for a product type. Motor controllers are registered by default, as MotorBoard.
+	@param id - board type
+	@param create - function returning a new board, NULL if it cannot. With MRM_BOARD_STATIC, it must not use the heap.
+	*/
+	static void factoryRegister(Board::BoardId id, BoardCreate create);
+
+	/** Ping all ids of all products in one pipelined sweep, create missing boards through the factory and add() the responding devices.
+	Boards already constructed by the user are reused. The host must pass received frames to Board::messageDecodeAll(), or BusRouter::decode().
+	Bus 0 and every bus with a registered transport are swept, and devices are added on the bus they answered on.
+	@param windowMs - time to wait for the last answers
+	@return - number of devices found
+	*/
+	static uint8_t sweep(uint16_t windowMs = 30);
+};
@@ -0,0 +1,95 @@
+#include "mrm-board-error.h"
+#include "mrm-common.h"
+#include <cstring>
+
+ErrorAggregator::ErrorAggregator(){
+	reset();
+}
+
+/** Count an error
+@param canId - id of the frame reporting or causing the error
+@param name - device's name, copied
+@param code - error code
+@param peripheral - reported by the device, not found locally
+@return - true if this is the pair's first occurrence, which the caller should pass on. false - only counted.
+*/
+bool ErrorAggregator::add(uint16_t canId, const char* name, uint8_t code, bool peripheral){
+	uint8_t count = recordsCount.load(std::memory_order_acquire);
+	for (uint8_t i = 0; i < count && i < MRM_ERROR_RECORDS; i++) {
+		ErrorRecord& record = records[i];
+		if (record.ready.load(std::memory_order_acquire) && record.canId == canId && record.code == code) {
+			record.count.fetch_add(1, std::memory_order_relaxed);
+			record.lastMs.store(millis(), std::memory_order_relaxed);
+			return false;
+		}
+	}
+
+	// New pair. 2 threads adding the same new pair at once may create 2 records, which is harmless.
+	uint8_t index = recordsCount.load(std::memory_order_relaxed);
+	do {
+		if (index >= MRM_ERROR_RECORDS) {
+			_overflows.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+	} while (!recordsCount.compare_exchange_weak(index, index + 1, std::memory_order_acq_rel));
+	ErrorRecord& record = records[index];
+	uint32_t now = millis();
+	strncpy(record.name, name, MRM_ERROR_NAME - 1);
+	record.name[MRM_ERROR_NAME - 1] = '\0';
+	record.canId = canId;
+	record.code = code;
+	record.peripheral = peripheral;
+	record.firstMs = now;
+	record.reportedMs = now;
+	record.reportedCount = 1;
+	record.count.store(1, std::memory_order_relaxed);
+	record.lastMs.store(now, std::memory_order_relaxed);
+	record.ready.store(true, std::memory_order_release);
+	return true;
+}
+
+/** Print repeats not reported yet, respecting MRM_ERROR_REPORT_MS. Call from the main loop or the log task, from one thread only.
+@param maxLines - stop after this many, to bound the time spent. The rest are printed by later calls.
+@return - number of lines printed
+*/
+uint8_t ErrorAggregator::flush(uint8_t maxLines){
+	uint8_t printed = 0;
+	uint8_t count = recordsCount.load(std::memory_order_acquire);
+	uint32_t now = millis();
+	for (uint8_t i = 0; i < count && i < MRM_ERROR_RECORDS && printed < maxLines; i++) {
+		ErrorRecord& record = records[i];
+		if (!record.ready.load(std::memory_order_acquire) || now - record.reportedMs < MRM_ERROR_REPORT_MS)
+			continue;
+		uint32_t total = record.count.load(std::memory_order_relaxed);
+		if (total == record.reportedCount)
+			continue;
+		::print("%s: error %i repeated %i times in %i ms\n\r", record.name, record.code, total - record.reportedCount, now - record.reportedMs);
+		record.reportedCount = total;
+		record.reportedMs = now;
+		printed++;
+	}
+	return printed;
+}
+
+/** Print all the pairs: count, first and last occurrence
+*/
+void ErrorAggregator::print(){
+	uint8_t count = recordsCount.load(std::memory_order_acquire);
+	for (uint8_t i = 0; i < count && i < MRM_ERROR_RECORDS; i++) {
+		ErrorRecord& record = records[i];
+		if (record.ready.load(std::memory_order_acquire))
+			::print("%s (0x%02x) %s error %i: %i times, %i - %i ms\n\r", record.name, record.canId, record.peripheral ? "device" : "local", record.code,
+				record.count.load(std::memory_order_relaxed), record.firstMs, record.lastMs.load(std::memory_order_relaxed));
+	}
+	if (overflows() != 0)
+		::print("%i errors not tracked\n\r", overflows());
+}
+
+/** Forget all the errors. Not safe while add() runs.
+*/
+void ErrorAggregator::reset(){
+	for (uint8_t i = 0; i < MRM_ERROR_RECORDS; i++)
+		records[i].ready.store(false, std::memory_order_relaxed);
+	recordsCount.store(0, std::memory_order_relaxed);
+	_overflows.store(0, std::memory_order_relaxed);
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Arduino.h"
+#include <atomic>
+
+// Error aggregation. Errors from the decoding path are coalesced per (CAN id, error code): only the first occurrence is passed on,
+// repeats just increment a counter. flush() reports the repeats, at most once per MRM_ERROR_REPORT_MS for each pair.
+
+#ifndef MRM_ERROR_RECORDS
+#define MRM_ERROR_RECORDS 16 // Distinct (CAN id, error code) pairs tracked
+#endif
+#ifndef MRM_ERROR_REPORT_MS
+#define MRM_ERROR_REPORT_MS 1000 // Minimal period between 2 reports of the same pair
+#endif
+#define MRM_ERROR_NAME 10 // Device names are shorter, see Board::add()
+
+struct ErrorRecord{
+	std::atomic<bool> ready; // Fields below set
+	std::atomic<uint32_t> count;
+	std::atomic<uint32_t> lastMs;
+	uint32_t firstMs;
+	uint32_t reportedCount; // count at the last report
+	uint32_t reportedMs;
+	char name[MRM_ERROR_NAME]; // Device's name, copied, as devices may move when more are added
+	uint16_t canId;
+	uint8_t code;
+	bool peripheral;
+};
+
+/** Coalesces repeated errors. add() may be called from several decoding threads, flush() and print() from one other.
+*/
+class ErrorAggregator{
+	ErrorRecord records[MRM_ERROR_RECORDS];
+	std::atomic<uint8_t> recordsCount;
+	std::atomic<uint32_t> _overflows;
+
+public:
+	ErrorAggregator();
+
+	/** Count an error
+	@param canId - id of the frame reporting or causing the error
+	@param name - device's name, copied
+	@param code - error code
+	@param peripheral - reported by the device, not found locally
+	@return - true if this is the pair's first occurrence, which the caller should pass on. false - only counted.
+	*/
+	bool add(uint16_t canId, const char* name, uint8_t code, bool peripheral);
+
+	/** Print repeats not reported yet, respecting MRM_ERROR_REPORT_MS. Call from the main loop or the log task, from one thread only.
+	@param maxLines - stop after this many, to bound the time spent. The rest are printed by later calls.
+	@return - number of lines printed
+	*/
+	uint8_t flush(uint8_t maxLines = 0xFF);
+
+	/** Errors not counted because all the records were taken
+	*/
+	uint32_t overflows(){ return _overflows.load(std::memory_order_relaxed); }
+
+	/** Print all the pairs: count, first and last occurrence
+	*/
+	void print();
+
+	/** Forget all the errors. Not safe while add() runs.
+	*/
+	void reset();
+};
@@ -0,0 +1,125 @@
+#include "mrm-board-log.h"
+#include "mrm-common.h"
+#include <cstring>
+
+static const char* const logFormats[] = {
+	"%s: unknown command 0x%02x\n\r", // LOG_COMMAND_UNKNOWN
+	"%s: error %i\n\r", // LOG_ERROR
+	"%s: ver. %i \n\r", // LOG_FIRMWARE
+	"Message from %s: %s\n\r" // LOG_MESSAGE
+};
+
+LogDeferred::LogDeferred(){
+	static_assert((MRM_LOG_ENTRIES & (MRM_LOG_ENTRIES - 1)) == 0, "MRM_LOG_ENTRIES must be a power of 2");
+	for (uint32_t i = 0; i < MRM_LOG_ENTRIES; i++)
+		entries[i].sequence.store(i, std::memory_order_relaxed);
+	enqueuePosition.store(0, std::memory_order_relaxed);
+	_dropped.store(0, std::memory_order_relaxed);
+}
+
+/** Log with integer arguments
+@param format - format id
+@param name - device's name, copied
+@param argument0 - first argument
+@param argument1 - second argument
+*/
+void LogDeferred::add(LogFormat format, const char* name, int32_t argument0, int32_t argument1){
+	LogEntry* entry = reserve();
+	if (entry == NULL)
+		return;
+	entry->format = format;
+	strncpy(entry->name, name, MRM_LOG_NAME - 1);
+	entry->name[MRM_LOG_NAME - 1] = '\0';
+	entry->arguments[0] = argument0;
+	entry->arguments[1] = argument1;
+	commit(entry);
+}
+
+/** Log with a text argument, copied into the queue
+@param format - format id
+@param name - device's name, copied
+@param text - text, truncated to MRM_LOG_TEXT_LENGTH - 1 characters
+*/
+void LogDeferred::addText(LogFormat format, const char* name, const char* text){
+	LogEntry* entry = reserve();
+	if (entry == NULL)
+		return;
+	entry->format = format;
+	strncpy(entry->name, name, MRM_LOG_NAME - 1);
+	entry->name[MRM_LOG_NAME - 1] = '\0';
+	strncpy(entry->text, text, MRM_LOG_TEXT_LENGTH - 1);
+	entry->text[MRM_LOG_TEXT_LENGTH - 1] = '\0';
+	commit(entry);
+}
+
+/** Format and print queued entries. Only one thread may call it.
+@param maxEntries - stop after this many, to bound the time spent
+@return - number of entries printed
+*/
+uint16_t LogDeferred::flush(uint16_t maxEntries){
+	uint16_t printed = 0;
+	while (printed < maxEntries) {
+		LogEntry& entry = entries[dequeuePosition & (MRM_LOG_ENTRIES - 1)];
+		if (entry.sequence.load(std::memory_order_acquire) != dequeuePosition + 1)
+			break; // Empty
+		const char* format = logFormats[entry.format];
+		switch (entry.format) {
+		case LOG_MESSAGE:
+			print(format, entry.name, entry.text);
+			break;
+		default:
+			print(format, entry.name, entry.arguments[0], entry.arguments[1]);
+		}
+		entry.sequence.store(dequeuePosition + MRM_LOG_ENTRIES, std::memory_order_release);
+		dequeuePosition++;
+		printed++;
+	}
+	return printed;
+}
+
+/** Claim a slot
+@return - slot or NULL if full
+*/
+LogEntry* LogDeferred::reserve(){
+	uint32_t position = enqueuePosition.load(std::memory_order_relaxed);
+	while (true) {
+		LogEntry* entry = &entries[position & (MRM_LOG_ENTRIES - 1)];
+		int32_t difference = (int32_t)(entry->sequence.load(std::memory_order_acquire) - position);
+		if (difference == 0) {
+			if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				return entry;
+		}
+		else if (difference < 0) {
+			_dropped.fetch_add(1, std::memory_order_relaxed);
+			return NULL;
+		}
+		else
+			position = enqueuePosition.load(std::memory_order_relaxed);
+	}
+}
+
+#if defined(ESP32)
+/** Background task's loop
+@param parameter - LogDeferred
+*/
+void LogDeferred::task(void* parameter){
+	LogDeferred* logDeferred = (LogDeferred*)parameter;
+	while (true) {
+		if (logDeferred->flusher != NULL)
+			logDeferred->flusher(8);
+		else
+			logDeferred->flush(8);
+		vTaskDelay(1);
+	}
+}
+
+/** Start a background task that flushes the queue
+@param core - ESP32 core
+@param priority - FreeRTOS priority, should be lower than CAN Bus decoding's
+@param flushAll - called instead of flush(), to print other queued output too, like Board::logFlush(). NULL - only this queue.
+*/
+void LogDeferred::taskStart(uint8_t core, uint8_t priority, uint16_t (*flushAll)(uint16_t maxEntries)){
+	flusher = flushAll;
+	xTaskCreatePinnedToCore(task, "mrmLog", 3072, this, priority, NULL, core);
+}
+#endif
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Arduino.h"
+#include <atomic>
+
+// Deferred logging. The hot path (frame decoding) only stores a format id and raw arguments into a lock-free queue.
+// Formatting and the slow serial output happen later, in flush(), called from the main loop or a background task.
+
+#ifndef MRM_LOG_ENTRIES
+#define MRM_LOG_ENTRIES 32 // Queue capacity, must be a power of 2
+#endif
+#define MRM_LOG_TEXT_LENGTH 29 // Text argument's maximum length, including '\0'
+#define MRM_LOG_NAME 10 // Device names are shorter, see Board::add()
+
+enum LogFormat : uint8_t {LOG_COMMAND_UNKNOWN, LOG_ERROR, LOG_FIRMWARE, LOG_MESSAGE};
+
+struct LogEntry{
+	std::atomic<uint32_t> sequence; // Slot's state, as in a bounded multi-producer queue
+	LogFormat format;
+	char name[MRM_LOG_NAME]; // Device's name, copied, as devices may move when more are added
+	union{
+		int32_t arguments[4];
+		char text[MRM_LOG_TEXT_LENGTH];
+	};
+};
+
+/** Lock-free multi-producer, single-consumer log queue. If full, new entries are dropped and counted, the producer never waits.
+*/
+class LogDeferred{
+	LogEntry entries[MRM_LOG_ENTRIES];
+	std::atomic<uint32_t> enqueuePosition;
+	uint32_t dequeuePosition = 0;
+	std::atomic<uint32_t> _dropped;
+	uint16_t (*flusher)(uint16_t maxEntries) = NULL; // Called by the background task instead of flush()
+
+	/** Claim a slot
+	@return - slot or NULL if full
+	*/
+	LogEntry* reserve();
+
+	/** Make a claimed slot visible to flush()
+	*/
+	void commit(LogEntry* entry){ entry->sequence.store(entry->sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+#if defined(ESP32)
+	/** Background task's loop
+	@param parameter - LogDeferred
+	*/
+	static void task(void* parameter);
+#endif
+
+public:
+	LogDeferred();
+
+	/** Log with integer arguments
+	@param format - format id
+	@param name - device's name, copied
+	@param argument0 - first argument
+	@param argument1 - second argument
+	*/
+	void add(LogFormat format, const char* name, int32_t argument0 = 0, int32_t argument1 = 0);
+
+	/** Log with a text argument, copied into the queue
+	@param format - format id
+	@param name - device's name, copied
+	@param text - text, truncated to MRM_LOG_TEXT_LENGTH - 1 characters
+	*/
+	void addText(LogFormat format, const char* name, const char* text);
+
+	/** Number of entries lost because the queue was full
+	*/
+	uint32_t dropped(){ return _dropped.load(std::memory_order_relaxed); }
+
+	/** Format and print queued entries. Only one thread may call it.
+	@param maxEntries - stop after this many, to bound the time spent
+	@return - number of entries printed
+	*/
+	uint16_t flush(uint16_t maxEntries = 0xFFFF);
+
+#if defined(ESP32)
+	/** Start a background task that flushes the queue
+	@param core - ESP32 core
+	@param priority - FreeRTOS priority, should be lower than CAN Bus decoding's
+	@param flushAll - called instead of flush(), to print other queued output too, like Board::logFlush(). NULL - only this queue.
+	*/
+	void taskStart(uint8_t core = 0, uint8_t priority = 1, uint16_t (*flushAll)(uint16_t maxEntries) = NULL);
+#endif
+};
@@ -0,0 +1,130 @@
+#include "mrm-board-registry.h"
+#include <algorithm>
+
+DeviceRegistry::Entry DeviceRegistry::entries[MRM_REGISTRY_DEVICES];
+uint8_t DeviceRegistry::byType[MRM_REGISTRY_DEVICES];
+uint8_t DeviceRegistry::entriesCount = 0;
+bool DeviceRegistry::built = true;
+
+/** Board's index in construction order
+@param board - board
+@return - index, MRM_BOARD_MAX_BOARDS if not found
+*/
+static uint8_t boardIndex(Board* board){
+	for (uint8_t i = 0; i < Board::boardsCount; i++)
+		if (Board::boards[i] == board)
+			return i;
+	return MRM_BOARD_MAX_BOARDS;
+}
+
+/** Register a device. Board::add() calls it.
+@param board - board
+@param number - device's number
+@return - success
+*/
+bool DeviceRegistry::add(Board* board, uint8_t number){
+	if (entriesCount >= MRM_REGISTRY_DEVICES) {
+		sprintf(errorMessage, "Max. %i registered devices", MRM_REGISTRY_DEVICES);
+		return false;
+	}
+	Entry& entry = entries[entriesCount++];
+	entry.board = board;
+	entry.number = number;
+	entry.hash = registryHash(board->devices[number].name.c_str());
+	built = false;
+	return true;
+}
+
+/** Sort the indices. Lookups call it if devices were added or removed since, so call it at setup, before other threads look up.
+@return - no duplicate names
+*/
+bool DeviceRegistry::build(){
+	std::sort(entries, entries + entriesCount, [](const Entry& a, const Entry& b){ return a.hash < b.hash; });
+	for (uint8_t i = 0; i < entriesCount; i++)
+		byType[i] = i;
+	std::sort(byType, byType + entriesCount, [](uint8_t a, uint8_t b){
+		Entry& first = entries[a];
+		Entry& second = entries[b];
+		if (first.board->id() != second.board->id())
+			return first.board->id() < second.board->id();
+		if (first.board != second.board)
+			return boardIndex(first.board) < boardIndex(second.board);
+		return first.number < second.number;
+	});
+	built = true;
+
+	bool unique = true;
+	for (uint8_t i = 0; i < entriesCount; i++) // Equal names have equal hashes, so they are adjacent
+		for (uint8_t j = i + 1; j < entriesCount && entries[j].hash == entries[i].hash; j++)
+			if (entries[i].board->devices[entries[i].number].name == entries[j].board->devices[entries[j].number].name) {
+				sprintf(errorMessage, "Duplicate name: %s", entries[i].board->devices[entries[i].number].name.c_str());
+				unique = false;
+			}
+	return unique;
+}
+
+/** Find a device by name
+@param hash - registryHash(name)
+@param name - name
+@return - handle, invalid if not found
+*/
+DeviceHandle DeviceRegistry::find(uint32_t hash, const char* name){
+	if (!built)
+		build();
+	DeviceHandle handle;
+	Entry* entry = std::lower_bound(entries, entries + entriesCount, hash, [](const Entry& a, uint32_t hash){ return a.hash < hash; });
+	for (; entry < entries + entriesCount && entry->hash == hash; entry++)
+		if (entry->board->devices[entry->number].name == name) {
+			handle.board = entry->board;
+			handle.number = entry->number;
+			break;
+		}
+	return handle;
+}
+
+/** A board's device
+@param board - board
+@param number - device's number
+@return - handle, invalid if there is no such device
+*/
+DeviceHandle DeviceRegistry::handle(Board* board, uint8_t number){
+	DeviceHandle handle;
+	if (board != NULL && board->deviceGet(number) != nullptr) {
+		handle.board = board;
+		handle.number = number;
+	}
+	return handle;
+}
+
+/** All the devices of a product
+@param id - product
+@param handles - output
+@param maxHandles - output's capacity
+@return - number of devices, can be bigger than maxHandles
+*/
+uint8_t DeviceRegistry::ofType(Board::BoardId id, DeviceHandle* handles, uint8_t maxHandles){
+	if (!built)
+		build();
+	uint8_t* first = std::lower_bound(byType, byType + entriesCount, id, [](uint8_t a, Board::BoardId id){ return entries[a].board->id() < id; });
+	uint8_t count = 0;
+	for (uint8_t* i = first; i < byType + entriesCount && entries[*i].board->id() == id; i++, count++)
+		if (count < maxHandles) {
+			handles[count].board = entries[*i].board;
+			handles[count].number = entries[*i].number;
+		}
+	return count;
+}
+
+/** Unregister a board's devices. Board's destructor calls it.
+@param board - board
+*/
+void DeviceRegistry::remove(Board* board){
+	uint8_t kept = 0;
+	for (uint8_t i = 0; i < entriesCount; i++)
+		if (entries[i].board != board)
+			entries[kept++] = entries[i];
+	if (kept != entriesCount) {
+		entriesCount = kept;
+		built = false;
+	}
+}
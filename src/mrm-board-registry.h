@@ -0,0 +1,93 @@
+#pragma once
+
+#include "mrm-board.h"
+
+// Robot-wide device registry. Board::add() registers each device; build() sorts a name index, by FNV-1a hash, and a product index,
+// by BoardId. Lookups are binary searches returning DeviceHandle, a board and a device number, which stays valid however devices
+// are stored. Resolve handles at setup and keep them in hot code instead of searching. Names can be hashed at compile time:
+//   constexpr uint32_t LEFT = registryHash("mot-left");
+//   DeviceHandle left = DeviceRegistry::find(LEFT, "mot-left");
+
+#ifndef MRM_REGISTRY_DEVICES
+#define MRM_REGISTRY_DEVICES 128
+#endif
+
+/** FNV-1a hash of a device's name
+@param name - name
+@param hash - of the preceding characters, to continue
+@return - hash
+*/
+constexpr uint32_t registryHash(const char* name, uint32_t hash = 2166136261u){
+	return *name == '\0' ? hash : registryHash(name + 1, (hash ^ (uint8_t)*name) * 16777619u);
+}
+
+/** A device, by its board and number
+*/
+struct DeviceHandle{
+	Board* board = NULL; // NULL - not found
+	uint8_t number = 0;
+
+	bool valid() const { return board != NULL; }
+
+	/** The device. Only for valid handles.
+	*/
+	Device& device() const { return board->devices[number]; }
+};
+
+class DeviceRegistry{
+	struct Entry{
+		uint32_t hash; // Name's
+		Board* board;
+		uint8_t number;
+	};
+	static Entry entries[MRM_REGISTRY_DEVICES]; // Sorted by hash after build()
+	static uint8_t byType[MRM_REGISTRY_DEVICES]; // Indices to entries, sorted by BoardId, boards' construction order and device number
+	static uint8_t entriesCount;
+	static bool built; // Indices match entries
+
+public:
+	/** Register a device. Board::add() calls it.
+	@param board - board
+	@param number - device's number
+	@return - success
+	*/
+	static bool add(Board* board, uint8_t number);
+
+	/** Sort the indices. Lookups call it if devices were added or removed since, so call it at setup, before other threads look up.
+	@return - no duplicate names
+	*/
+	static bool build();
+
+	/** Find a device by name
+	@param hash - registryHash(name)
+	@param name - name
+	@return - handle, invalid if not found
+	*/
+	static DeviceHandle find(uint32_t hash, const char* name);
+
+	/** Find a device by name
+	@param name - name
+	@return - handle, invalid if not found
+	*/
+	static DeviceHandle find(const char* name){ return find(registryHash(name), name); }
+
+	/** A board's device
+	@param board - board
+	@param number - device's number
+	@return - handle, invalid if there is no such device
+	*/
+	static DeviceHandle handle(Board* board, uint8_t number);
+
+	/** All the devices of a product
+	@param id - product
+	@param handles - output
+	@param maxHandles - output's capacity
+	@return - number of devices, can be bigger than maxHandles
+	*/
+	static uint8_t ofType(Board::BoardId id, DeviceHandle* handles, uint8_t maxHandles);
+
+	/** Unregister a board's devices. Board's destructor calls it.
+	@param board - board
+	*/
+	static void remove(Board* board);
+};
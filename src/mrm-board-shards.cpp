@@ -0,0 +1,177 @@
+#include "mrm-board-shards.h"
+#if !defined(ESP32)
+#include <chrono>
+#include <thread>
+static std::thread workers[MRM_DECODE_SHARDS];
+#endif
+
+DecodeShards::Shard DecodeShards::shards[MRM_DECODE_SHARDS];
+uint8_t DecodeShards::shardsCount = 0;
+uint8_t DecodeShards::router[MRM_CAN_BUSES][MRM_CAN_IDS];
+std::atomic<bool> DecodeShards::running(false);
+
+/** Partition the boards into shards, balancing the devices, and build the id table. Call it again after CAN Bus ids change,
+like after swapCANIds() or Topology::restore(), with the workers stopped.
+@param count - number of shards, 1 - MRM_DECODE_SHARDS
+@return - shards used
+*/
+uint8_t DecodeShards::assign(uint8_t count){
+	if (count == 0)
+		count = 1;
+	if (count > MRM_DECODE_SHARDS)
+		count = MRM_DECODE_SHARDS;
+	if (count > Board::boardsCount && Board::boardsCount > 0)
+		count = Board::boardsCount;
+	shardsCount = count;
+	memset(router, 0, sizeof(router));
+	uint16_t load[MRM_DECODE_SHARDS] = {};
+	for (uint8_t i = 0; i < MRM_DECODE_SHARDS; i++) {
+		shards[i].boardsCount = 0;
+		if (shards[i].held) { // Routed by the old table
+			shards[i].held = false;
+			shards[i].dropped++;
+		}
+	}
+
+	// Greedy: the board with most devices first, each to the least loaded shard
+	bool placed[MRM_BOARD_MAX_BOARDS] = {};
+	for (uint8_t n = 0; n < Board::boardsCount; n++) {
+		int16_t biggest = -1;
+		for (uint8_t i = 0; i < Board::boardsCount; i++)
+			if (!placed[i] && (biggest < 0 || Board::boards[i]->devices.size() > Board::boards[biggest]->devices.size()))
+				biggest = i;
+		uint8_t lightest = 0;
+		for (uint8_t s = 1; s < shardsCount; s++)
+			if (load[s] < load[lightest])
+				lightest = s;
+		Board* board = Board::boards[biggest];
+		placed[biggest] = true;
+		shards[lightest].boards[shards[lightest].boardsCount++] = board;
+		load[lightest] += board->devices.size();
+		for (Device& device : board->devices)
+			router[device.bus][device.canIdOut & (MRM_CAN_IDS - 1)] = lightest;
+	}
+	return shardsCount;
+}
+
+/** Decode a shard's queued frames. Workers call it, it can also be called directly if no workers were started.
+@param shard - shard's index
+@param maxFrames - stop after this many
+@return - number of frames decoded
+*/
+uint16_t DecodeShards::decode(uint8_t shard, uint16_t maxFrames){
+	if (shard >= shardsCount)
+		return 0;
+	Shard& mine = shards[shard];
+	uint16_t decoded = 0;
+	ShardFrame frame;
+	while (decoded < maxFrames && mine.queue.pop(frame)) {
+		RxFrame& message = frame.message;
+		Board::rxBus = frame.bus;
+		bool claimed = false;
+		for (uint8_t i = 0; i < mine.boardsCount && !claimed; i++)
+#if MRM_CAN_FD
+			claimed = mine.boards[i]->messageDecodeFD(message);
+		if (!claimed && shard == 0 && Board::unclaimedDecode != NULL) {
+			CANMessage classic = message.classic();
+			Board::unclaimedDecode(classic);
+		}
+#else
+			claimed = mine.boards[i]->messageDecode(message);
+		if (!claimed && shard == 0 && Board::unclaimedDecode != NULL)
+			Board::unclaimedDecode(message);
+#endif
+		decoded++;
+	}
+	return decoded;
+}
+
+/** Move frames from the bus queues to the shards' queues. Each shard whose queue is full holds one frame and drops the next ones,
+so the other shards keep getting theirs. Only one thread may call it.
+@param maxFrames - stop after this many
+@return - number of frames moved
+*/
+uint16_t DecodeShards::route(uint16_t maxFrames){
+	if (shardsCount == 0)
+		assign(1);
+	uint16_t moved = 0;
+	for (uint8_t i = 0; i < shardsCount; i++) // Held frames first, to keep each device's order
+		if (shards[i].held && shards[i].queue.push(shards[i].heldFrame)) {
+			shards[i].held = false;
+			moved++;
+		}
+	ShardFrame frame;
+	while (moved < maxFrames && BusRouter::receive(frame.message, &frame.bus)) {
+		Shard& shard = shards[shardOf(frame.message.id, frame.bus)];
+		if (shard.held) // Still full
+			shard.dropped++;
+		else if (shard.queue.push(frame))
+			moved++;
+		else {
+			shard.heldFrame = frame;
+			shard.held = true;
+		}
+#if defined(ESP32)
+		if (shard.task != NULL)
+			xTaskNotifyGive(shard.task);
+#endif
+	}
+	return moved;
+}
+
+/** Worker's body
+@param parameter - shard's index
+*/
+void DecodeShards::work(void* parameter){
+	uint8_t shard = (uint8_t)(uintptr_t)parameter;
+	while (running.load(std::memory_order_relaxed)) {
+		if (decode(shard, 32) == 0) {
+#if defined(ESP32)
+			ulTaskNotifyTake(pdTRUE, 1);
+#else
+			std::this_thread::sleep_for(std::chrono::microseconds(MRM_SHARD_IDLE_US));
+#endif
+		}
+	}
+#if defined(ESP32)
+	shards[shard].task = NULL;
+	shards[shard].working.store(false, std::memory_order_release);
+	vTaskDelete(NULL);
+#endif
+}
+
+/** Start a worker for each shard
+@param priority - FreeRTOS priority, ESP32 only
+*/
+void DecodeShards::start(uint8_t priority){
+	if (shardsCount == 0)
+		assign(1);
+	if (running.exchange(true))
+		return;
+	for (uint8_t i = 0; i < shardsCount; i++) {
+#if defined(ESP32)
+		char name[12];
+		sprintf(name, "mrmDecode%i", i);
+		shards[i].working.store(true, std::memory_order_relaxed);
+		if (xTaskCreatePinnedToCore(work, name, 4096, (void*)(uintptr_t)i, priority, &shards[i].task, i % 2) != pdPASS)
+			shards[i].working.store(false, std::memory_order_relaxed);
+#else
+		workers[i] = std::thread(work, (void*)(uintptr_t)i);
+#endif
+	}
+}
+
+/** Stop the workers after their current frame, and wait for them
+*/
+void DecodeShards::stop(){
+	running.store(false);
+	for (uint8_t i = 0; i < MRM_DECODE_SHARDS; i++) {
+#if defined(ESP32)
+		while (shards[i].working.load(std::memory_order_acquire))
+			vTaskDelay(1);
+#else
+		if (workers[i].joinable())
+			workers[i].join();
+#endif
+	}
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "mrm-board.h"
+#include <atomic>
+
+// Parallel decoding. Boards are partitioned into shards, each decoded by its own worker: a std::thread on a host, a FreeRTOS task on ESP32,
+// pinned to the cores in turn. route() takes frames from BusRouter's bus queues and, by a bus and CAN Bus id table, pushes each into its shard's
+// lock-free queue. A device belongs to exactly one shard, so its frames keep their order and its readings are written by one thread only:
+// each board's readings live in its own arrays, so a shard's readings are its boards'. State the main thread shares with decoding, like
+// LatencyProbe's, is atomic, and batch starts are confirmed by the main thread (Board::startPoll()). Unknown ids go to shard 0, which also calls
+// Board::unclaimedDecode. A shard that falls behind holds one frame and then loses its own frames, never stalling the other shards.
+//
+//   DecodeShards::assign(2);
+//   DecodeShards::start();
+//   loop: BusRouter::poll(bus) for each bus, DecodeShards::route()
+
+#ifndef MRM_DECODE_SHARDS
+#define MRM_DECODE_SHARDS 4 // Maximum number of shards
+#endif
+#ifndef MRM_SHARD_QUEUE_FRAMES
+#define MRM_SHARD_QUEUE_FRAMES 128 // Per shard, must be a power of 2
+#endif
+#ifndef MRM_SHARD_IDLE_US
+#define MRM_SHARD_IDLE_US 100 // Host workers sleep this long when their queue is empty
+#endif
+#define MRM_CAN_IDS 0x800 // Standard 11-bit ids
+
+class DecodeShards{
+	struct ShardFrame{
+		RxFrame message;
+		uint8_t bus;
+	};
+	struct Shard{
+		FrameQueue<ShardFrame, MRM_SHARD_QUEUE_FRAMES> queue;
+		Board* boards[MRM_BOARD_MAX_BOARDS];
+		uint8_t boardsCount = 0;
+		ShardFrame heldFrame; // Taken from a bus queue, waiting for room in the queue
+		bool held = false;
+		uint32_t dropped = 0; // Frames lost because the queue was full and a frame already held
+#if defined(ESP32)
+		TaskHandle_t task = NULL;
+		std::atomic<bool> working; // Task not finished yet
+#endif
+	};
+	static Shard shards[MRM_DECODE_SHARDS];
+	static uint8_t shardsCount; // 0 - not assigned
+	static uint8_t router[MRM_CAN_BUSES][MRM_CAN_IDS]; // Bus and CAN Bus id to shard
+	static std::atomic<bool> running;
+
+	/** Worker's body
+	@param parameter - shard's index
+	*/
+	static void work(void* parameter);
+
+public:
+	/** Partition the boards into shards, balancing the devices, and build the id table. Call it again after CAN Bus ids change,
+	like after swapCANIds() or Topology::restore(), with the workers stopped.
+	@param count - number of shards, 1 - MRM_DECODE_SHARDS
+	@return - shards used
+	*/
+	static uint8_t assign(uint8_t count);
+
+	/** Decode a shard's queued frames. Workers call it, it can also be called directly if no workers were started.
+	@param shard - shard's index
+	@param maxFrames - stop after this many
+	@return - number of frames decoded
+	*/
+	static uint16_t decode(uint8_t shard, uint16_t maxFrames = 0xFFFF);
+
+	/** Times a shard's queue was found full. The first frame that does not fit waits in route(), see dropped().
+	@param shard - shard's index
+	*/
+	static uint32_t overflows(uint8_t shard){ return shard < MRM_DECODE_SHARDS ? shards[shard].queue.overflows : 0; }
+
+	/** Frames a shard lost: its queue was full and another of its frames already waited
+	@param shard - shard's index
+	*/
+	static uint32_t dropped(uint8_t shard){ return shard < MRM_DECODE_SHARDS ? shards[shard].dropped : 0; }
+
+	/** Move frames from the bus queues to the shards' queues. Each shard whose queue is full holds one frame and drops the next ones,
+	so the other shards keep getting theirs. Only one thread may call it.
+	@param maxFrames - stop after this many
+	@return - number of frames moved
+	*/
+	static uint16_t route(uint16_t maxFrames = 0xFFFF);
+
+	/** Shard a CAN Bus id is decoded in
+	@param canId - id
+	@param bus - bus index
+	*/
+	static uint8_t shardOf(uint32_t canId, uint8_t bus = 0){ return bus < MRM_CAN_BUSES ? router[bus][canId & (MRM_CAN_IDS - 1)] : 0; }
+
+	/** Start a worker for each shard
+	@param priority - FreeRTOS priority, ESP32 only
+	*/
+	static void start(uint8_t priority = 2);
+
+	/** Stop the workers after their current frame, and wait for them
+	*/
+	static void stop();
+};
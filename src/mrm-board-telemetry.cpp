@@ -0,0 +1,489 @@
+#include "mrm-board-telemetry.h"
+#include <cstdio>
+
+/** Append an unsigned LEB128 varint
+@param buffer - output
+@param value - value
+@return - bytes written, 1 - 5
+*/
+static uint8_t varintPut(uint8_t* buffer, uint32_t value){
+	uint8_t length = 0;
+	while (value >= 0x80) {
+		buffer[length++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	buffer[length++] = value;
+	return length;
+}
+
+/** Read an unsigned LEB128 varint
+@param buffer - input
+@param end - input's end
+@param value - output
+@return - bytes read, 0 - truncated
+*/
+static uint8_t varintGet(const uint8_t* buffer, const uint8_t* end, uint32_t& value){
+	value = 0;
+	for (uint8_t i = 0; i < 5 && buffer + i < end; i++) {
+		value |= (uint32_t)(buffer[i] & 0x7F) << (7 * i);
+		if ((buffer[i] & 0x80) == 0)
+			return i + 1;
+	}
+	return 0;
+}
+
+// Zigzag: small differences of either sign take few varint bytes
+static uint32_t zigzag(int32_t value){ return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31); }
+static int32_t unzigzag(uint32_t value){ return (int32_t)(value >> 1) ^ -(int32_t)(value & 1); }
+
+/** Fletcher-16
+@param data - bytes
+@param length - their number
+@param checksum - of the preceding bytes, to continue
+@return - checksum
+*/
+static uint16_t fletcher16(const uint8_t* data, uint16_t length, uint16_t checksum = 0){
+	uint16_t sum1 = checksum & 0xFF;
+	uint16_t sum2 = checksum >> 8;
+	for (uint16_t i = 0; i < length; i++) {
+		sum1 = (sum1 + data[i]) % 255;
+		sum2 = (sum2 + sum1) % 255;
+	}
+	return (sum2 << 8) | sum1;
+}
+
+
+/**
+@param writer - output, like a function calling Serial.write(). NULL - only to a file, see fileOpen().
+@param context - passed to writer
+*/
+Telemetry::Telemetry(TelemetryWriter writer, void* context) : writer(writer), context(context) {
+	memset(last, 0, sizeof(last));
+	memset(lastAlive, 0, sizeof(lastAlive));
+}
+
+Telemetry::~Telemetry(){
+	fileClose();
+}
+
+/** All the devices' alive bits, boards in construction order, devices in add() order
+@param alive - output
+@return - number of devices
+*/
+uint8_t Telemetry::aliveGet(uint8_t* alive){
+	memset(alive, 0, MRM_TELEMETRY_DEVICES / 8);
+	uint8_t count = 0;
+	for (uint8_t i = 0; i < Board::boardsCount; i++)
+		for (Device& device : Board::boards[i]->devices) {
+			if (count >= MRM_TELEMETRY_DEVICES)
+				return count;
+			if (device.alive)
+				alive[count / 8] |= 1 << (count % 8);
+			count++;
+		}
+	return count;
+}
+
+/** Add a channel
+@param kind - what to sample
+@param board - board, ignored for TELEMETRY_BUS_LOAD
+@param deviceNumber - device's ordinal number
+@param subsensor - sensor's subsensor, or bus for TELEMETRY_BUS_LOAD
+@return - success
+*/
+bool Telemetry::channelAdd(TelemetryKind kind, Board* board, uint8_t deviceNumber, uint8_t subsensor){
+	if (channelsCount >= MRM_TELEMETRY_CHANNELS) {
+		sprintf(errorMessage, "Max. %i telemetry channels", MRM_TELEMETRY_CHANNELS);
+		return false;
+	}
+	if (kind == TELEMETRY_BUS_LOAD)
+		board = NULL;
+	else if (board == NULL || board->deviceGet(deviceNumber) == nullptr ||
+		(kind == TELEMETRY_ENCODER && board->boardType() != Board::MOTOR_BOARD) ||
+		(kind == TELEMETRY_SENSOR && board->boardType() != Board::SENSOR_BOARD)) {
+		sprintf(errorMessage, "Telemetry: no device %i", deviceNumber);
+		return false;
+	}
+	TelemetryChannel& channel = channels[channelsCount++];
+	channel.board = board;
+	channel.deviceNumber = deviceNumber;
+	channel.subsensor = subsensor;
+	channel.kind = kind;
+	sinceKeyframe = 0; // Catalog changed, written with the next keyframe
+	return true;
+}
+
+/** Add the usual channels: encoders of all motor boards, frames, errors and FPS of all the devices and load of all the buses
+@return - channels added
+*/
+uint8_t Telemetry::channelsAddAll(){
+	uint8_t added = 0;
+	for (uint8_t i = 0; i < Board::boardsCount; i++) {
+		Board* board = Board::boards[i];
+		for (Device& device : board->devices) {
+			if (board->boardType() == Board::MOTOR_BOARD)
+				added += channelAdd(TELEMETRY_ENCODER, board, device.number);
+			added += channelAdd(TELEMETRY_FRAMES, board, device.number);
+			added += channelAdd(TELEMETRY_ERRORS, board, device.number);
+			added += channelAdd(TELEMETRY_FPS, board, device.number);
+		}
+	}
+	for (uint8_t bus = 0; bus < MRM_CAN_BUSES; bus++)
+		added += channelAdd(TELEMETRY_BUS_LOAD, NULL, 0, bus);
+	return added;
+}
+
+/** Also write records to a file
+@param fileName - path. On ESP32 it must be on a mounted file system, like "/spiffs/telemetry.bin".
+@return - success
+*/
+bool Telemetry::fileOpen(const char* fileName){
+	fileClose();
+	file = fopen(fileName, "wb");
+	if (file == NULL) {
+		sprintf(errorMessage, "Telemetry: no file %s", fileName);
+		return false;
+	}
+	sinceKeyframe = 0; // A file must start with a catalog
+	catalogDue = true;
+	return true;
+}
+
+void Telemetry::fileClose(){
+	if (file != NULL) {
+		fclose(file);
+		file = NULL;
+	}
+}
+
+/** Write a record now
+@param keyframe - absolute values, otherwise a keyframe only when due
+*/
+void Telemetry::snapshot(bool keyframe){
+	uint32_t nowMs = millis();
+	uint8_t alive[MRM_TELEMETRY_DEVICES / 8];
+	uint8_t devicesCount = aliveGet(alive);
+	uint8_t aliveBytes = (devicesCount + 7) / 8;
+	// Decoders size deltas' alive bitmap by the catalog's devices, so a device added since needs a new catalog.
+	if (keyframe || sinceKeyframe == 0 || sinceKeyframe >= keyframeEvery || devicesCount != catalogDevices) {
+		keyframe = true;
+		sinceKeyframe = 0;
+	}
+	uint16_t length = 0;
+
+	if (keyframe) {
+		// Catalog: devices' names, then each channel's kind, device's index (0xFF - none) and subsensor
+		payload[length++] = devicesCount;
+		catalogDevices = devicesCount;
+		uint8_t base[MRM_BOARD_MAX_BOARDS]; // Index of each board's first device
+		uint8_t index = 0;
+		for (uint8_t i = 0; i < Board::boardsCount; i++) {
+			base[i] = index;
+			for (Device& device : Board::boards[i]->devices) {
+				if (index++ >= devicesCount)
+					break;
+				uint8_t nameLength = device.name.length() < MRM_TELEMETRY_NAME - 1 ? device.name.length() : MRM_TELEMETRY_NAME - 1;
+				memcpy(&payload[length], device.name.c_str(), nameLength);
+				length += nameLength;
+				payload[length++] = '\0';
+			}
+		}
+		payload[length++] = channelsCount;
+		for (uint8_t i = 0; i < channelsCount; i++) {
+			TelemetryChannel& channel = channels[i];
+			uint8_t device = 0xFF;
+			for (uint8_t j = 0; j < Board::boardsCount && channel.board != NULL; j++)
+				if (Board::boards[j] == channel.board)
+					device = base[j] + channel.deviceNumber;
+			payload[length++] = channel.kind;
+			payload[length++] = device;
+			payload[length++] = channel.subsensor;
+		}
+		uint16_t sum = fletcher16(payload, length);
+		if (catalogDue || sum != catalogChecksum || ++keyframesSinceCatalog >= catalogEvery) {
+			write(TELEMETRY_CATALOG, length);
+			catalogChecksum = sum;
+			keyframesSinceCatalog = 0;
+			catalogDue = false;
+		}
+
+		// Keyframe: time, alive bitmap, absolute values
+		length = 0;
+		for (uint8_t i = 0; i < 4; i++)
+			payload[length++] = nowMs >> (8 * i);
+		memcpy(&payload[length], alive, aliveBytes);
+		length += aliveBytes;
+		for (uint8_t i = 0; i < channelsCount; i++) {
+			last[i] = valueGet(channels[i]);
+			length += varintPut(&payload[length], zigzag(last[i]));
+		}
+		write(TELEMETRY_KEYFRAME, length);
+	}
+	else {
+		// Delta: elapsed time, flags (bit 0 - alive bitmap follows), changed channels' bitmap, their differences
+		length += varintPut(&payload[length], nowMs - lastMs);
+		bool aliveChanged = memcmp(alive, lastAlive, aliveBytes) != 0;
+		payload[length++] = aliveChanged;
+		if (aliveChanged) {
+			memcpy(&payload[length], alive, aliveBytes);
+			length += aliveBytes;
+		}
+		uint8_t* changed = &payload[length];
+		uint8_t changedBytes = (channelsCount + 7) / 8;
+		memset(changed, 0, changedBytes);
+		length += changedBytes;
+		for (uint8_t i = 0; i < channelsCount; i++) {
+			int32_t value = valueGet(channels[i]);
+			if (value != last[i]) {
+				changed[i / 8] |= 1 << (i % 8);
+				length += varintPut(&payload[length], zigzag((int32_t)((uint32_t)value - (uint32_t)last[i])));
+				last[i] = value;
+			}
+		}
+		write(TELEMETRY_DELTA, length);
+	}
+	memcpy(lastAlive, alive, sizeof(lastAlive));
+	lastMs = nowMs;
+	sinceKeyframe++;
+}
+
+/** Write a record if periodMs elapsed. Call it from the main loop.
+@return - written
+*/
+bool Telemetry::tick(){
+	if (millis() - lastMs < periodMs && sinceKeyframe != 0)
+		return false;
+	snapshot();
+	return true;
+}
+
+/** Current value of a channel
+@param channel - channel
+*/
+int32_t Telemetry::valueGet(TelemetryChannel& channel){
+	if (channel.kind == TELEMETRY_BUS_LOAD)
+		return channel.subsensor < MRM_CAN_BUSES ? Board::busLoad[channel.subsensor].loadPerMille() : 0;
+	Device* device = channel.board->deviceGet(channel.deviceNumber);
+	if (device == nullptr)
+		return 0;
+	switch (channel.kind) {
+	case TELEMETRY_ENCODER:
+		return ((MotorBoard*)channel.board)->readingGet(*device).value;
+	case TELEMETRY_SENSOR:
+		return ((SensorBoard*)channel.board)->reading(channel.subsensor, channel.deviceNumber);
+	case TELEMETRY_FRAMES:
+		return device->stats.framesReceived;
+	case TELEMETRY_ERRORS:
+		return device->stats.decodeErrors;
+	case TELEMETRY_FPS:
+		return device->fpsLast;
+	default:
+		return 0;
+	}
+}
+
+/** Frame and write a record
+@param type - TelemetryRecord
+@param length - payload's length
+*/
+void Telemetry::write(uint8_t type, uint16_t length){
+	uint8_t header[5] = {MRM_TELEMETRY_MAGIC, type, sequence++, (uint8_t)length, (uint8_t)(length >> 8)};
+	uint16_t sum = fletcher16(payload, length, fletcher16(&header[1], 4)); // Type, sequence, length and payload
+	uint8_t checksum[2] = {(uint8_t)sum, (uint8_t)(sum >> 8)};
+	if (writer != NULL) {
+		writer(header, sizeof(header), context);
+		writer(payload, length, context);
+		writer(checksum, 2, context);
+	}
+	if (file != NULL) {
+		fwrite(header, sizeof(header), 1, file);
+		fwrite(payload, length, 1, file);
+		fwrite(checksum, 2, 1, file);
+	}
+	bytesWritten += sizeof(header) + length + 2;
+}
+
+
+/** Apply a complete, verified record
+@return - values changed
+*/
+bool TelemetryDecoder::apply(){
+	const uint8_t* payload = record + 4;
+	const uint8_t* next = payload;
+	const uint8_t* end = payload + length;
+	switch (record[0]) {
+	case TELEMETRY_CATALOG: {
+		uint16_t sum = fletcher16(payload, length);
+		if ((sum == catalogChecksum && catalogued) || next >= end)
+			return false; // Repeated for decoders joining late
+		keyed = false; // Values belong to the next keyframe
+		catalogued = true;
+		catalogChecksum = sum;
+		catalogChanged = true;
+		devicesCount = *next++;
+		if (devicesCount > MRM_TELEMETRY_DEVICES)
+			devicesCount = MRM_TELEMETRY_DEVICES;
+		for (uint8_t i = 0; i < devicesCount; i++) {
+			uint8_t j = 0;
+			while (next < end && *next != '\0') {
+				if (j < MRM_TELEMETRY_NAME - 1)
+					names[i][j++] = *next;
+				next++;
+			}
+			names[i][j] = '\0';
+			next++;
+		}
+		if (next >= end)
+			return false;
+		channelsCount = *next++;
+		if (channelsCount > MRM_TELEMETRY_CHANNELS)
+			channelsCount = MRM_TELEMETRY_CHANNELS;
+		for (uint8_t i = 0; i < channelsCount && next + 3 <= end; i++) {
+			channels[i].board = NULL;
+			channels[i].kind = *next++;
+			channels[i].deviceNumber = *next++;
+			channels[i].subsensor = *next++;
+		}
+		return false;
+	}
+	case TELEMETRY_KEYFRAME: {
+		if (length < 4 || !catalogued)
+			return false;
+		timeMs = next[0] | (next[1] << 8) | (next[2] << 16) | ((uint32_t)next[3] << 24);
+		next += 4;
+		uint8_t aliveBytes = (devicesCount + 7) / 8;
+		memcpy(alive, next, next + aliveBytes <= end ? aliveBytes : 0);
+		next += aliveBytes;
+		for (uint8_t i = 0; i < channelsCount; i++) {
+			uint32_t value;
+			uint8_t bytes = varintGet(next, end, value);
+			if (bytes == 0)
+				return false;
+			values[i] = unzigzag(value);
+			next += bytes;
+		}
+		keyed = true;
+		return true;
+	}
+	case TELEMETRY_DELTA: {
+		if (!keyed)
+			return false;
+		uint32_t elapsedMs;
+		uint8_t bytes = varintGet(next, end, elapsedMs);
+		if (bytes == 0 || next + bytes >= end)
+			return false;
+		next += bytes;
+		uint8_t aliveBytes = (devicesCount + 7) / 8;
+		if (*next++ & 1) {
+			if (next + aliveBytes > end)
+				return false;
+			memcpy(alive, next, aliveBytes);
+			next += aliveBytes;
+		}
+		const uint8_t* changed = next;
+		next += (channelsCount + 7) / 8;
+		if (next > end)
+			return false;
+		for (uint8_t i = 0; i < channelsCount; i++)
+			if ((changed[i / 8] >> (i % 8)) & 1) {
+				uint32_t difference;
+				bytes = varintGet(next, end, difference);
+				if (bytes == 0) {
+					keyed = false;
+					return false;
+				}
+				values[i] = (int32_t)((uint32_t)values[i] + (uint32_t)unzigzag(difference));
+				next += bytes;
+			}
+		timeMs += elapsedMs;
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+/** Channel's description
+@param channel - index
+@param text - output, at least 32 characters
+*/
+void TelemetryDecoder::channelName(uint8_t channel, char* text){
+	static const char* kinds[] = {"encoder", "sensor", "frames", "errors", "fps", "bus load"};
+	if (channel >= channelsCount) {
+		text[0] = '\0';
+		return;
+	}
+	TelemetryChannel& c = channels[channel];
+	const char* kind = c.kind < sizeof(kinds) / sizeof(kinds[0]) ? kinds[c.kind] : "?";
+	if (c.kind == TELEMETRY_BUS_LOAD)
+		sprintf(text, "%s %i", kind, c.subsensor);
+	else if (c.kind == TELEMETRY_SENSOR)
+		sprintf(text, "%s %s %i", c.deviceNumber < devicesCount ? names[c.deviceNumber] : "?", kind, c.subsensor);
+	else
+		sprintf(text, "%s %s", c.deviceNumber < devicesCount ? names[c.deviceNumber] : "?", kind);
+}
+
+/** Feed the next byte of the stream
+@param byte - byte
+@return - a record updated values and timeMs
+*/
+bool TelemetryDecoder::feed(uint8_t byte){
+	if (!inRecord) {
+		if (byte == MRM_TELEMETRY_MAGIC) {
+			inRecord = true;
+			recordLength = 0;
+		}
+		return false;
+	}
+	record[recordLength++] = byte;
+	return parse();
+}
+
+/** Check the bytes received since the magic. A record that proves false is rescanned from the byte after its magic, so a real record
+starting inside it is not lost.
+@return - a record updated values and timeMs
+*/
+bool TelemetryDecoder::parse(){
+	bool updated = false;
+	while (inRecord) {
+		bool finished = false; // Valid or not
+		bool valid = false;
+		if (recordLength >= 4) {
+			length = record[2] | (record[3] << 8);
+			if (length > MRM_TELEMETRY_PAYLOAD || (record[0] != TELEMETRY_CATALOG && record[0] != TELEMETRY_KEYFRAME && record[0] != TELEMETRY_DELTA))
+				finished = true; // Not a record, maybe text
+			else if (recordLength >= 4 + length + 2) {
+				finished = true;
+				uint16_t sum = record[4 + length] | (record[4 + length + 1] << 8);
+				valid = sum == fletcher16(record + 4, length, fletcher16(record, 4));
+				if (!valid)
+					corrupted++;
+			}
+		}
+		if (!finished)
+			return updated; // Wait for more bytes
+		if (valid) {
+			if (record[1] != expectedSequence && keyed) {
+				lost += (uint8_t)(record[1] - expectedSequence);
+				if (record[0] == TELEMETRY_DELTA)
+					keyed = false; // A delta is missing, wait for a keyframe
+			}
+			expectedSequence = record[1] + 1;
+			updated |= apply();
+		}
+
+		// Continue with the next magic after the record or, if it was false, after its magic
+		uint16_t magic = valid ? 4 + length + 2 : 0;
+		while (magic < recordLength && record[magic] != MRM_TELEMETRY_MAGIC)
+			magic++;
+		if (magic >= recordLength) {
+			inRecord = false;
+			recordLength = 0;
+		}
+		else {
+			recordLength -= magic + 1;
+			memmove(record, record + magic + 1, recordLength);
+		}
+	}
+	return updated;
+}
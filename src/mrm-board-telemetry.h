@@ -0,0 +1,186 @@
+#pragma once
+
+#include "mrm-board.h"
+
+// Binary telemetry. Telemetry samples chosen channels (encoder counts, sensor readings, frame and error counters, FPS, bus load)
+// and the alive bitmap of all the devices, and writes compact records to a serial port or a file:
+//   catalog - device names and what each channel is, sent before a keyframe when it changed and with every catalogEvery-th keyframe,
+//     so that a decoder may join at any time
+//   keyframe - absolute values
+//   delta - only changed channels, as differences from the previous record, in zigzag varints
+// Each record is framed: MRM_TELEMETRY_MAGIC, type, sequence, 2 bytes payload's length, payload, 2 bytes Fletcher-16 of type to payload.
+// A decoder resynchronises on the magic and the checksum, so records may share a serial port with print() text.
+// TelemetryDecoder decodes the stream, see extras/telemetry-decode.
+
+#ifndef MRM_TELEMETRY_CHANNELS
+#define MRM_TELEMETRY_CHANNELS 64
+#endif
+#ifndef MRM_TELEMETRY_DEVICES
+#define MRM_TELEMETRY_DEVICES 128 // Alive bitmap's and catalog's capacity
+#endif
+#define MRM_TELEMETRY_MAGIC 0xA5
+#define MRM_TELEMETRY_PAYLOAD 1536 // Largest record's payload: a catalog with all the devices
+#define MRM_TELEMETRY_NAME 10 // Device names are shorter, see Board::add()
+
+enum TelemetryRecord{TELEMETRY_CATALOG = 'C', TELEMETRY_KEYFRAME = 'K', TELEMETRY_DELTA = 'D'};
+
+enum TelemetryKind{
+	TELEMETRY_ENCODER, // MotorBoard's encoder count
+	TELEMETRY_SENSOR, // SensorBoard::reading() of a subsensor
+	TELEMETRY_FRAMES, // Frames received from the device, a counter. Its rate is device's actual FPS on the bus.
+	TELEMETRY_ERRORS, // Frames with unknown commands, a counter
+	TELEMETRY_FPS, // FPS the device reported, see Board::fpsRequest()
+	TELEMETRY_BUS_LOAD // Per mille, subsensor is the bus, no device
+};
+
+/** Output for records
+@param data - bytes
+@param length - their number
+@param context - passed to Telemetry's constructor
+*/
+typedef void (*TelemetryWriter)(const uint8_t* data, uint16_t length, void* context);
+
+struct TelemetryChannel{
+	Board* board; // NULL for bus load
+	uint8_t deviceNumber;
+	uint8_t subsensor; // Sensor's subsensor or bus
+	uint8_t kind; // TelemetryKind
+};
+
+class Telemetry{
+	TelemetryChannel channels[MRM_TELEMETRY_CHANNELS];
+	uint8_t channelsCount = 0;
+	int32_t last[MRM_TELEMETRY_CHANNELS]; // Values in the last record
+	uint8_t lastAlive[MRM_TELEMETRY_DEVICES / 8];
+	uint32_t lastMs = 0;
+	uint8_t sequence = 0;
+	uint16_t sinceKeyframe = 0; // 0 - next record is a keyframe
+	uint16_t catalogChecksum = 0; // Of the last catalog written
+	uint8_t catalogDevices = 0; // Devices in the last catalog built
+	uint8_t keyframesSinceCatalog = 0;
+	bool catalogDue = true; // Write the catalog with the next keyframe, even if unchanged
+	TelemetryWriter writer;
+	void* context;
+	FILE* file = NULL;
+	uint8_t payload[MRM_TELEMETRY_PAYLOAD];
+
+	/** All the devices' alive bits, boards in construction order, devices in add() order
+	@param alive - output
+	@return - number of devices
+	*/
+	uint8_t aliveGet(uint8_t* alive);
+
+	/** Current value of a channel
+	@param channel - channel
+	*/
+	int32_t valueGet(TelemetryChannel& channel);
+
+	/** Frame and write a record
+	@param type - TelemetryRecord
+	@param length - payload's length
+	*/
+	void write(uint8_t type, uint16_t length);
+
+public:
+	uint16_t periodMs = 20; // tick() writes a record this often
+	uint16_t keyframeEvery = 50; // Records between keyframes
+	uint8_t catalogEvery = 10; // Keyframes between repeats of an unchanged catalog, for decoders joining late
+	uint32_t bytesWritten = 0;
+
+	/**
+	@param writer - output, like a function calling Serial.write(). NULL - only to a file, see fileOpen().
+	@param context - passed to writer
+	*/
+	Telemetry(TelemetryWriter writer = NULL, void* context = NULL);
+
+	~Telemetry();
+
+	/** Add a channel
+	@param kind - what to sample
+	@param board - board, ignored for TELEMETRY_BUS_LOAD
+	@param deviceNumber - device's ordinal number
+	@param subsensor - sensor's subsensor, or bus for TELEMETRY_BUS_LOAD
+	@return - success
+	*/
+	bool channelAdd(TelemetryKind kind, Board* board, uint8_t deviceNumber = 0, uint8_t subsensor = 0);
+
+	/** Add the usual channels: encoders of all motor boards, frames, errors and FPS of all the devices and load of all the buses
+	@return - channels added
+	*/
+	uint8_t channelsAddAll();
+
+	/** Remove all the channels
+	*/
+	void channelsClear(){ channelsCount = 0; sinceKeyframe = 0; }
+
+	/** Also write records to a file
+	@param fileName - path. On ESP32 it must be on a mounted file system, like "/spiffs/telemetry.bin".
+	@return - success
+	*/
+	bool fileOpen(const char* fileName);
+
+	void fileClose();
+
+	/** Write a record now
+	@param keyframe - absolute values, otherwise a keyframe only when due
+	*/
+	void snapshot(bool keyframe = false);
+
+	/** Write a record if periodMs elapsed. Call it from the main loop.
+	@return - written
+	*/
+	bool tick();
+};
+
+/** Decodes a telemetry stream, byte by byte, for example on a host computer
+*/
+class TelemetryDecoder{
+	uint8_t record[4 + MRM_TELEMETRY_PAYLOAD + 2]; // Bytes after the magic: type, sequence, length, payload and checksum
+	uint16_t recordLength = 0; // Bytes in record
+	bool inRecord = false; // Magic found
+	uint16_t length = 0; // Payload's
+	uint8_t expectedSequence = 0;
+	bool keyed = false; // Values valid, deltas may be applied
+	bool catalogued = false; // A catalog arrived, keyframes may be applied
+	uint16_t catalogChecksum = 0; // Of the last catalog
+
+	/** Apply a complete, verified record
+	@return - values changed
+	*/
+	bool apply();
+
+	/** Check the bytes received since the magic. A record that proves false is rescanned from the byte after its magic, so a real record
+	starting inside it is not lost.
+	@return - a record updated values and timeMs
+	*/
+	bool parse();
+
+public:
+	char names[MRM_TELEMETRY_DEVICES][MRM_TELEMETRY_NAME];
+	uint8_t devicesCount = 0;
+	TelemetryChannel channels[MRM_TELEMETRY_CHANNELS]; // board is NULL, kind and subsensor valid, deviceNumber is the index in names
+	uint8_t channelsCount = 0;
+	int32_t values[MRM_TELEMETRY_CHANNELS];
+	uint8_t alive[MRM_TELEMETRY_DEVICES / 8];
+	uint32_t timeMs = 0; // Robot's millis() of the last record
+	uint32_t lost = 0; // Records missed, detected by the sequence
+	uint32_t corrupted = 0; // Records with wrong checksums
+	bool catalogChanged = false; // Set by a new catalog, the user clears it
+
+	/** Feed the next byte of the stream
+	@param byte - byte
+	@return - a record updated values and timeMs
+	*/
+	bool feed(uint8_t byte);
+
+	/** Channel's description
+	@param channel - index
+	@param text - output, at least 32 characters
+	*/
+	void channelName(uint8_t channel, char* text);
+
+	/** Is a device alive?
+	@param device - index in names
+	*/
+	bool isAlive(uint8_t device){ return (alive[device / 8] >> (device % 8)) & 1; }
+};
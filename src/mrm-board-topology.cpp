@@ -0,0 +1,267 @@
+#include "mrm-board-topology.h"
+#include "mrm-board.h"
+#include "mrm-board-discovery.h"
+#if defined(ESP32)
+#include <Preferences.h>
+#else
+#include <cstdio>
+#endif
+
+#define TOPOLOGY_HEADER_BYTES 10
+#define TOPOLOGY_ALIVE 0x01 // Device's flags
+#define TOPOLOGY_ALIVE_ONCE 0x02
+#define TOPOLOGY_MODE_SHIFT 2 // Bits 2 - 3: measuring mode
+#define TOPOLOGY_DEVICE_BYTES 6
+
+static uint8_t topologyBuffer[MRM_TOPOLOGY_BYTES];
+
+/** CRC-16/CCITT
+@param buffer - data
+@param length - number of bytes
+@return - CRC
+*/
+uint16_t Topology::crc(const uint8_t* buffer, uint16_t length){
+	uint16_t crc = 0xFFFF;
+	for (uint16_t i = 0; i < length; i++) {
+		crc ^= buffer[i] << 8;
+		for (uint8_t bit = 0; bit < 8; bit++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+/** Check a blob's header and payload CRC
+@param buffer - blob
+@param length - number of bytes
+@return - valid
+*/
+bool Topology::headerValid(const uint8_t* buffer, uint16_t length){
+	if (length < TOPOLOGY_HEADER_BYTES)
+		return false;
+	uint32_t magic = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+	uint16_t payloadLength = buffer[6] | (buffer[7] << 8);
+	uint16_t payloadCrc = buffer[8] | (buffer[9] << 8);
+	return magic == MRM_TOPOLOGY_MAGIC && buffer[4] == MRM_TOPOLOGY_VERSION && TOPOLOGY_HEADER_BYTES + payloadLength <= length &&
+		crc(buffer + TOPOLOGY_HEADER_BYTES, payloadLength) == payloadCrc;
+}
+
+/** Construct the boards and devices a blob describes, through Discovery's factory, for an offline tool without the robot's sketch.
+Devices are named as Discovery::sweep() names them. Apply the blob afterwards with deserialize().
+@param buffer - blob
+@param length - number of bytes
+@return - number of boards constructed. Boards whose type has no registered class are skipped, see errorMessage.
+*/
+uint8_t Topology::boardsCreate(const uint8_t* buffer, uint16_t length){
+	if (!headerValid(buffer, length)) {
+		strcpy(errorMessage, "Topology: invalid blob");
+		return 0;
+	}
+	const uint8_t* end = buffer + TOPOLOGY_HEADER_BYTES + (buffer[6] | (buffer[7] << 8));
+	const uint8_t* next = buffer + TOPOLOGY_HEADER_BYTES;
+	uint8_t created = 0;
+	for (uint8_t i = 0; i < buffer[5]; i++) {
+		if (next + 3 > end)
+			break;
+		uint8_t devicesCount = next[1];
+		const uint8_t* devices = next + 3 + next[2];
+		if (devices + TOPOLOGY_DEVICE_BYTES * devicesCount > end)
+			break;
+
+		// The product whose id range holds the board's first device, else the first one of the board's type
+		uint8_t product = 0xFF;
+		for (uint8_t j = 0; j < productsCount; j++)
+			if (products[j].id == next[0] && (product == 0xFF || (devicesCount > 0 &&
+				productIndex(devices[0] | (devices[1] << 8)) == j)))
+				product = j;
+		Board* board = product == 0xFF ? NULL : Discovery::boardCreate(products[product]);
+		if (board == NULL) {
+			if (product != 0xFF)
+				sprintf(errorMessage, "Topology: %s, no Board class", products[product].name);
+			else
+				sprintf(errorMessage, "Topology: unknown board %i", next[0]);
+		}
+		else {
+			for (uint8_t j = 0; j < devicesCount; j++) {
+				const uint8_t* device = devices + TOPOLOGY_DEVICE_BYTES * j;
+				uint16_t canIdIn = device[0] | (device[1] << 8);
+				uint8_t range = productIndex(canIdIn);
+				if (range < productsCount && products[range].id == next[0])
+					Discovery::deviceAdd(board, range, (canIdIn - products[range].canIdBase) / 2, device[5]);
+				else // Swapped to an id outside the product's range, deserialize() restores it
+					Discovery::deviceAdd(board, product, j % MRM_PRODUCT_DEVICES, device[5]);
+			}
+			created++;
+		}
+		next = devices + TOPOLOGY_DEVICE_BYTES * devicesCount;
+	}
+	return created;
+}
+
+/** Apply a blob to the constructed boards. The boards and their devices must be the same ones (type, count, order) as when saved.
+@param buffer - blob
+@param length - number of bytes
+@return - success. If boards or devices do not match, nothing is changed.
+*/
+bool Topology::deserialize(const uint8_t* buffer, uint16_t length){
+	if (!headerValid(buffer, length) || buffer[5] != Board::boardsCount)
+		return false;
+	uint16_t payloadLength = buffer[6] | (buffer[7] << 8);
+
+	// Validate everything first, so that a mismatch changes nothing.
+	const uint8_t* end = buffer + TOPOLOGY_HEADER_BYTES + payloadLength;
+	for (uint8_t pass = 0; pass < 2; pass++) {
+		const uint8_t* next = buffer + TOPOLOGY_HEADER_BYTES;
+		for (uint8_t i = 0; i < Board::boardsCount; i++) {
+			Board* board = Board::boards[i];
+			if (next + 3 > end || next[0] != board->id() || next[1] != board->devices.size())
+				return false;
+			uint8_t configLength = next[2];
+			const uint8_t* config = next + 3;
+			next = config + configLength;
+			if (next + TOPOLOGY_DEVICE_BYTES * board->devices.size() > end)
+				return false;
+			for (uint8_t j = 0; j < board->devices.size(); j++)
+				if (next[TOPOLOGY_DEVICE_BYTES * j + 5] >= MRM_CAN_BUSES ||
+					((next[TOPOLOGY_DEVICE_BYTES * j + 4] >> TOPOLOGY_MODE_SHIFT) & 0x03) >= MRM_MEASURING_MODES)
+					return false;
+			if (pass == 0 ? !board->configValid(config, configLength) : !board->configDeserialize(config, configLength))
+				return false;
+			for (Device& device : board->devices) {
+				if (pass == 1) {
+					device.canIdIn = next[0] | (next[1] << 8);
+					device.canIdOut = next[2] | (next[3] << 8);
+					device.alive = next[4] & TOPOLOGY_ALIVE;
+					device.aliveOnce = next[4] & TOPOLOGY_ALIVE_ONCE;
+					device.measuringMode = (next[4] >> TOPOLOGY_MODE_SHIFT) & 0x03;
+					device.bus = next[5];
+				}
+				next += TOPOLOGY_DEVICE_BYTES;
+			}
+		}
+	}
+	return true;
+}
+
+/** Load the stored blob, apply it and check that all the devices alive when saved respond, in a single sweep.
+@param fileName - file name on a host, NVS key on ESP32
+@return - success. If false, a full Board::devicesScan() is needed.
+*/
+bool Topology::restore(const char* fileName){
+	uint16_t length = 0;
+#if defined(ESP32)
+	Preferences preferences;
+	if (!preferences.begin("mrm", true))
+		return false;
+	length = preferences.getBytes(fileName, topologyBuffer, MRM_TOPOLOGY_BYTES);
+	preferences.end();
+#else
+	FILE* file = fopen(fileName, "rb");
+	if (file == NULL)
+		return false;
+	length = fread(topologyBuffer, 1, MRM_TOPOLOGY_BYTES, file);
+	fclose(file);
+#endif
+	if (!deserialize(topologyBuffer, length))
+		return false;
+
+	// Each device saved as alive must answer again. Counts are not enough: a missing device and a new one would cancel out.
+	uint8_t expected[(MRM_TOPOLOGY_BYTES / TOPOLOGY_DEVICE_BYTES + 7) / 8] = {};
+	uint16_t index = 0;
+	for (uint8_t i = 0; i < Board::boardsCount; i++)
+		for (Device& device : Board::boards[i]->devices) {
+			if (device.alive)
+				expected[index / 8] |= 1 << (index % 8);
+			index++;
+		}
+	Board::aliveSweep();
+	uint16_t missing = 0;
+	index = 0;
+	for (uint8_t i = 0; i < Board::boardsCount; i++)
+		for (Device& device : Board::boards[i]->devices) {
+			if ((expected[index / 8] >> (index % 8) & 1) && !device.alive) {
+				if (missing++ == 0)
+					sprintf(errorMessage, "Topology: %s missing", device.name.c_str());
+			}
+			index++;
+		}
+	if (missing > 1)
+		sprintf(errorMessage, "Topology: %i missing", missing);
+	return missing == 0;
+}
+
+/** Store the current topology
+@param fileName - file name on a host, NVS key on ESP32
+@return - success
+*/
+bool Topology::save(const char* fileName){
+	uint16_t length = serialize(topologyBuffer, MRM_TOPOLOGY_BYTES);
+	if (length == 0) {
+		strcpy(errorMessage, "Topology too big");
+		return false;
+	}
+#if defined(ESP32)
+	Preferences preferences;
+	if (!preferences.begin("mrm", false))
+		return false;
+	bool ok = preferences.putBytes(fileName, topologyBuffer, length) == length;
+	preferences.end();
+#else
+	FILE* file = fopen(fileName, "wb");
+	if (file == NULL)
+		return false;
+	bool ok = fwrite(topologyBuffer, 1, length, file) == length;
+	fclose(file);
+#endif
+	if (!ok)
+		strcpy(errorMessage, "Topology not saved");
+	return ok;
+}
+
+/** Write all the boards' topology into a blob
+@param buffer - output
+@param size - buffer's size
+@return - number of bytes, 0 - no room
+*/
+uint16_t Topology::serialize(uint8_t* buffer, uint16_t size){
+	if (size < TOPOLOGY_HEADER_BYTES)
+		return 0;
+	uint16_t length = TOPOLOGY_HEADER_BYTES;
+	for (uint8_t i = 0; i < Board::boardsCount; i++) {
+		Board* board = Board::boards[i];
+		if (length + 3 > size)
+			return 0;
+		buffer[length] = board->id();
+		buffer[length + 1] = board->devices.size();
+		uint8_t roomForConfig = size - length - 3 > 0xFE ? 0xFE : size - length - 3;
+		uint8_t configLength = board->configSerialize(buffer + length + 3, roomForConfig);
+		if (configLength == 0xFF)
+			return 0;
+		buffer[length + 2] = configLength;
+		length += 3 + configLength;
+		if (length + TOPOLOGY_DEVICE_BYTES * board->devices.size() > size)
+			return 0;
+		for (Device& device : board->devices) {
+			buffer[length] = device.canIdIn & 0xFF;
+			buffer[length + 1] = device.canIdIn >> 8;
+			buffer[length + 2] = device.canIdOut & 0xFF;
+			buffer[length + 3] = device.canIdOut >> 8;
+			buffer[length + 4] = (device.alive ? TOPOLOGY_ALIVE : 0) | (device.aliveOnce ? TOPOLOGY_ALIVE_ONCE : 0) |
+				(device.measuringMode << TOPOLOGY_MODE_SHIFT);
+			buffer[length + 5] = device.bus;
+			length += TOPOLOGY_DEVICE_BYTES;
+		}
+	}
+
+	uint16_t payloadLength = length - TOPOLOGY_HEADER_BYTES;
+	uint16_t payloadCrc = crc(buffer + TOPOLOGY_HEADER_BYTES, payloadLength);
+	uint32_t magic = MRM_TOPOLOGY_MAGIC;
+	for (uint8_t i = 0; i < 4; i++)
+		buffer[i] = (magic >> (8 * i)) & 0xFF;
+	buffer[4] = MRM_TOPOLOGY_VERSION;
+	buffer[5] = Board::boardsCount;
+	buffer[6] = payloadLength & 0xFF;
+	buffer[7] = payloadLength >> 8;
+	buffer[8] = payloadCrc & 0xFF;
+	buffer[9] = payloadCrc >> 8;
+	return length;
+}
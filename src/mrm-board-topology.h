@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Arduino.h"
+
+// Persistent topology cache. Discovered devices' CAN Bus ids (after swapCANIds()), aliveness and boards' configuration are stored in a compact,
+// versioned blob: NVS on ESP32, a file elsewhere. On the next boot restore() applies it and confirms it with a single Board::aliveSweep().
+//
+// Blob: header {magic, version, boards count, payload length, CRC-16 of payload}, then for each board
+// {BoardId, devices count, configuration length, configuration, for each device {canIdIn, canIdOut, flags (alive, alive once, measuring mode), bus}}.
+
+#define MRM_TOPOLOGY_MAGIC 0x5054524D // "MRTP"
+#define MRM_TOPOLOGY_VERSION 2
+#ifndef MRM_TOPOLOGY_BYTES
+#define MRM_TOPOLOGY_BYTES 1024 // Maximum blob size
+#endif
+
+class Topology{
+	/** CRC-16/CCITT
+	@param buffer - data
+	@param length - number of bytes
+	@return - CRC
+	*/
+	static uint16_t crc(const uint8_t* buffer, uint16_t length);
+
+	/** Check a blob's header and payload CRC
+	@param buffer - blob
+	@param length - number of bytes
+	@return - valid
+	*/
+	static bool headerValid(const uint8_t* buffer, uint16_t length);
+
+public:
+	/** Construct the boards and devices a blob describes, through Discovery's factory, for an offline tool without the robot's sketch.
+	Devices are named as Discovery::sweep() names them. Apply the blob afterwards with deserialize().
+	@param buffer - blob
+	@param length - number of bytes
+	@return - number of boards constructed. Boards whose type has no registered class are skipped, see errorMessage.
+	*/
+	static uint8_t boardsCreate(const uint8_t* buffer, uint16_t length);
+
+	/** Apply a blob to the constructed boards. The boards and their devices must be the same ones (type, count, order) as when saved.
+	@param buffer - blob
+	@param length - number of bytes
+	@return - success. If boards or devices do not match, nothing is changed.
+	*/
+	static bool deserialize(const uint8_t* buffer, uint16_t length);
+
+	/** Load the stored blob, apply it and check that all the devices alive when saved respond, in a single sweep.
+	@param fileName - file name on a host, NVS key on ESP32
+	@return - success. If false, a full Board::devicesScan() is needed.
+	*/
+	static bool restore(const char* fileName = "mrm-topology");
+
+	/** Store the current topology
+	@param fileName - file name on a host, NVS key on ESP32
+	@return - success
+	*/
+	static bool save(const char* fileName = "mrm-topology");
+
+	/** Write all the boards' topology into a blob
+	@param buffer - output
+	@param size - buffer's size
+	@return - number of bytes, 0 - no room
+	*/
+	static uint16_t serialize(uint8_t* buffer, uint16_t size);
+};
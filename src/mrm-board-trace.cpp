@@ -0,0 +1,79 @@
+#include "mrm-board-trace.h"
+#include "mrm-board.h"
+#include <cstddef>
+#include <cstdio>
+
+/** Write the ring to a file
+@param fileName - path. On ESP32 it must be on a mounted file system, like "/spiffs/trace.bin".
+@return - success
+*/
+bool FrameTrace::dump(const char* fileName){
+	FILE* file = fopen(fileName, "wb");
+	if (file == NULL) {
+		sprintf(errorMessage, "Trace: no file %s", fileName);
+		return false;
+	}
+	uint32_t total = written.load(std::memory_order_relaxed);
+	uint16_t count = frameCount();
+	TraceFileHeader header = {MRM_TRACE_MAGIC, MRM_TRACE_VERSION, sizeof(TraceFrame), count, total - count};
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	uint16_t oldest = count < MRM_TRACE_FRAMES ? 0 : total % MRM_TRACE_FRAMES;
+	for (uint16_t i = 0; i < count && ok; i++)
+		ok = fwrite(&frames[(oldest + i) % MRM_TRACE_FRAMES], sizeof(TraceFrame), 1, file) == 1;
+	fclose(file);
+	if (!ok)
+		sprintf(errorMessage, "Trace: write failed");
+	return ok;
+}
+
+/** Feed inbound frames of a dumped trace through boards' messageDecode(), or messageDecodeFD() for CAN FD ones, as fast as possible.
+Board::rxBus is set to each frame's bus, so devices sharing an id on different buses take only their own frames.
+@param buffer - trace file's contents, for example memory-mapped
+@param size - buffer's size in bytes
+@param boards - boards to decode with. Each frame is offered to them in order, until one accepts it.
+@param boardsCount - number of boards
+@param unclaimed - output, number of inbound frames no board accepted. Can be NULL.
+@return - number of inbound frames replayed, 0 if the buffer is not a valid trace
+*/
+uint32_t FrameTrace::replay(const uint8_t* buffer, uint32_t size, Board** boards, uint8_t boardsCount, uint32_t* unclaimed){
+	if (unclaimed != NULL)
+		*unclaimed = 0;
+	if (size < sizeof(TraceFileHeader))
+		return 0;
+	TraceFileHeader header;
+	memcpy(&header, buffer, sizeof(header));
+	uint16_t dataOffset = offsetof(TraceFrame, data);
+	if (header.magic != MRM_TRACE_MAGIC || header.version != MRM_TRACE_VERSION || header.frameSize < dataOffset + 8)
+		return 0;
+	uint8_t capacity = header.frameSize - dataOffset > MRM_CAN_FD_BYTES ? MRM_CAN_FD_BYTES : header.frameSize - dataOffset; // Traced payload, by the build that traced
+	if (header.count > (size - sizeof(header)) / header.frameSize)
+		header.count = (size - sizeof(header)) / header.frameSize;
+
+	uint32_t replayed = 0;
+	const uint8_t* next = buffer + sizeof(header);
+	for (uint32_t i = 0; i < header.count; i++, next += header.frameSize) {
+		uint16_t idAndDirection;
+		memcpy(&idAndDirection, next + offsetof(TraceFrame, idAndDirection), sizeof(idAndDirection));
+		if (idAndDirection & MRM_TRACE_OUTBOUND)
+			continue;
+		Board::rxBus = next[offsetof(TraceFrame, bus)];
+		uint8_t length = next[offsetof(TraceFrame, length)];
+		const uint8_t* data = next + dataOffset;
+		bool claimed = false;
+		if (idAndDirection & MRM_TRACE_FD) {
+			CANFDMessage message(idAndDirection & 0x7FF, data, length > capacity ? capacity : length);
+			for (uint8_t j = 0; j < boardsCount && !claimed; j++)
+				claimed = boards[j]->messageDecodeFD(message);
+		}
+		else {
+			CANMessage message(idAndDirection & 0x7FF, (uint8_t*)data, length > 8 ? 8 : length);
+			for (uint8_t j = 0; j < boardsCount && !claimed; j++)
+				claimed = boards[j]->messageDecode(message);
+		}
+		if (!claimed && unclaimed != NULL)
+			(*unclaimed)++;
+		replayed++;
+	}
+	Board::rxBus = 0xFF;
+	return replayed;
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "Arduino.h"
+#include "mrm-can-bus.h"
+#include "mrm-board-transport.h"
+#include <atomic>
+
+// Binary frame trace. A preallocated ring records every frame a Board sends or decodes, with no formatting in the hot path.
+// The ring can be dumped to a file and replayed offline through Board::messageDecode() and messageDecodeFD().
+
+#ifndef MRM_TRACE_FRAMES
+#define MRM_TRACE_FRAMES 1024 // Ring capacity, 9 + MRM_TRACE_BYTES bytes per frame
+#endif
+#if MRM_CAN_FD
+#define MRM_TRACE_BYTES MRM_CAN_FD_BYTES // Payload kept for each frame
+#else
+#define MRM_TRACE_BYTES 8
+#endif
+
+#define MRM_TRACE_MAGIC 0x5443524D // "MRCT"
+#define MRM_TRACE_VERSION 2
+#define MRM_TRACE_OUTBOUND 0x8000 // Direction bit in TraceFrame::idAndDirection
+#define MRM_TRACE_FD 0x4000 // CAN FD frame bit in TraceFrame::idAndDirection
+
+class Board;
+
+#pragma pack(push, 1)
+/** File header, followed by count TraceFrame records, the oldest first.
+*/
+struct TraceFileHeader{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t frameSize; // sizeof(TraceFrame), payload's capacity being the rest after length
+	uint32_t count; // Number of frames that follow
+	uint32_t overwritten; // Frames lost because the ring wrapped
+};
+
+struct TraceFrame{
+	uint32_t timestampUs; // micros() when sent or decoded
+	uint16_t idAndDirection; // Bits 0 - 10: CAN Bus id, bit 14: 1 - CAN FD, bit 15: 1 - outbound, 0 - inbound
+	uint8_t bus; // Device's bus index
+	uint8_t length; // Payload's, up to 64 for FD frames
+	uint8_t data[MRM_TRACE_BYTES]; // FD payloads longer than MRM_TRACE_BYTES are truncated
+};
+#pragma pack(pop)
+
+class FrameTrace{
+	TraceFrame frames[MRM_TRACE_FRAMES];
+	std::atomic<uint32_t> written; // Frames recorded since clear(), slots are claimed atomically so that several decoding threads may record
+
+public:
+	bool enabled = true;
+
+	FrameTrace(){ clear(); }
+
+	/** Empty the ring
+	*/
+	void clear(){ written.store(0, std::memory_order_relaxed); }
+
+	/** Write the ring to a file
+	@param fileName - path. On ESP32 it must be on a mounted file system, like "/spiffs/trace.bin".
+	@return - success
+	*/
+	bool dump(const char* fileName);
+
+	/** Number of frames in the ring
+	*/
+	uint16_t frameCount(){
+		uint32_t total = written.load(std::memory_order_relaxed);
+		return total < MRM_TRACE_FRAMES ? total : MRM_TRACE_FRAMES;
+	}
+
+	/** Record a frame. Called by Board for each sent and decoded frame.
+	@param id - CAN Bus id
+	@param data - payload
+	@param length - payload's length
+	@param fd - CAN FD frame
+	@param outbound - otherwise inbound
+	@param bus - bus index
+	*/
+	void record(uint32_t id, const uint8_t* data, uint8_t length, bool fd, bool outbound, uint8_t bus){
+		if (!enabled)
+			return;
+		TraceFrame& frame = frames[written.fetch_add(1, std::memory_order_relaxed) % MRM_TRACE_FRAMES];
+		frame.timestampUs = micros();
+		frame.idAndDirection = (id & 0x7FF) | (fd ? MRM_TRACE_FD : 0) | (outbound ? MRM_TRACE_OUTBOUND : 0);
+		frame.bus = bus;
+		frame.length = length;
+		for (uint8_t i = 0; i < MRM_TRACE_BYTES; i++)
+			frame.data[i] = i < length ? data[i] : 0;
+	}
+
+	/** Record a classic frame
+	@param message - frame
+	@param outbound - otherwise inbound
+	@param bus - bus index
+	*/
+	void record(CANMessage& message, bool outbound, uint8_t bus){ record(message.id, message.data, message.dlc, false, outbound, bus); }
+
+	/** Record a CAN FD frame
+	@param message - frame
+	@param outbound - otherwise inbound
+	@param bus - bus index
+	*/
+	void record(CANFDMessage& message, bool outbound, uint8_t bus){ record(message.id, message.data, message.length, true, outbound, bus); }
+
+	/** Feed inbound frames of a dumped trace through boards' messageDecode(), or messageDecodeFD() for CAN FD ones, as fast as possible.
+	Board::rxBus is set to each frame's bus, so devices sharing an id on different buses take only their own frames.
+	@param buffer - trace file's contents, for example memory-mapped
+	@param size - buffer's size in bytes
+	@param boards - boards to decode with. Each frame is offered to them in order, until one accepts it.
+	@param boardsCount - number of boards
+	@param unclaimed - output, number of inbound frames no board accepted. Can be NULL.
+	@return - number of inbound frames replayed, 0 if the buffer is not a valid trace
+	*/
+	static uint32_t replay(const uint8_t* buffer, uint32_t size, Board** boards, uint8_t boardsCount, uint32_t* unclaimed = NULL);
+};
@@ -0,0 +1,136 @@
+#include "mrm-board-transport.h"
+#include "mrm-board.h"
+#if defined(ESP32)
+#include "driver/twai.h"
+#endif
+
+CanTransport* BusRouter::transports[MRM_CAN_BUSES];
+FrameQueue<RxFrame, MRM_RX_QUEUE_FRAMES> BusRouter::queues[MRM_CAN_BUSES];
+uint8_t BusRouter::nextBus = 0;
+
+/** Decode queued frames of all the buses with Board::messageDecodeAll() or, for FD frames, Board::messageDecodeAllFD(), taking them from each bus in turn
+@param maxFrames - stop after this many
+@return - number of frames decoded
+*/
+uint16_t BusRouter::decode(uint16_t maxFrames){
+	uint16_t decoded = 0;
+	bool any = true;
+	while (any && decoded < maxFrames) {
+		any = false;
+		for (uint8_t bus = 0; bus < MRM_CAN_BUSES && decoded < maxFrames; bus++) {
+			RxFrame message;
+			if (queues[bus].pop(message)) {
+#if MRM_CAN_FD
+				Board::messageDecodeAllFD(message, bus);
+#else
+				Board::messageDecodeAll(message, bus);
+#endif
+				decoded++;
+				any = true;
+			}
+		}
+	}
+	return decoded;
+}
+
+/** Move received frames of a bus from its controller into the bus' queue. Call it from the bus' receive task or loop.
+@param bus - bus index
+@return - number of frames moved
+*/
+uint16_t BusRouter::poll(uint8_t bus){
+	if (bus >= MRM_CAN_BUSES || transports[bus] == NULL)
+		return 0;
+	uint16_t moved = 0;
+#if MRM_CAN_FD
+	CANFDMessage message;
+	if (transports[bus]->fdCapable()) {
+		while (transports[bus]->receiveFD(message) && queues[bus].push(message))
+			moved++;
+		return moved;
+	}
+#endif
+	CANMessage classic;
+	while (transports[bus]->receive(classic) && queues[bus].push(classic))
+		moved++;
+	return moved;
+}
+
+/** Take the next queued frame, from each bus in turn. Only one thread may call it, or decode().
+@param message - output
+@param bus - output, the frame's bus. Can be NULL.
+@return - a frame was queued
+*/
+bool BusRouter::receive(RxFrame& message, uint8_t* bus){
+	for (uint8_t i = 0; i < MRM_CAN_BUSES; i++) {
+		uint8_t from = nextBus;
+		if (++nextBus >= MRM_CAN_BUSES)
+			nextBus = 0;
+		if (queues[from].pop(message)) {
+			if (bus != NULL)
+				*bus = from;
+			return true;
+		}
+	}
+	return false;
+}
+
+/** Send through a registered controller
+@param message - frame
+@param bus - bus index
+*/
+void BusRouter::transportSend(CANMessage& message, uint8_t bus){
+	if (bus < MRM_CAN_BUSES && transports[bus] != NULL) {
+		if (!transports[bus]->send(message))
+			sprintf(errorMessage, "Bus %i: TX full", bus);
+	}
+	else
+		sprintf(errorMessage, "No bus %i", bus);
+}
+
+/** Send an FD frame through a registered, FD-capable controller
+@param message - frame
+@param bus - bus index
+@return - sent
+*/
+bool BusRouter::transportSendFD(CANFDMessage& message, uint8_t bus){
+	if (!transportExists(bus) || !transports[bus]->fdCapable()) {
+		sprintf(errorMessage, "Bus %i: no FD", bus);
+		return false;
+	}
+	if (!transports[bus]->sendFD(message)) {
+		sprintf(errorMessage, "Bus %i: TX full", bus);
+		return false;
+	}
+	return true;
+}
+
+/** Register a controller
+@param bus - bus index
+@param transport - controller. NULL on bus 0 - frames go to BoardHost::messageSend().
+*/
+void BusRouter::transportSet(uint8_t bus, CanTransport* transport){
+	if (bus < MRM_CAN_BUSES)
+		transports[bus] = transport;
+	else
+		sprintf(errorMessage, "No bus %i", bus);
+}
+
+#if defined(ESP32)
+bool TwaiTransport::receive(CANMessage& message){
+	twai_message_t frame;
+	if (twai_receive(&frame, 0) != ESP_OK)
+		return false;
+	message.id = frame.identifier;
+	message.dlc = frame.data_length_code > 8 ? 8 : frame.data_length_code;
+	memcpy(message.data, frame.data, message.dlc);
+	return true;
+}
+
+bool TwaiTransport::send(CANMessage& message){
+	twai_message_t frame = {};
+	frame.identifier = message.id;
+	frame.data_length_code = message.dlc;
+	memcpy(frame.data, message.data, message.dlc);
+	return twai_transmit(&frame, 0) == ESP_OK;
+}
+#endif
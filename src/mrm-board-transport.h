@@ -0,0 +1,205 @@
+#pragma once
+
+#include "Arduino.h"
+#include "mrm-can-bus.h"
+#include <atomic>
+
+// Multi-bus transport. Each Device carries a bus index, BusRouter sends its frames through that bus' CanTransport
+// and keeps an independent receive queue per bus. Bus 0 without a registered transport is the host's, BoardHost::messageSend().
+// The same CAN Bus ids can be used on different buses: decode() passes each frame's bus to Board::messageDecodeAll(), and
+// Board::isForMe() matches it against Device::bus.
+
+#ifndef MRM_CAN_BUSES
+#define MRM_CAN_BUSES 2
+#endif
+#ifndef MRM_RX_QUEUE_FRAMES
+#define MRM_RX_QUEUE_FRAMES 64 // Per bus, must be a power of 2
+#endif
+// CAN FD. 1 - receive queues hold frames with up to 64 data bytes, FD-capable transports are read with receiveFD().
+#ifndef MRM_CAN_FD
+#define MRM_CAN_FD 0
+#endif
+#define MRM_CAN_FD_BYTES 64
+
+/** CAN FD frame. Classic frames fit too, with length up to 8.
+*/
+struct CANFDMessage{
+	uint32_t id;
+	uint8_t length; // 0 - 8, 12, 16, 20, 24, 32, 48 or 64
+	uint8_t data[MRM_CAN_FD_BYTES];
+
+	CANFDMessage(){}
+	CANFDMessage(uint32_t id, const uint8_t* data, uint8_t length) : id(id), length(length){
+		memcpy(this->data, data, length);
+		memset(this->data + length, 0, fdLength(length) - length);
+		this->length = fdLength(length);
+	}
+	CANFDMessage(const CANMessage& message) : CANFDMessage(message.id, message.data, message.dlc){}
+
+	/** Smallest valid FD payload length that holds a number of bytes
+	@param bytes - 0 - 64
+	@return - length
+	*/
+	static uint8_t fdLength(uint8_t bytes){
+		if (bytes <= 8)
+			return bytes;
+		else if (bytes <= 24)
+			return (bytes + 3) / 4 * 4;
+		else if (bytes <= 32)
+			return 32;
+		else if (bytes <= 48)
+			return 48;
+		else
+			return 64;
+	}
+
+	/** Classic frame with the first 8 bytes
+	*/
+	CANMessage classic(){ return CANMessage(id, data, length > 8 ? 8 : length); }
+};
+
+#if MRM_CAN_FD
+typedef CANFDMessage RxFrame;
+#else
+typedef CANMessage RxFrame;
+#endif
+
+/** One CAN controller, like ESP32 TWAI, an external MCP2515 or a SocketCAN interface
+*/
+class CanTransport{
+public:
+	/** Receive a frame, without waiting
+	@param message - output
+	@return - a frame was received
+	*/
+	virtual bool receive(CANMessage& message) = 0;
+
+	/** Send a frame, without waiting for the bus
+	@param message - frame
+	@return - queued for transmission
+	*/
+	virtual bool send(CANMessage& message) = 0;
+
+	/** Can the controller send and receive CAN FD frames?
+	*/
+	virtual bool fdCapable(){ return false; }
+
+	/** Receive a classic or FD frame, without waiting
+	@param message - output
+	@return - a frame was received
+	*/
+	virtual bool receiveFD(CANFDMessage& message){ return false; }
+
+	/** Send an FD frame, without waiting for the bus
+	@param message - frame
+	@return - queued for transmission
+	*/
+	virtual bool sendFD(CANFDMessage& message){ return false; }
+};
+
+/** Lock-free single-producer, single-consumer queue of frames
+*/
+template <typename T, uint16_t N>
+class FrameQueue{
+	T frames[N];
+	std::atomic<uint16_t> head; // Next to write, producer's
+	std::atomic<uint16_t> tail; // Next to read, consumer's
+
+public:
+	uint32_t overflows = 0;
+
+	FrameQueue(){
+		static_assert((N & (N - 1)) == 0, "FrameQueue size must be a power of 2");
+		head.store(0, std::memory_order_relaxed);
+		tail.store(0, std::memory_order_relaxed);
+	}
+
+	bool pop(T& message){
+		uint16_t t = tail.load(std::memory_order_relaxed);
+		if (t == head.load(std::memory_order_acquire))
+			return false;
+		message = frames[t & (N - 1)];
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool push(const T& message){
+		uint16_t h = head.load(std::memory_order_relaxed);
+		if ((uint16_t)(h - tail.load(std::memory_order_acquire)) >= N) {
+			overflows++;
+			return false;
+		}
+		frames[h & (N - 1)] = message;
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+};
+
+class BusRouter{
+	static CanTransport* transports[MRM_CAN_BUSES];
+	static FrameQueue<RxFrame, MRM_RX_QUEUE_FRAMES> queues[MRM_CAN_BUSES];
+	static uint8_t nextBus; // receive() starts here
+
+public:
+	/** Decode queued frames of all the buses with Board::messageDecodeAll() or, for FD frames, Board::messageDecodeAllFD(), taking them from each bus in turn
+	@param maxFrames - stop after this many
+	@return - number of frames decoded
+	*/
+	static uint16_t decode(uint16_t maxFrames = 0xFFFF);
+
+	/** Move received frames of a bus from its controller into the bus' queue. Call it from the bus' receive task or loop.
+	@param bus - bus index
+	@return - number of frames moved
+	*/
+	static uint16_t poll(uint8_t bus);
+
+	/** Take the next queued frame, from each bus in turn. Only one thread may call it, or decode().
+	@param message - output
+	@param bus - output, the frame's bus. Can be NULL.
+	@return - a frame was queued
+	*/
+	static bool receive(RxFrame& message, uint8_t* bus = NULL);
+
+	/** Is there a controller registered for a bus?
+	@param bus - bus index
+	*/
+	static bool transportExists(uint8_t bus){ return bus < MRM_CAN_BUSES && transports[bus] != NULL; }
+
+	/** Is a bus' controller FD-capable?
+	@param bus - bus index
+	*/
+	static bool transportFD(uint8_t bus){ return transportExists(bus) && transports[bus]->fdCapable(); }
+
+	/** Send through a registered controller
+	@param message - frame
+	@param bus - bus index
+	*/
+	static void transportSend(CANMessage& message, uint8_t bus);
+
+	/** Send an FD frame through a registered, FD-capable controller
+	@param message - frame
+	@param bus - bus index
+	@return - sent
+	*/
+	static bool transportSendFD(CANFDMessage& message, uint8_t bus);
+
+	/** Register a controller
+	@param bus - bus index
+	@param transport - controller. NULL on bus 0 - frames go to BoardHost::messageSend().
+	*/
+	static void transportSet(uint8_t bus, CanTransport* transport);
+
+	/** Frames lost because a bus' queue was full
+	*/
+	static uint32_t overflows(uint8_t bus){ return bus < MRM_CAN_BUSES ? queues[bus].overflows : 0; }
+};
+
+#if defined(ESP32)
+/** ESP32's on-chip TWAI controller. The driver must be installed and started, as mrm-can-bus does.
+*/
+class TwaiTransport : public CanTransport{
+public:
+	bool receive(CANMessage& message);
+	bool send(CANMessage& message);
+};
+#endif
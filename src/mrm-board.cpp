@@ -1,11 +1,69 @@
 #include "mrm-board.h"
+#include "mrm-board-registry.h"
 #include <mrm-pid.h>
 #include "mrm-robot.h"
 
 #define REPORT_STRAY 1
 #define REQUEST_NOTIFICATION 0
 
-std::map<int, std::string>* Board::commandNames = NULL;
+const CommandName Board::commandNames[] = {
+	{COMMAND_SENSORS_MEASURE_CONTINUOUS, "Measure cont"},
+	{COMMAND_SENSORS_MEASURE_ONCE, "Measure once"},
+	{COMMAND_SENSORS_MEASURE_STOP, "Measure stop"},
+	{COMMAND_SENSORS_MEASURE_SENDING, "Measure send"},
+	{COMMAND_SENSORS_MEASURE_CONTINUOUS_REQUEST_NOTIFICATION, "Meas req not"},
+	{COMMAND_SENSORS_MEASURE_CONTINUOUS_AND_RETURN_CALCULATED_DATA, "Meas con cal"},
+	{COMMAND_SENSORS_MEASURE_CALCULATED_SENDING, "Meas cal sen"},
+	{COMMAND_SENSORS_MEASURE_CONTINUOUS_VERSION_2, "Measure co 2"},
+	{COMMAND_SENSORS_MEASURE_CONTINUOUS_VERSION_3, "Measure co 3"},
+	{COMMAND_FIRMWARE_REQUEST, "Firmware req"},
+	{COMMAND_FIRMWARE_SENDING, "Firmware sen"},
+	{COMMAND_RESET, "Reset"},
+	{COMMAND_MESSAGE_SENDING_1, "Messa send 1"},
+	{COMMAND_MESSAGE_SENDING_2, "Messa send 2"},
+	{COMMAND_MESSAGE_SENDING_3, "Messa send 3"},
+	{COMMAND_MESSAGE_SENDING_4, "Messa send 4"},
+	{COMMAND_SPEED_SET, "Speed set   "},
+	{COMMAND_SPEED_SET_REQUEST_NOTIFICATION, "Speed set re"},
+	{COMMAND_DUPLICATE_ID_PING, "Dupl id ping"},
+	{COMMAND_DUPLICATE_ID_ECHO, "Dupl id echo"},
+	{COMMAND_INFO_REQUEST, "Info request"},
+	{COMMAND_INFO_SENDING_1, "Info sendi 1"},
+	{COMMAND_INFO_SENDING_2, "Info sendi 2"},
+	{COMMAND_INFO_SENDING_3, "Info sendi 3"},
+	{COMMAND_PNP_ENABLE, "PnP enable  "},
+	{COMMAND_PNP_DISABLE, "PnP disable "},
+	{COMMAND_FPS_REQUEST, "FPS request "},
+	{COMMAND_FPS_SENDING, "FPS sending "},
+	{COMMAND_PNP_REQUEST, "PnP request "},
+	{COMMAND_PNP_SENDING, "PnP sending "},
+	{COMMAND_TIME_SYNC_REQUEST, "Time sync re"},
+	{COMMAND_TIME_SYNC_SENDING, "Time sync se"},
+	{COMMAND_ID_CHANGE_REQUEST, "Id change re"},
+	{COMMAND_NOTIFICATION, "Notification"},
+	{COMMAND_OSCILLATOR_TEST, "Oscilla test"},
+	{COMMAND_ERROR, "Error"},
+	{COMMAND_CAN_TEST, "CAN test"},
+	{COMMAND_REPORT_ALIVE,  "Report alive"}
+};
+const uint8_t Board::commandNamesCount = sizeof(Board::commandNames) / sizeof(CommandName);
+FrameTrace* Board::frameTrace = NULL;
+LogDeferred Board::logDeferred;
+uint32_t Board::logDroppedReported = 0;
+bool Board::logTaskStarted = false;
+ErrorAggregator Board::errors;
+TxFrame Board::txQueue[MRM_TX_QUEUE_FRAMES];
+uint8_t Board::txHead = 0;
+uint8_t Board::txTail = 0;
+uint32_t Board::txLastUs = 0;
+uint16_t Board::txGapUs = MRM_TX_GAP_US;
+Board* Board::boards[MRM_BOARD_MAX_BOARDS];
+uint8_t Board::boardsCount = 0;
+BusLoad Board::busLoad[MRM_CAN_BUSES];
+LatencyProbe Board::latencyProbe;
+bool (*Board::unclaimedDecode)(CANMessage& message) = NULL;
+thread_local uint8_t Board::rxBus = 0xFF;
+thread_local bool Board::rxPacked = false;
 
 /** Board is a single instance for all boards of the same type, not a single board (if there are more than 1 of the same type)! */
 
@@ -26,56 +84,73 @@ Board::Board(uint8_t maxNumberOfBoards, uint8_t devicesOn1Board, std::string boa
 	_message[28] = '\0';
 	_id = id;
 
-	if (Board::commandNames == NULL)
-	{
-		Board::commandNames = new std::map<int, std::string>();
-		Board::commandNames->insert({COMMAND_SENSORS_MEASURE_CONTINUOUS, "Measure cont"});
-		Board::commandNames->insert({COMMAND_SENSORS_MEASURE_ONCE, "Measure once"});
-		Board::commandNames->insert({COMMAND_SENSORS_MEASURE_STOP, "Measure stop"});
-		Board::commandNames->insert({COMMAND_SENSORS_MEASURE_SENDING, "Measure send"});
-		Board::commandNames->insert({COMMAND_SENSORS_MEASURE_CONTINUOUS_REQUEST_NOTIFICATION, "Meas req not"});
-		Board::commandNames->insert({COMMAND_SENSORS_MEASURE_CONTINUOUS_AND_RETURN_CALCULATED_DATA, "Meas con cal"});
-		Board::commandNames->insert({COMMAND_SENSORS_MEASURE_CALCULATED_SENDING, "Meas cal sen"});
-		Board::commandNames->insert({COMMAND_SENSORS_MEASURE_CONTINUOUS_VERSION_2, "Measure co 2"});
-		Board::commandNames->insert({COMMAND_SENSORS_MEASURE_CONTINUOUS_VERSION_3, "Measure co 3"});
-		Board::commandNames->insert({COMMAND_FIRMWARE_REQUEST, "Firmware req"});
-		Board::commandNames->insert({COMMAND_FIRMWARE_SENDING, "Firmware sen"});
-		Board::commandNames->insert({COMMAND_RESET, "Reset"});
-		Board::commandNames->insert({COMMAND_MESSAGE_SENDING_1, "Messa send 1"});
-		Board::commandNames->insert({COMMAND_MESSAGE_SENDING_2, "Messa send 2"});
-		Board::commandNames->insert({COMMAND_MESSAGE_SENDING_3, "Messa send 3"});
-		Board::commandNames->insert({COMMAND_MESSAGE_SENDING_4, "Messa send 4"});
-		Board::commandNames->insert({COMMAND_SPEED_SET, "Speed set   "});
-		Board::commandNames->insert({COMMAND_SPEED_SET_REQUEST_NOTIFICATION, "Speed set re"});
-		Board::commandNames->insert({COMMAND_DUPLICATE_ID_PING, "Dupl id ping"});
-		Board::commandNames->insert({COMMAND_DUPLICATE_ID_ECHO, "Dupl id echo"});
-		Board::commandNames->insert({COMMAND_INFO_REQUEST, "Info request"});
-		Board::commandNames->insert({COMMAND_INFO_SENDING_1, "Info sendi 1"});
-		Board::commandNames->insert({COMMAND_INFO_SENDING_2, "Info sendi 2"});
-		Board::commandNames->insert({COMMAND_INFO_SENDING_3, "Info sendi 3"});
-		Board::commandNames->insert({COMMAND_FPS_REQUEST, "FPS request "});
-		Board::commandNames->insert({COMMAND_FPS_SENDING, "FPS sending "});
-		Board::commandNames->insert({COMMAND_ID_CHANGE_REQUEST, "Id change re"});
-		Board::commandNames->insert({COMMAND_NOTIFICATION, "Notification"});
-		Board::commandNames->insert({COMMAND_OSCILLATOR_TEST, "Oscilla test"});
-		Board::commandNames->insert({COMMAND_ERROR, "Error"});
-		Board::commandNames->insert({COMMAND_CAN_TEST, "CAN test"});
-		Board::commandNames->insert({COMMAND_REPORT_ALIVE,  "Report alive"});
-	}
+#if !MRM_BOARD_STATIC
+	devices.reserve(maxNumberOfBoards * devicesOn1Board); // No reallocation after setup.
+#endif
+
+	if (boardsCount < MRM_BOARD_MAX_BOARDS)
+		boards[boardsCount++] = this;
+	else
+		sprintf(errorMessage, "Too many boards: %s", boardName.c_str());
+}
+
+Board::~Board() {
+	for (uint8_t i = 0; i < boardsCount; i++)
+		if (boards[i] == this) {
+			for (uint8_t j = i; j + 1 < boardsCount; j++)
+				boards[j] = boards[j + 1];
+			boardsCount--;
+			break;
+		}
+	DeviceRegistry::remove(this);
+	for (uint8_t i = txHead; i != txTail; i++) // Paced frames still queued
+		if (txQueue[i & (MRM_TX_QUEUE_FRAMES - 1)].board == this)
+			txQueue[i & (MRM_TX_QUEUE_FRAMES - 1)].board = NULL;
+}
+
+/** Estimate when readings were acquired
+@param device - device
+@param deviceTime - low 16 bits of device's acquisition time, -1 - not in the frame
+@return - host's micros(). Without a timestamp, the decoding time less the best one-way latency. Without sync, the decoding time.
+*/
+uint32_t Board::acquisitionUs(Device& device, int32_t deviceTime) {
+	uint32_t nowUs = micros();
+	if (device.clock.syncUs == 0)
+		return nowUs;
+	if (deviceTime < 0)
+		return nowUs - device.clock.rttMinUs / 2;
+	// The timestamp wraps every 65.5 ms: complete it with the high bits of device's current time, the latest such time not in the future
+	uint32_t deviceNow = hostToDeviceUs(device, nowUs);
+	uint32_t acquired = (deviceNow & 0xFFFF0000) | (uint16_t)deviceTime;
+	if ((int32_t)(acquired - deviceNow) > 0)
+		acquired -= 0x10000;
+	return deviceToHostUs(device, acquired);
 }
 
 /** Add a device.
 @param deviceName
 @param canIn
 @param canOut
+@param bus - CAN Bus index
 */
-void Board::add(std::string deviceName, uint16_t canIn, uint16_t canOut) {
+void Board::add(std::string deviceName, uint16_t canIn, uint16_t canOut, uint8_t bus) {
 if (deviceName.length() > 9) {
 		sprintf(errorMessage, "Name too long: %s", deviceName.c_str());
 		return;
 	}
-	devices.push_back({deviceName, canIn, canOut, (uint8_t)devices.size()});
+#if MRM_BOARD_STATIC
+	if (devices.size() >= devices.capacity()) {
+		sprintf(errorMessage, "Too many devices: %s", deviceName.c_str());
+		return;
+	}
+#endif
+	if (bus >= MRM_CAN_BUSES) {
+		sprintf(errorMessage, "No bus %i: %s", bus, deviceName.c_str());
+		return;
+	}
+	devices.push_back({deviceName, canIn, canOut, (uint8_t)devices.size(), bus});
 	nextFree++;
+	DeviceRegistry::add(this, devices.size() - 1);
 }
 
 /** Did it respond to last ping? If not, try another ping and see if it responds.
@@ -117,6 +192,32 @@ uint8_t Board::aliveCount(){
 }
 
 
+/** Ping all the devices of all the boards in one paced burst and collect the answers during a single window, instead of a scan per device
+@param windowMs - collection time. 0 - one scan's time.
+@return - number of alive devices
+*/
+uint8_t Board::aliveSweep(uint16_t windowMs) {
+	if (boardsCount == 0)
+		return 0;
+	if (windowMs == 0)
+		windowMs = PAUSE_MICRO_S_BETWEEN_DEVICE_SCANS * 3 / 1000;
+	for (uint8_t i = 0; i < boardsCount; i++) {
+		boards[i]->aliveSet(false);
+		for (Device& device : boards[i]->devices) {
+			boards[i]->canData[0] = COMMAND_REPORT_ALIVE;
+			boards[i]->txEnqueueWait(boards[i]->canData, 1, device.number); // Paced: devices of the same kind miss frames sent back to back.
+		}
+	}
+	txFlush();
+	boards[0]->delayMs(windowMs); // Answers are decoded meanwhile.
+
+	uint8_t alive = 0;
+	for (uint8_t i = 0; i < boardsCount; i++)
+		alive += boards[i]->aliveCount();
+	return alive;
+}
+
+
 /** Set aliveness
 @param yesOrNo
 @param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
@@ -152,16 +253,106 @@ bool Board::canGap() {
 	return false;
 }
 
+/** Round-trip latency benchmark. Sends timestamped COMMAND_CAN_TEST frames, matches the echoes and prints min, median and 99th percentile,
+overall and for each bus load quarter.
+@param device - device, nullptr - all alive devices
+@param probes - number of frames to send to each device, up to MRM_LATENCY_SAMPLES
+@param betweenMs - pause between 2 frames
+*/
+void Board::canTest(Device* device, uint16_t probes, uint16_t betweenMs) {
+	if (device == nullptr) {
+		for (Device& dev : devices)
+			if (dev.alive)
+				canTest(&dev, probes, betweenMs);
+		return;
+	}
+
+	latencyProbe.clear();
+	latencyProbe.device = device;
+	for (uint16_t i = 0; i < probes && i < MRM_LATENCY_SAMPLES; i++) {
+		uint32_t nowUs = micros();
+		canData[0] = COMMAND_CAN_TEST;
+		canData[1] = nowUs & 0xFF;
+		canData[2] = (nowUs >> 8) & 0xFF;
+		canData[3] = (nowUs >> 16) & 0xFF;
+		canData[4] = (nowUs >> 24) & 0xFF;
+		canData[5] = ++latencyProbe.sequence;
+		latencyProbe.sent(canData[5]);
+		messageSend(canData, 6, device->number);
+		delayMs(betweenMs); // Echoes are decoded meanwhile.
+	}
+	delayMs(20); // Late echoes
+	latencyProbe.device = NULL;
+
+	LatencyProbe::Result result = latencyProbe.result();
+	if (result.count == 0) {
+		print("%s: no echo\n\r", device->name.c_str());
+		return;
+	}
+	print("%s: %i/%i echoes, min %i us, median %i us, p99 %i us\n\r", device->name.c_str(), result.count, probes, result.minimumUs, 
+		result.medianUs, result.p99Us);
+	for (uint16_t load = 0; load < 1000; load += 250) {
+		result = latencyProbe.result(load, load == 750 ? 1001 : load + 250);
+		if (result.count != 0)
+			print("  load %i-%i %%: %i, min %i us, median %i us, p99 %i us\n\r", load / 10, load / 10 + 25, result.count, 
+				result.minimumUs, result.medianUs, result.p99Us);
+	}
+}
+
 std::string Board::commandName(uint8_t byte){
 	return "";
 }
 
 std::string Board::commandNameCommon(uint8_t byte){
-	auto it = commandNames->find(byte);
-	if (it == commandNames->end())
-		return "Warning: no common command found for key " + (int)byte;
-	else
-		return it->second;
+	// Binary search, commandNames is sorted.
+	int16_t low = 0;
+	int16_t high = commandNamesCount - 1;
+	while (low <= high) {
+		int16_t middle = (low + high) / 2;
+		if (commandNames[middle].command == byte)
+			return commandNames[middle].name;
+		else if (commandNames[middle].command < byte)
+			low = middle + 1;
+		else
+			high = middle - 1;
+	}
+	return "Warning: no common command found for key " + std::to_string(byte);
+}
+
+
+/** Restore board-specific configuration saved by configSerialize()
+@param buffer - data
+@param length - number of bytes
+@return - success
+*/
+bool Board::configDeserialize(const uint8_t* buffer, uint8_t length) {
+	if (!configValid(buffer, length))
+		return false;
+	measuringMode = buffer[0];
+	return true;
+}
+
+
+/** Check configuration saved by configSerialize() without applying it
+@param buffer - data
+@param length - number of bytes
+@return - configDeserialize() would succeed
+*/
+bool Board::configValid(const uint8_t* buffer, uint8_t length) {
+	return length >= 1 && buffer[0] < MRM_MEASURING_MODES;
+}
+
+
+/** Write board-specific configuration, like measuring mode, for Topology
+@param buffer - output
+@param size - buffer's size
+@return - number of bytes written, 0xFF - no room
+*/
+uint8_t Board::configSerialize(uint8_t* buffer, uint8_t size) {
+	if (size < 1)
+		return 0xFF;
+	buffer[0] = measuringMode;
+	return 1;
 }
 
 
@@ -177,16 +368,6 @@ uint8_t Board::count() {
 }
 
 
-void Board::delayMs(uint16_t ms){
-	if (delayMsParent)
-		delayMsParent(ms);
-	else{
-		print("delayMsParent() not defined.\n\r");
-		exit(1);
-	}
-}
-
-
 Device* Board::deviceGet(uint8_t deviceNumber){
 	if (deviceNumber < devices.size())
 		return &devices[deviceNumber];
@@ -195,13 +376,79 @@ Device* Board::deviceGet(uint8_t deviceNumber){
 }
 
 
+/** Convert a device's time to host's
+@param device - device
+@param deviceUs - device's micros()
+@return - host's micros()
+*/
+uint32_t Board::deviceToHostUs(Device& device, uint32_t deviceUs){
+	DeviceClock& clock = device.clock;
+	uint32_t hostUs = deviceUs - clock.offsetUs; // Without drift, then corrected by the drift accumulated until then
+	return deviceUs - clock.offsetUs - (int32_t)(clock.driftPpm * (int32_t)(hostUs - clock.syncUs) / 1e6f);
+}
+
+
 uint8_t Board::deviceNumber(uint16_t msgId){
-	for(auto device: devices)
+	for(Device& device: devices)
 		if (isForMe(msgId, device) || isFromMe(msgId, device)) 
 			return device.number;
 	return 0xFF;
 }
 
+/** Bytes occupied by this board's object and its storage
+@return - bytes
+*/
+uint32_t Board::memoryFootprint(){
+#if MRM_BOARD_STATIC
+	return sizeof(Board);
+#else
+	return sizeof(Board) + devices.capacity() * sizeof(Device);
+#endif
+}
+
+
+/** Print memory footprint
+*/
+void Board::memoryFootprintPrint(){
+	print("%s: %u bytes, %u/%u devices, %s\n\r", _boardsName.c_str(), (unsigned int)memoryFootprint(), (unsigned int)devices.size(),
+		(unsigned int)(maximumNumberOfBoards * devicesOnABoard), MRM_BOARD_STATIC ? "static" : "heap");
+}
+
+
+/** Detect devices sharing a CAN Bus id. Pings all the devices of all the boards in one paced burst, then collects echoes during a single window.
+More than one echo for an id means more than one physical device uses it.
+@param windowMs - collection time. 0 - one scan's time.
+@return - number of conflicting ids
+*/
+uint8_t Board::duplicatesScan(uint16_t windowMs) {
+	if (boardsCount == 0)
+		return 0;
+	if (windowMs == 0)
+		windowMs = PAUSE_MICRO_S_BETWEEN_DEVICE_SCANS * 3 / 1000;
+	for (uint8_t i = 0; i < boardsCount; i++)
+		for (Device& device : boards[i]->devices) {
+			device.duplicateEchoes = 0;
+			device.duplicateSignaturesCount = 0;
+			boards[i]->canData[0] = COMMAND_DUPLICATE_ID_PING;
+			boards[i]->txEnqueueWait(boards[i]->canData, 1, device.number); // Paced: devices of the same kind miss frames sent back to back.
+		}
+	txFlush();
+	boards[0]->delayMs(windowMs); // Echoes are decoded meanwhile.
+
+	uint8_t conflicts = 0;
+	for (uint8_t i = 0; i < boardsCount; i++)
+		for (Device& device : boards[i]->devices)
+			if (device.duplicateEchoes > 1 || device.duplicateSignaturesCount > 1) {
+				print("%s (0x%02x): %i echoes, %i distinct\n\r", device.name.c_str(), device.canIdIn, device.duplicateEchoes, 
+					device.duplicateSignaturesCount);
+				conflicts++;
+			}
+	if (conflicts == 0)
+		print("No duplicate ids\n\r");
+	return conflicts;
+}
+
+
 /** Ping devices and refresh alive array
 @param verbose - prints statuses
 @param mask - bitwise, 16 bits - no more than 16 devices! Bit == 1 - scan, 0 - no scan.
@@ -218,26 +465,6 @@ void Board::devicesScan(uint16_t mask) {
 }
 
 
-void Board::end(){
-	if (endParent)
-		endParent();
-	else{
-		print("endParent() not defined.\n\r");
-		exit(1);
-	}
-}
-
-
-void Board::errorAdd(CANMessage message, uint8_t errorCode, bool peripheral, bool printNow){
-	if (errorAddParent)
-		errorAddParent(message, errorCode, peripheral, printNow);
-	else{
-		print("errorAddParent() not defined.\n\r");
-		exit(1);
-	}
-}
-
-
 /** Request firmware version
 @param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
 */
@@ -314,14 +541,14 @@ void Board::info(Device* device) {
 }
 
 
-/** Is the frame addressed to this device's Arduino object?
+/** Is the frame addressed to this device's Arduino object? Not if it came from another bus, see rxBus.
 @param canIdOut - CAN Bus id.
 @param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the deviceNumber, starting with 0.
 @return - if true, it is
 */
 bool Board::isForMe(uint32_t canId, Device& device) {
 
-	return canId == device.canIdOut;
+	return canId == device.canIdOut && (rxBus == 0xFF || rxBus == device.bus);
 }
 
 /** Does the frame originate from this device's Arduino object?
@@ -341,19 +568,34 @@ bool Board::isFromMe(uint32_t canId, Device& device) {
 @return - command found
 */
 bool Board::messageDecodeCommon(CANMessage& message, Device& device) {
-	device.lastMessageReceivedMs = millis();
+	messageReceived(message, device);
 	bool found = true;
 	uint8_t command = message.data[0];
 	switch (command) {
-	case COMMAND_DUPLICATE_ID_ECHO:
+	case COMMAND_DUPLICATE_ID_ECHO: {
+		if (device.duplicateEchoes < 0xFF)
+			device.duplicateEchoes++;
+		uint32_t signature = message.dlc;
+		for (uint8_t i = 1; i < message.dlc; i++)
+			signature = signature * 31 + message.data[i];
+		bool known = false;
+		for (uint8_t i = 0; i < device.duplicateSignaturesCount && !known; i++)
+			known = device.duplicateSignatures[i] == signature;
+		if (!known && device.duplicateSignaturesCount < MRM_DUPLICATE_SIGNATURES)
+			device.duplicateSignatures[device.duplicateSignaturesCount++] = signature;
+		break;
+	}
 	case COMMAND_DUPLICATE_ID_PING:
 		break;
 	case COMMAND_ERROR:
-		errorAdd(message, message.data[1], true, true);
+		if (errors.add(message.id, device.name.c_str(), message.data[1], true)) {
+			errorAdd(message, message.data[1], true, false);
+			logDeferred.add(LOG_ERROR, device.name.c_str(), message.data[1]);
+		}
 		break;
 	case COMMAND_FIRMWARE_SENDING: {
 		uint16_t firmwareVersion = (message.data[2] << 8) | message.data[1];
-		print("%s: ver. %i \n\r", device.name.c_str(), firmwareVersion);
+		logDeferred.add(LOG_FIRMWARE, device.name.c_str(), firmwareVersion);
 	}
 		break;
 	case COMMAND_FPS_SENDING:
@@ -374,14 +616,25 @@ bool Board::messageDecodeCommon(CANMessage& message, Device& device) {
 	case COMMAND_MESSAGE_SENDING_4:
 		for (uint8_t i = 0; i < 7; i++)
 			_message[21 + i] = message.data[i + 1];
-		print("Message from %s: %s\n\r", device.name.c_str(), _message);
+		logDeferred.addText(LOG_MESSAGE, device.name.c_str(), (char*)_message);
 		break;
-	case COMMAND_NOTIFICATION:
 	case COMMAND_CAN_TEST:
+		if (latencyProbe.device == &device && message.dlc >= 6 && latencyProbe.echoed(message.data[5])) {
+			uint32_t sentUs = message.data[1] | (message.data[2] << 8) | (message.data[3] << 16) | ((uint32_t)message.data[4] << 24);
+			latencyProbe.add(micros() - sentUs, busLoad[device.bus].loadPerMille());
+		}
+		break;
+	case COMMAND_NOTIFICATION:
+		break;
+	case COMMAND_PNP_SENDING:
+		device.pnp = message.data[1];
 		break;
 	case COMMAND_REPORT_ALIVE:
 		device.alive = true;
 		break;
+	case COMMAND_TIME_SYNC_SENDING:
+		timeSyncDecode(message, device);
+		break;
 	default:
 		found = false;
 	}
@@ -389,6 +642,87 @@ bool Board::messageDecodeCommon(CANMessage& message, Device& device) {
 }
 
 
+/** Common part of FD frames' decoding. Only frames longer than classic ones get here.
+@param message - frame
+@param device - device
+@return - command found
+*/
+bool Board::messageDecodeCommonFD(CANFDMessage& message, Device& device) {
+	switch (message.data[0]) {
+	case COMMAND_MESSAGE_SENDING_1: { // Whole text in one frame
+		CANMessage classic = message.classic();
+		messageReceived(classic, device, &message);
+		uint8_t i;
+		for (i = 0; i < 28 && i + 1 < message.length; i++)
+			_message[i] = message.data[i + 1];
+		_message[i] = '\0';
+		logDeferred.addText(LOG_MESSAGE, device.name.c_str(), (char*)_message);
+		return true;
+	}
+	default:
+		return false;
+	}
+}
+
+
+/** Read a CAN FD frame into local variables. FD payloads extend classic ones, so frames up to 8 bytes go to messageDecode(). A longer frame
+that is not a common FD command packs classic frames back to back, 8 bytes each, command byte first, for example all of a sensor array's
+readings frames; each part goes to messageDecode(), until a part with command 0 (padding).
+@param message - frame
+@return - true if canId for this class
+*/
+bool Board::messageDecodeFD(CANFDMessage& message) {
+	CANMessage classic = message.classic();
+	if (message.length <= 8)
+		return messageDecode(classic);
+	for (Device& device : devices)
+		if (isForMe(message.id, device)) {
+			if (messageDecodeCommonFD(message, device))
+				return true;
+			messageReceived(classic, device, &message);
+			rxPacked = true;
+			for (uint8_t i = 0; i < message.length && message.data[i] != 0; i += 8) {
+				CANMessage part(message.id, message.data + i, message.length - i > 8 ? 8 : message.length - i);
+				messageDecode(part);
+			}
+			rxPacked = false;
+			return true;
+		}
+	return false;
+}
+
+
+/** Offer a received frame to all the boards and, if none claims it, to unclaimedDecode. Host calls it for each received frame.
+@param message - frame
+@param bus - bus it came from, only devices on it take it. 0xFF - any.
+@return - claimed
+*/
+bool Board::messageDecodeAll(CANMessage& message, uint8_t bus) {
+	rxBus = bus;
+	for (uint8_t i = 0; i < boardsCount; i++)
+		if (boards[i]->messageDecode(message))
+			return true;
+	return unclaimedDecode != NULL && unclaimedDecode(message);
+}
+
+
+/** Offer a received FD frame to all the boards and, if none claims it, to unclaimedDecode
+@param message - frame
+@param bus - bus it came from, only devices on it take it. 0xFF - any.
+@return - claimed
+*/
+bool Board::messageDecodeAllFD(CANFDMessage& message, uint8_t bus) {
+	rxBus = bus;
+	for (uint8_t i = 0; i < boardsCount; i++)
+		if (boards[i]->messageDecodeFD(message))
+			return true;
+	if (unclaimedDecode == NULL)
+		return false;
+	CANMessage classic = message.classic();
+	return unclaimedDecode(classic);
+}
+
+
 /** Prints a frame
 @param msgId - messageId
 @param dlc - data length
@@ -397,35 +731,62 @@ bool Board::messageDecodeCommon(CANMessage& message, Device& device) {
 @return - if true, found and printed
 */
 void Board::messagePrint(CANMessage& message, bool outbound) {
-	messagePrintParent(message, this, 0xFF, outbound, false, "");
+	BoardHost::messagePrint(message, this, 0xFF, outbound, false, "");
 }
 
-/** Send CAN Bus message
-@param dlc - data length
-@param data - payload
-@param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+/** Bookkeeping for each received frame: aliveness time, counters, bus load and trace
+@param message - frame, FD ones with their first 8 bytes
+@param device - device
+@param fdMessage - the whole FD frame, NULL - classic frame
 */
-void Board::messageSend(uint8_t* data, uint8_t dlc, uint8_t deviceNumber) {
-	if (messageSendParent){
-		CANMessage message(devices[deviceNumber].canIdIn, data, dlc);
-		messageSendParent(message, deviceNumber);
+void Board::messageReceived(CANMessage& message, Device& device, CANFDMessage* fdMessage) {
+	if (rxPacked) // A part of an FD frame, counted as a whole
+		return;
+	uint32_t nowMs = millis();
+	if (device.stats.framesReceived++ != 0) {
+		uint32_t gapMs = nowMs - device.lastMessageReceivedMs;
+		uint8_t bucket = 0;
+		while (gapMs > 0 && bucket < MRM_STATS_BUCKETS - 1) {
+			gapMs >>= 1;
+			bucket++;
+		}
+		device.stats.interArrival[bucket]++;
 	}
-	else{
-		print("messageSendParent() not defined.\n\r");
-		exit(1);
+	device.lastMessageReceivedMs = nowMs;
+	if (fdMessage != NULL)
+		busLoad[device.bus].addFD(fdMessage->length);
+	else
+		busLoad[device.bus].add(message.dlc);
+	if (frameTrace != NULL) {
+		if (fdMessage != NULL)
+			frameTrace->record(*fdMessage, false, device.bus);
+		else
+			frameTrace->record(message, false, device.bus);
 	}
 }
 
 
-void Board::noLoopWithoutThis(){
-	if (noLoopWithoutThisParent)
-		noLoopWithoutThisParent();
-	else{
-		print("noLoopWithoutThisParent() not defined.\n\r");
-		exit(1);
+/** Send a CAN FD frame. Needs an FD-capable transport on the device's bus. Payloads up to 8 bytes fall back to classic frames.
+@param data - payload
+@param length - up to 64
+@param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+@return - sent
+*/
+bool Board::messageSendFD(uint8_t* data, uint8_t length, uint8_t deviceNumber) {
+	Device& device = devices[deviceNumber];
+	if (length <= 8 && !BusRouter::transportFD(device.bus)) {
+		messageSend(data, length, deviceNumber);
+		return true;
 	}
+	CANFDMessage message(device.canIdIn, data, length > MRM_CAN_FD_BYTES ? MRM_CAN_FD_BYTES : length);
+	if (frameTrace != NULL)
+		frameTrace->record(message, true, device.bus);
+	device.stats.framesSent++;
+	busLoad[device.bus].addFD(message.length);
+	return BusRouter::transportSendFD(message, device.bus);
 }
 
+
 /** Request notification
 @param commandRequestingNotification
 @param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
@@ -502,25 +863,11 @@ void Board::reset(Device* device) {
 }
 
 
-uint16_t Board::serialReadNumber(uint16_t timeoutFirst, uint16_t timeoutBetween, bool onlySingleDigitInput, 
-		uint16_t limit, bool printWarnings){
-	if (serialReadNumberParent)
-		return serialReadNumberParent(timeoutFirst, timeoutBetween, onlySingleDigitInput, 
-			limit, printWarnings);
-	else{
-		print("serialReadNumberParent() not defined.\n\r");
-		exit(1);
-	}
-}
-
-
 bool Board::setup(){
-	if (setupParent)
-		return setupParent();
-	else{
-		print("setupParent() not defined.\n\r");
-		exit(1);
-	}
+#if MRM_BOARD_STATIC
+	memoryFootprintPrint();
+#endif
+	return BoardHost::setup();
 }
 
 /** Starts periodical CANBus messages that will be refreshing values that can be read by reading()
@@ -535,21 +882,12 @@ void Board::start(Device* device, uint8_t measuringModeNow, uint16_t refreshMs)
 	else {
 		if (device->alive) {
 			// print("Alive, start reading: %s\n\r", _boardsName.c_str());
+			uint8_t dlc = startFrame(canData, measuringModeNow, refreshMs); // Also clamps the mode
+			device->measuringMode = measuringMode;
 #if REQUEST_NOTIFICATION
 			notificationRequest(COMMAND_SENSORS_MEASURE_CONTINUOUS_REQUEST_NOTIFICATION, device);
 #else
-			if (measuringModeNow == 0 || measuringModeLimit == 0)
-				canData[0] = COMMAND_SENSORS_MEASURE_CONTINUOUS;
-			else if (measuringModeNow == 1 || measuringModeLimit >= 1)
-				canData[0] = COMMAND_SENSORS_MEASURE_CONTINUOUS_VERSION_2;
-			else
-				canData[0] = COMMAND_SENSORS_MEASURE_CONTINUOUS_VERSION_3;
-			measuringMode = measuringModeNow;
-			if (refreshMs != 0) {
-				canData[1] = refreshMs & 0xFF;
-				canData[2] = (refreshMs >> 8) & 0xFF;
-			}
-			messageSend(canData, refreshMs == 0 ? 1 : 3, device->number);
+			messageSend(canData, dlc, device->number);
 
 			// if (++dumpCnt >= DUMP_LIMIT)
 			// 	dumpCnt = 0;
@@ -562,6 +900,132 @@ void Board::start(Device* device, uint8_t measuringModeNow, uint16_t refreshMs)
 	}
 }
 
+/** Print all devices' bus counters
+*/
+void Board::statsPrint() {
+	for (Device& device : devices) {
+		print("%s: rx %i, tx %i, err %i, start ", device.name.c_str(), device.stats.framesReceived, device.stats.framesSent, 
+			device.stats.decodeErrors);
+		if (device.stats.startLatencyMs == 0xFFFF)
+			print("-");
+		else
+			print("%i ms", device.stats.startLatencyMs);
+		print(", gaps");
+		for (uint8_t i = 0; i < MRM_STATS_BUCKETS; i++)
+			print(" %i", device.stats.interArrival[i]);
+		print("\n\r");
+	}
+}
+
+
+/** Reset bus counters
+@param device - device, nullptr - all devices
+*/
+void Board::statsReset(Device* device) {
+	if (device == nullptr)
+		for (Device& dev : devices)
+			statsReset(&dev);
+	else
+		device->stats = DeviceStats();
+}
+
+
+/** Start all the alive devices without blocking: the frames leave through the paced queue. Follow with startPoll() until it returns 0.
+@param measuringModeNow - Measuring mode id. Default 0.
+@param refreshMs - gap between 2 CAN Bus messages to refresh local Arduino copy of device's data. 0 - device's default.
+@param bus - only devices on this bus, 0xFF - all. Each bus keeps its own frame, so buses can have different refresh periods.
+*/
+void Board::startBatch(uint8_t measuringModeNow, uint16_t refreshMs, uint8_t bus) {
+	uint8_t data[3];
+	uint8_t dlc = startFrame(data, measuringModeNow, refreshMs);
+	for (Device& device : devices)
+		if (device.alive && (bus == 0xFF || device.bus == bus))
+			device.measuringMode = measuringMode;
+	startBatchCommand(data, dlc, bus);
+}
+
+
+/** Queue a batch start for all the alive devices and mark them pending
+@param data - start frame
+@param dlc - its length
+@param bus - only devices on this bus, 0xFF - all
+*/
+void Board::startBatchCommand(uint8_t* data, uint8_t dlc, uint8_t bus) {
+	for (uint8_t i = 0; i < MRM_CAN_BUSES; i++)
+		if (bus == 0xFF || i == bus) {
+			memcpy(startData[i], data, dlc);
+			startDlc[i] = dlc;
+		}
+	for (Device& device : devices)
+		if (device.alive && (bus == 0xFF || device.bus == bus)) {
+			device.startTries = 1;
+			device.startSentMs = 0;
+			if (!txEnqueue(data, dlc, device.number, true))
+				device.startSentMs = millis(); // Not queued, it will time out and be retried
+		}
+}
+
+
+/** Build the frame start() sends
+@param data - output, 3 bytes
+@param measuringModeNow - Measuring mode id
+@param refreshMs - 0 - device's default
+@return - frame's length
+*/
+uint8_t Board::startFrame(uint8_t* data, uint8_t measuringModeNow, uint16_t refreshMs) {
+	static const uint8_t commands[MRM_MEASURING_MODES] = { COMMAND_SENSORS_MEASURE_CONTINUOUS, COMMAND_SENSORS_MEASURE_CONTINUOUS_VERSION_2,
+		COMMAND_SENSORS_MEASURE_CONTINUOUS_VERSION_3 };
+	if (measuringModeNow > measuringModeLimit)
+		measuringModeNow = measuringModeLimit;
+	if (measuringModeNow >= MRM_MEASURING_MODES)
+		measuringModeNow = MRM_MEASURING_MODES - 1;
+	data[0] = commands[measuringModeNow];
+	measuringMode = measuringModeNow;
+	if (refreshMs == 0)
+		return 1;
+	data[1] = refreshMs & 0xFF;
+	data[2] = (refreshMs >> 8) & 0xFF;
+	return 3;
+}
+
+
+/** Advance a batch start: send paced frames, confirm devices by their first reading, retry the silent ones. Non-blocking.
+A device is confirmed when its lastReadingsMs is not older than its start frame, so any board's decoder confirms it.
+@return - devices still pending. Devices that exhausted MRM_START_TRIES are dropped from pending and reported in errorMessage.
+*/
+uint8_t Board::startPoll() {
+	txPump();
+	uint8_t pending = 0;
+	uint32_t now = millis();
+	for (Device& device : devices) {
+		if (device.startTries == 0)
+			continue;
+		if (device.startSentMs != 0 && device.lastReadingsMs != 0 && (int32_t)(device.lastReadingsMs - device.startSentMs) >= 0) {
+			device.startTries = 0; // Confirmed
+			if (device.stats.startMs != 0) {
+				uint32_t latency = device.lastReadingsMs - device.stats.startMs;
+				device.stats.startLatencyMs = latency > 0xFFFE ? 0xFFFE : latency;
+				device.stats.startMs = 0;
+			}
+			continue;
+		}
+		if (device.startSentMs != 0 && now - device.startSentMs > MRM_START_CONFIRM_MS) {
+			if (device.startTries >= MRM_START_TRIES) {
+				device.startTries = 0;
+				sprintf(errorMessage, "%s not started", device.name.c_str());
+				continue;
+			}
+			device.startTries++;
+			device.startSentMs = 0;
+			if (!txEnqueue(startData[device.bus], startDlc[device.bus], device.number, true))
+				device.startSentMs = now;
+		}
+		pending++;
+	}
+	return pending;
+}
+
+
 /** Stops periodical CANBus messages that refresh values that can be read by reading()
 @param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
 */
@@ -581,6 +1045,78 @@ void Board::stop(Device * device) {
 }
 
 
+/** Subscribe to a device's new readings instead of polling
+@param device - device
+@param callback - called from decoding, see ReadingCallback
+@param context - passed to callback
+@param threshold - only if the reading changed at least this much since the last delivered one. 0 - each reading.
+@param subsensor - subsensor's number, 0xFF - any
+@return - handle for unsubscribe(), 0xFF - no free slot
+*/
+uint8_t Board::subscribe(Device& device, ReadingCallback callback, void* context, uint32_t threshold, uint8_t subsensor) {
+	for (uint8_t i = 0; i < MRM_SUBSCRIPTIONS; i++)
+		if (subscriptions[i].callback == NULL
+#if defined(ESP32)
+			&& subscriptions[i].task == NULL
+#endif
+		) {
+			subscriptions[i] = Subscription();
+			subscriptions[i].callback = callback;
+			subscriptions[i].context = context;
+			subscriptions[i].threshold = threshold;
+			subscriptions[i].deviceNumber = device.number;
+			subscriptions[i].subsensor = subsensor;
+			if (i >= subscriptionsCount)
+				subscriptionsCount = i + 1;
+			return i;
+		}
+	sprintf(errorMessage, "%s: no free subscription", _boardsName.c_str());
+	return 0xFF;
+}
+
+
+#if defined(ESP32)
+/** Subscribe a FreeRTOS task, which will be notified (xTaskNotifyGive()) on a new reading
+@param device - device
+@param task - task to wake
+@param threshold - only if the reading changed at least this much since the last delivered one. 0 - each reading.
+@param subsensor - subsensor's number, 0xFF - any
+@return - handle for unsubscribe(), 0xFF - no free slot
+*/
+uint8_t Board::subscribeTask(Device& device, TaskHandle_t task, uint32_t threshold, uint8_t subsensor) {
+	uint8_t handle = subscribe(device, NULL, NULL, threshold, subsensor);
+	if (handle != 0xFF)
+		subscriptions[handle].task = task;
+	return handle;
+}
+#endif
+
+
+/** Deliver a reading to matching subscriptions
+@param device - device
+@param subsensor - subsensor's number
+@param value - reading
+*/
+void Board::subscriptionsNotify(Device& device, uint8_t subsensor, int32_t value) {
+	for (uint8_t i = 0; i < subscriptionsCount; i++) {
+		Subscription& subscription = subscriptions[i];
+		if (subscription.deviceNumber != device.number || (subscription.subsensor != 0xFF && subscription.subsensor != subsensor))
+			continue;
+		if (subscription.delivered && subscription.threshold != 0 && 
+			(uint32_t)abs((int64_t)value - subscription.lastValue) < subscription.threshold)
+			continue;
+		subscription.lastValue = value;
+		subscription.delivered = true;
+		if (subscription.callback != NULL)
+			subscription.callback(this, device, subsensor, value, subscription.context);
+#if defined(ESP32)
+		if (subscription.task != NULL)
+			xTaskNotifyGive(subscription.task);
+#endif
+	}
+}
+
+
 /** add() assigns device numbers one after another. swap() changes the sequence later. Therefore, add(); add(); will assign number 0 to a device with the smallest CAN Bus id and 1 to the one with the next smallest.
 If we want to change the order so that now the device 1 is the one with the smalles CAN Bus id, we will call swap(0, 1); after the the add() commands.
 @param deviceNumber1 - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
@@ -596,15 +1132,173 @@ void Board::swapCANIds(Device& device1, Device& device2) {
 }
 
 
-bool Board::userBreak(){
-	if (userBreakParent)
-		return userBreakParent();
-	else{
-		print("userBreakParent() not defined.\n\r");
-		exit(1);
+/** Stop all the alive devices through the paced queue, without blocking. Frames leave in txPump() or startPoll().
+*/
+void Board::stopBatch() {
+	uint8_t data[1] = { COMMAND_SENSORS_MEASURE_STOP };
+	for (Device& device : devices)
+		if (device.alive) {
+			device.startTries = 0;
+			device.lastReadingsMs = 0;
+			if (!txEnqueue(data, 1, device.number))
+				sprintf(errorMessage, "TX queue full");
+		}
+}
+
+
+/** Queue a frame for the paced sending, see txPump()
+@param data - payload
+@param dlc - length
+@param deviceNumber - device
+@param start - batch start frame
+@return - false if the queue is full
+*/
+bool Board::txEnqueue(uint8_t* data, uint8_t dlc, uint8_t deviceNumber, bool start) {
+	static_assert((MRM_TX_QUEUE_FRAMES & (MRM_TX_QUEUE_FRAMES - 1)) == 0 && MRM_TX_QUEUE_FRAMES <= 128, "MRM_TX_QUEUE_FRAMES must be a power of 2, max. 128");
+	if ((uint8_t)(txTail - txHead) >= MRM_TX_QUEUE_FRAMES)
+		return false;
+	TxFrame& frame = txQueue[txTail & (MRM_TX_QUEUE_FRAMES - 1)];
+	frame.board = this;
+	frame.deviceNumber = deviceNumber;
+	frame.dlc = dlc;
+	frame.start = start;
+	memcpy(frame.data, data, dlc);
+	txTail++;
+	return true;
+}
+
+
+/** Queue a frame for the paced sending, sending queued ones while the queue is full. Blocks, answers are decoded meanwhile.
+@param data - payload
+@param dlc - length
+@param deviceNumber - device
+*/
+void Board::txEnqueueWait(uint8_t* data, uint8_t dlc, uint8_t deviceNumber) {
+	while (!txEnqueue(data, dlc, deviceNumber)) {
+		txPump();
+		delayMs(1);
+	}
+}
+
+
+/** Send all the queued paced frames. Blocks, answers are decoded meanwhile.
+*/
+void Board::txFlush() {
+	while (txPump() != 0)
+		BoardHost::delayMs(1);
+}
+
+
+/** Send the paced frames that are due. Non-blocking, call it from the loop while startBatch() or stopBatch() frames are queued.
+@return - frames still queued
+*/
+uint8_t Board::txPump() {
+	while (txHead != txTail && micros() - txLastUs >= txGapUs) {
+		TxFrame& frame = txQueue[txHead & (MRM_TX_QUEUE_FRAMES - 1)];
+		txHead++;
+		if (frame.board == NULL) // Board destroyed
+			continue;
+		txLastUs = micros();
+		if (frame.start) {
+			Device& device = frame.board->devices[frame.deviceNumber];
+			device.startSentMs = millis();
+			if (device.startSentMs == 0)
+				device.startSentMs = 1;
+			device.stats.startMs = device.startSentMs;
+		}
+		frame.board->messageSend(frame.data, frame.dlc, frame.deviceNumber);
+	}
+	return (uint8_t)(txTail - txHead);
+}
+
+
+/** Send time sync requests. Each answer refines the device's clock offset and, over repeated calls, its drift. Call it periodically,
+like every second, preferably when the bus is quiet: answers delayed in queues are detected by their round trip and rejected.
+@param device - device, nullptr - all the alive ones
+*/
+void Board::timeSync(Device* device) {
+	if (device == nullptr) {
+		for (Device& dev : devices)
+			timeSync(&dev);
+	}
+	else {
+		if (device->alive) {
+			canData[0] = COMMAND_TIME_SYNC_REQUEST;
+			device->clock.requestUs.store(micros(), std::memory_order_release);
+			messageSend(canData, 1, device->number);
+		}
+	}
+}
+
+
+/** Take a COMMAND_TIME_SYNC_SENDING answer into the device's clock estimate. As in PTP, the path is assumed symmetric: the device
+stamped its answer half a round trip, less its own turnaround, before it arrived.
+@param message - frame
+@param device - device
+*/
+void Board::timeSyncDecode(CANMessage& message, Device& device) {
+	DeviceClock& clock = device.clock;
+	uint32_t arrivedUs = micros();
+	if (message.dlc < 7)
+		return;
+	uint32_t requestUs = clock.requestUs.exchange(0, std::memory_order_acquire);
+	if (requestUs == 0)
+		return; // Not asked for
+	uint32_t deviceUs = message.data[1] | (message.data[2] << 8) | (message.data[3] << 16) | ((uint32_t)message.data[4] << 24);
+	uint16_t turnaroundUs = message.data[5] | (message.data[6] << 8);
+	uint32_t elapsedUs = arrivedUs - requestUs;
+	uint32_t rttUs = elapsedUs > turnaroundUs ? elapsedUs - turnaroundUs : 0;
+	if (rttUs > 0xFFFE)
+		rttUs = 0xFFFE;
+	if (rttUs < clock.rttMinUs)
+		clock.rttMinUs = rttUs;
+	else if (rttUs > 2u * clock.rttMinUs + MRM_CLOCK_RTT_SLACK_US) {
+		clock.rejected++;
+		return;
+	}
+
+	uint32_t sentUs = arrivedUs - rttUs / 2; // Host's time when the device stamped deviceUs
+	int32_t offsetUs = (int32_t)(deviceUs - sentUs);
+	if (clock.syncUs == 0) {
+		clock.baseUs = sentUs;
+		clock.baseOffsetUs = offsetUs;
+	}
+	else if ((int32_t)(sentUs - clock.baseUs) >= MRM_CLOCK_DRIFT_SPAN_US) {
+		float driftPpm = (float)(offsetUs - clock.baseOffsetUs) * 1e6f / (int32_t)(sentUs - clock.baseUs);
+		clock.driftPpm = clock.driftMeasures++ == 0 ? driftPpm : clock.driftPpm + (driftPpm - clock.driftPpm) / 4;
+		clock.baseUs = sentUs;
+		clock.baseOffsetUs = offsetUs;
 	}
+	clock.offsetUs = offsetUs;
+	clock.syncUs = sentUs;
+	clock.samples++;
 }
 
+
+/** Cancel a subscription
+@param handle - returned by subscribe()
+*/
+void Board::unsubscribe(uint8_t handle) {
+	if (handle >= MRM_SUBSCRIPTIONS)
+		return;
+	subscriptions[handle] = Subscription();
+	while (subscriptionsCount > 0 && subscriptions[subscriptionsCount - 1].callback == NULL
+#if defined(ESP32)
+		&& subscriptions[subscriptionsCount - 1].task == NULL
+#endif
+	)
+		subscriptionsCount--;
+}
+
+
+// Bytes 1 - 4 encoder count. Firmware answering time sync appends the acquisition time, bytes 5 - 6.
+static constexpr ReadingField encoderField = { 0, 1, 4, 0, 32, false };
+const ModeLayout MotorBoard::encoderLayouts[MRM_MEASURING_MODES] = {
+	{{{COMMAND_SENSORS_MEASURE_SENDING, 1, {encoderField}, 5}}},
+	{{{COMMAND_SENSORS_MEASURE_SENDING, 1, {encoderField}, 5}}},
+	{{{COMMAND_SENSORS_MEASURE_SENDING, 1, {encoderField}, 5}}}
+};
+
 /**
 @param robot - robot containing this board
 @param devicesOnABoard - number of devices on each board
@@ -614,22 +1308,231 @@ bool Board::userBreak(){
 */
 MotorBoard::MotorBoard(uint8_t devicesOnABoard, std::string boardName, uint8_t maxNumberOfBoards, BoardId id) :
 	Board(maxNumberOfBoards, devicesOnABoard, boardName, MOTOR_BOARD, id) {
-	encoderCount = new std::vector<uint32_t>(devicesOnABoard * maxNumberOfBoards);
-	reversed = new std::vector<bool>(devicesOnABoard * maxNumberOfBoards);
-	lastSpeed = new std::vector<int8_t>(devicesOnABoard * maxNumberOfBoards);
+	uint16_t count = devicesOnABoard * maxNumberOfBoards;
+#if MRM_BOARD_STATIC
+	if (count > MRM_BOARD_MAX_DEVICES) {
+		sprintf(errorMessage, "%s: max. %i motors", boardName.c_str(), MRM_BOARD_MAX_DEVICES);
+		count = MRM_BOARD_MAX_DEVICES;
+	}
+#endif
+	encoderCount.assign(count, 0);
+	encoderVelocity.assign(count, 0);
+	velocityMs.assign(count, 0);
+	velocityUs.assign(count, 0);
+	reversed.assign(count, false);
+	lastSpeed.assign(count, 0);
 }
 
 MotorBoard::~MotorBoard(){
 	stop();
 }
 
+/** Encoder frames recorded by MotorBoard::characterise()
+*/
+struct CharacterisationLog{
+	uint32_t us[MRM_CHARACTERISATION_FRAMES];
+	int32_t count[MRM_CHARACTERISATION_FRAMES];
+	std::atomic<uint16_t> frames; // Written by the decoding thread after its entry, read by characterise()
+	std::atomic<bool> overflow;
+};
+static CharacterisationLog characterisationLog; // Static, too big for ESP32's loop stack
+
+/** ReadingCallback appending each encoder frame to a CharacterisationLog
+*/
+static void characterisationRecord(Board* board, Device& device, uint8_t subsensor, int32_t value, void* context) {
+	CharacterisationLog* log = (CharacterisationLog*)context;
+	uint16_t frames = log->frames.load(std::memory_order_relaxed);
+	if (frames >= MRM_CHARACTERISATION_FRAMES)
+		log->overflow.store(true, std::memory_order_relaxed);
+	else {
+		log->us[frames] = micros();
+		log->count[frames] = value;
+		log->frames.store(frames + 1, std::memory_order_release); // Publish the entry
+	}
+}
+
+/** Encoder rate over the frames arrived since a moment
+@param log - frames
+@param frames - entries published so far
+@param fromUs - start
+@return - counts/s, 0 - too few frames
+*/
+static float characterisationRate(CharacterisationLog& log, uint16_t frames, uint32_t fromUs) {
+	int16_t first = -1;
+	for (uint16_t i = 0; i < frames; i++)
+		if ((int32_t)(log.us[i] - fromUs) >= 0) {
+			first = i;
+			break;
+		}
+	if (first < 0 || frames - first < 2 || log.us[frames - 1] == log.us[first])
+		return 0;
+	return (float)(log.count[frames - 1] - log.count[first]) * 1e6 / (log.us[frames - 1] - log.us[first]);
+}
+
+/** Non-interactive characterisation, for regression benchmarks across robots. For each motor: a speed sweep, a dead-band search and a step response,
+recording every encoder frame with its arrival time. CSV columns: record, motor, speed, us, value. Records:
+frame - us is arrival time, value encoder count; rate - value counts/s after settling; dead-band - the smallest moving speed, for each direction;
+latency - us from the step command to the first changed count; rise - us to 63 % of the step's final rate.
+@param device - motor, NULL - all alive
+@param fileName - CSV output
+@param speedStep - sweep's step, 1 - 127
+@param settleMs - wait after each speed change before measuring the rate, also the rate's window
+@return - success
+*/
+bool MotorBoard::characterise(Device* device, const char* fileName, uint8_t speedStep, uint16_t settleMs) {
+	const int8_t STEP_SPEED = 100;
+	const float MOVING_SHARE = 0.02; // Moving if the rate exceeds this share of the fastest one
+	if (speedStep == 0 || speedStep > 127) {
+		sprintf(errorMessage, "Step %i invalid", speedStep);
+		return false;
+	}
+	FILE* file = fopen(fileName, "w");
+	if (file == NULL) {
+		sprintf(errorMessage, "Cannot open %s", fileName);
+		return false;
+	}
+	fprintf(file, "record,motor,speed,us,value\n");
+	CharacterisationLog& log = characterisationLog;
+
+	// Set speed, record settling and measuring windows, write frames. Returns the rate in the measuring window.
+	auto measure = [&](Device& dev, int8_t speed) -> float {
+		log.frames.store(0, std::memory_order_relaxed);
+		speedSet(dev.number, speed);
+		delayMs(settleMs);
+		uint32_t settledUs = micros();
+		delayMs(settleMs);
+		uint16_t frames = log.frames.load(std::memory_order_acquire);
+		for (uint16_t i = 0; i < frames; i++)
+			fprintf(file, "frame,%i,%i,%u,%i\n", dev.number, speed, log.us[i], log.count[i]);
+		float rate = characterisationRate(log, frames, settledUs);
+		fprintf(file, "rate,%i,%i,,%.1f\n", dev.number, speed, rate);
+		return rate;
+	};
+
+	bool overflow = false;
+	for (Device& dev : devices) {
+		if ((device != NULL && &dev != device) || !dev.alive)
+			continue;
+		start(&dev, 0, MRM_CHARACTERISATION_REFRESH_MS);
+		uint8_t handle = subscribe(dev, characterisationRecord, &log);
+		if (handle == 0xFF)
+			break;
+		log.overflow.store(false, std::memory_order_relaxed);
+
+		// Sweep
+		float rates[256];
+		float fastest = 0;
+		for (int16_t speed = -127; speed <= 127; speed += speedStep) {
+			rates[speed + 128] = measure(dev, speed);
+			if (fabsf(rates[speed + 128]) > fastest)
+				fastest = fabsf(rates[speed + 128]);
+		}
+
+		// Dead-band: the first moving speed in the sweep, refined one by one from the last still one
+		int8_t deadBand[2] = { 0, 0 };
+		for (uint8_t direction = 0; direction < 2; direction++) {
+			int8_t sign = direction == 0 ? 1 : -1;
+			int16_t firstMoving = 128;
+			for (int16_t speed = -127; speed <= 127; speed += speedStep)
+				if (speed * sign > 0 && speed * sign < firstMoving && fabsf(rates[speed + 128]) > fastest * MOVING_SHARE)
+					firstMoving = speed * sign;
+			for (int16_t speed = firstMoving - speedStep < 1 ? 1 : firstMoving - speedStep + 1; speed <= firstMoving && speed <= 127; speed++) {
+				speedSet(dev.number, 0); // From standstill, not coasting from the previous speed
+				delayMs(settleMs);
+				if (fabsf(measure(dev, speed * sign)) > fastest * MOVING_SHARE) {
+					deadBand[direction] = speed * sign;
+					break;
+				}
+			}
+			fprintf(file, "dead-band,%i,%i,,\n", dev.number, deadBand[direction]);
+		}
+
+		// Step response
+		speedSet(dev.number, 0);
+		delayMs(settleMs);
+		log.frames.store(0, std::memory_order_relaxed);
+		int32_t countBefore = encoderCount[dev.number];
+		uint32_t stepUs = micros();
+		speedSet(dev.number, STEP_SPEED);
+		delayMs(settleMs * 2);
+		speedSet(dev.number, 0);
+		uint32_t latencyUs = 0;
+		uint32_t riseUs = 0;
+		uint16_t frames = log.frames.load(std::memory_order_acquire);
+		float finalRate = characterisationRate(log, frames, stepUs + settleMs * 1000);
+		for (uint16_t i = 0; i < frames; i++) {
+			fprintf(file, "frame,%i,%i,%u,%i\n", dev.number, STEP_SPEED, log.us[i], log.count[i]);
+			if (latencyUs == 0 && log.count[i] != countBefore)
+				latencyUs = log.us[i] - stepUs;
+			if (riseUs == 0 && i > 0 && log.us[i] != log.us[i - 1] && finalRate != 0 &&
+				(float)(log.count[i] - log.count[i - 1]) * 1e6 / (log.us[i] - log.us[i - 1]) / finalRate >= 0.63)
+				riseUs = log.us[i] - stepUs;
+		}
+		fprintf(file, "latency,%i,%i,%u,\n", dev.number, STEP_SPEED, latencyUs);
+		fprintf(file, "rise,%i,%i,%u,\n", dev.number, STEP_SPEED, riseUs);
+		print("%s: dead-band %i/%i, max. %i counts/s, latency %i us, rise %i us\n\r", dev.name.c_str(), deadBand[0], deadBand[1], (int)fastest, latencyUs, riseUs);
+
+		overflow |= log.overflow.load(std::memory_order_relaxed);
+		unsubscribe(handle);
+		Board::stop(&dev);
+	}
+	fclose(file);
+	if (overflow)
+		sprintf(errorMessage, "Frames lost, increase MRM_CHARACTERISATION_FRAMES");
+	return !overflow;
+}
+
+
 /** Changes rotation's direction
 @param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
 */
 void MotorBoard::directionChange(Device& device) {
-	(*reversed)[device.number] = !(*reversed)[device.number];
+	reversed[device.number] = !reversed[device.number];
 }
 
+/** Restore configuration saved by configSerialize()
+@param buffer - data
+@param length - number of bytes
+@return - success
+*/
+bool MotorBoard::configDeserialize(const uint8_t* buffer, uint8_t length) {
+	if (!configValid(buffer, length) || !Board::configDeserialize(buffer, length))
+		return false;
+	for (uint8_t i = 0; i < reversed.size(); i++)
+		reversed[i] = (buffer[1 + i / 8] >> (i % 8)) & 1;
+	return true;
+}
+
+
+/** Check configuration saved by configSerialize() without applying it
+@param buffer - data
+@param length - number of bytes
+@return - configDeserialize() would succeed
+*/
+bool MotorBoard::configValid(const uint8_t* buffer, uint8_t length) {
+	return Board::configValid(buffer, length) && length >= 1 + (reversed.size() + 7) / 8;
+}
+
+
+/** Write configuration, measuring mode and reversed motors, for Topology
+@param buffer - output
+@param size - buffer's size
+@return - number of bytes written, 0xFF - no room
+*/
+uint8_t MotorBoard::configSerialize(uint8_t* buffer, uint8_t size) {
+	uint8_t length = Board::configSerialize(buffer, size);
+	uint8_t bytes = (reversed.size() + 7) / 8;
+	if (length == 0xFF || length + bytes > size)
+		return 0xFF;
+	for (uint8_t i = 0; i < bytes; i++)
+		buffer[length + i] = 0;
+	for (uint8_t i = 0; i < reversed.size(); i++)
+		if (reversed[i])
+			buffer[length + i / 8] |= 1 << (i % 8);
+	return length + bytes;
+}
+
+
 /** Read CAN Bus message into local variables
 @param canId - CAN Bus id
 @param data - 8 bytes from CAN Bus message.
@@ -640,15 +1543,19 @@ bool MotorBoard::messageDecode(CANMessage& message) {
 	for (Device& device : devices)
 		if (isForMe(message.id, device)) {
 			if (!messageDecodeCommon(message, device)) {
-				switch (message.data[0]) {
-				case COMMAND_SENSORS_MEASURE_SENDING: {
-					uint32_t enc = (message.data[4] << 24) | (message.data[3] << 16) | (message.data[2] << 8) | message.data[1];
-					(*encoderCount)[device.number] = enc;
-					device.lastReadingsMs = millis();
-					break;
+				int32_t readings[1];
+				int32_t deviceTime;
+				if (readingsDecode(encoderLayouts, message, device, readings, &deviceTime)) {
+					encoderCount[device.number] = readings[0];
+					readingsReceived(device, deviceTime);
+					readingNotify(device, 0, readings[0]);
 				}
-				default:
-					errorAddParent(message, ERROR_COMMAND_UNKNOWN, false, true);
+				else {
+					device.stats.decodeErrors++;
+					if (errors.add(message.id, device.name.c_str(), ERROR_COMMAND_UNKNOWN, false)) {
+						errorAdd(message, ERROR_COMMAND_UNKNOWN, false, false);
+						logDeferred.add(LOG_COMMAND_UNKNOWN, device.name.c_str(), message.data[0]);
+					}
 				}
 			}
 			return true;
@@ -657,6 +1564,42 @@ bool MotorBoard::messageDecode(CANMessage& message) {
 }
 
 
+/** Bytes occupied by this board's object and its storage
+@return - bytes
+*/
+uint32_t MotorBoard::memoryFootprint(){
+#if MRM_BOARD_STATIC
+	return sizeof(MotorBoard);
+#else
+	return sizeof(MotorBoard) + devices.capacity() * sizeof(Device) + encoderCount.capacity() * sizeof(uint32_t) + encoderVelocity.capacity() * sizeof(int32_t) + 
+		(velocityMs.capacity() + velocityUs.capacity()) * sizeof(uint32_t) + reversed.capacity() / 8 + lastSpeed.capacity() * sizeof(int8_t);
+#endif
+}
+
+
+/** Read a CAN FD frame. Besides classic frames, decodes an encoder and velocity bundle: COMMAND_SENSORS_MEASURE_SENDING, 
+bytes 1 - 4 encoder count, 5 - 8 signed velocity.
+@param message - frame
+@return - true if canId for this class
+*/
+bool MotorBoard::messageDecodeFD(CANFDMessage& message) {
+	if (message.length >= 9 && message.data[0] == COMMAND_SENSORS_MEASURE_SENDING)
+		for (Device& device : devices)
+			if (isForMe(message.id, device)) {
+				CANMessage classic = message.classic();
+				messageReceived(classic, device, &message);
+				encoderCount[device.number] = (message.data[4] << 24) | (message.data[3] << 16) | (message.data[2] << 8) | message.data[1];
+				encoderVelocity[device.number] = (int32_t)(((uint32_t)message.data[8] << 24) | (message.data[7] << 16) | (message.data[6] << 8) | message.data[5]);
+				readingsReceived(device);
+				velocityMs[device.number] = device.lastReadingsMs;
+				velocityUs[device.number] = device.readingsUs;
+				readingNotify(device, 0, encoderCount[device.number]);
+				return true;
+			}
+	return Board::messageDecodeFD(message);
+}
+
+
 /** Encoder readings
 @param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
 @return - encoder value
@@ -664,7 +1607,7 @@ bool MotorBoard::messageDecode(CANMessage& message) {
 uint16_t MotorBoard::reading(Device& device) {
 	aliveWithOptionalScan(&device, true);
 	if (started(device))
-		return (*encoderCount)[device.number];
+		return encoderCount[device.number];
 	else
 		return 0;
 }
@@ -675,7 +1618,16 @@ void MotorBoard::readingsPrint() {
 	print("Encoders:");
 	for (Device& device : devices)
 		if (device.alive)
-			print(" %4i", (*encoderCount)[device.number]);
+			print(" %4i", encoderCount[device.number]);
+}
+
+
+/** Encoder velocity, only sent by devices streaming CAN FD bundles
+@param device - device
+@return - velocity, in encoder counts per device's time unit
+*/
+int32_t MotorBoard::velocity(Device& device) {
+	return encoderVelocity[device.number];
 }
 
 
@@ -689,11 +1641,11 @@ void MotorBoard::speedSet(uint8_t motorNumber, int8_t speed, bool force) {
 		return;
 	}
 
-	if (!force && (*lastSpeed)[motorNumber] == speed)
+	if (!force && lastSpeed[motorNumber] == speed)
 		return;
-	(*lastSpeed)[motorNumber] = speed;
+	lastSpeed[motorNumber] = speed;
 
-	if ((*reversed)[motorNumber])
+	if (reversed[motorNumber])
 		speed = -speed;
 
 	canData[0] = COMMAND_SPEED_SET;
@@ -809,7 +1761,7 @@ void MotorBoard::test(Device * device , uint16_t betweenTestsMs)
 				speedSet(dev.number, speed);
 
 				if (millis() - lastMs > DISPLAY_PAUSE_MS) {
-					print("Mot. %i:%3i, en: %i\n\r", dev.number, speed, (*encoderCount)[dev.number]);
+					print("Mot. %i:%3i, en: %i\n\r", dev.number, speed, encoderCount[dev.number]);
 					lastMs = millis();
 				}
 				delayMs(PAUSE_MS);
@@ -871,19 +1823,114 @@ void SensorBoard::continuousReadingCalculatedDataStart(Device* device) {
 	}
 }
 
+/** Batch version of continuousReadingCalculatedDataStart() for all the alive devices, without blocking. Follow with startPoll() until it returns 0.
+*/
+void SensorBoard::continuousReadingCalculatedDataStartBatch() {
+	uint8_t data[1] = {COMMAND_SENSORS_MEASURE_CONTINUOUS_AND_RETURN_CALCULATED_DATA};
+	startBatchCommand(data, 1);
+}
+
 
 MotorGroup::MotorGroup(){
 }
 
 
-/** Stop motors
+/** Enable motion profiles. After this, go() only sets targets, which profileTick() approaches and sends.
+@param acceleration - maximum change of speed, in speed units (127 - full) per s. 0 - disable profiles.
+@param jerk - maximum change of acceleration, per s^2, giving an S-curve. 0 - trapezoidal.
+@param tickMs - setpoints' period
+*/
+void MotorGroup::profileSet(float acceleration, float jerk, uint16_t tickMs) {
+	profileAcceleration = acceleration;
+	profileJerk = jerk;
+	profileTickMs = tickMs == 0 ? 1 : tickMs;
+	profileLastMs = millis();
+}
+
+/** Advance all the profiles if a tick elapsed and send the wheels whose rounded speed changed, in one burst. Non-blocking, call it from the loop.
+@return - true while any wheel is still approaching its target
+*/
+bool MotorGroup::profileTick() {
+	uint32_t elapsedMs = millis() - profileLastMs;
+	if (profileAcceleration <= 0 || elapsedMs < profileTickMs)
+		return profileAcceleration > 0 && profileMoving;
+	profileLastMs += elapsedMs;
+	float dt = elapsedMs / 1000.0;
+
+	bool moving = false;
+	for (uint8_t i = 0; i < MAX_MOTORS_IN_GROUP && motorBoard[i] != NULL; i++) {
+		MotionProfile& profile = profiles[i];
+		float error = profile.target - profile.speed;
+		if (error == 0)
+			continue;
+		if (profileJerk <= 0) { // Trapezoidal: constant acceleration
+			float step = profileAcceleration * dt;
+			profile.speed += error > step ? step : (error < -step ? -step : error);
+		}
+		else { // S-curve: acceleration ramps up, and down early enough to reach the target with 0 acceleration
+			float stopping = sqrtf(2 * profileJerk * fabsf(error));
+			float wanted = stopping < profileAcceleration ? stopping : profileAcceleration;
+			if (error < 0)
+				wanted = -wanted;
+			float change = profileJerk * dt;
+			float difference = wanted - profile.acceleration;
+			profile.acceleration += difference > change ? change : (difference < -change ? -change : difference);
+			profile.speed += profile.acceleration * dt;
+			if ((profile.target - profile.speed) * error <= 0 || fabsf(profile.target - profile.speed) < 0.5) { // Reached or passed
+				profile.speed = profile.target;
+				profile.acceleration = 0;
+			}
+		}
+		if (profile.speed != profile.target)
+			moving = true;
+		motorBoard[i]->speedSet(motorNumber[i], (int8_t)roundf(profile.speed)); // speedSet() drops unchanged speeds
+	}
+	profileMoving = moving;
+	return moving;
+}
+
+/** Command a wheel: directly or, if profiling, as the profile's target
+@param i - wheel
+@param speed - -127 to 127
+*/
+void MotorGroup::speedOut(uint8_t i, int8_t speed) {
+	if (profileAcceleration > 0) {
+		profiles[i].target = speed;
+		if (profiles[i].speed != speed)
+			profileMoving = true;
+	}
+	else {
+		profiles[i].speed = speed;
+		profiles[i].target = speed;
+		motorBoard[i]->speedSet(motorNumber[i], speed);
+	}
+}
+
+/** Stop motors at once, also ending any profile
 */
 void MotorGroup::stop() {
 	for (uint8_t i = 0; i < MAX_MOTORS_IN_GROUP; i++)
 		if (motorBoard[i] == NULL)
 			break;
-		else 
+		else {
+			profiles[i] = MotionProfile();
 			motorBoard[i]->speedSet(motorNumber[i], 0);
+		}
+	profileMoving = false;
+}
+
+/** Set a wheel's target speed, reached by profileTick()
+@param i - wheel, in the group's order
+@param speed - -127 to 127
+*/
+void MotorGroup::targetSet(uint8_t i, int8_t speed) {
+	if (i >= MAX_MOTORS_IN_GROUP || motorBoard[i] == NULL) {
+		sprintf(errorMessage, "Wheel %i doesn't exist", i);
+		return;
+	}
+	profiles[i].target = speed;
+	if (profiles[i].speed != speed)
+		profileMoving = true;
 }
 
 /** Constructor
@@ -947,12 +1994,13 @@ void MotorGroupDifferential::go(int16_t leftSpeed, int16_t rightSpeed, int16_t l
 				maxSpeed = abs(speeds[i]);
 		// print("M0:%i M1:%i M2:%i M3:%i Lat:%i\n\r", speeds[0], speeds[1], speeds[2], speeds[3], lateralSpeedToRight);
 		for (uint8_t i = 0; i < 4; i++) {
-						delayMs(1);
+			if (profileAcceleration <= 0)
+				delayMs(1);
 			if (maxSpeed > speedLimit) {
-				motorBoard[i]->speedSet(motorNumber[i], (int8_t)(speeds[i] / maxSpeed * speedLimit));
+				speedOut(i, (int8_t)(speeds[i] / maxSpeed * speedLimit));
 			}
 			else {
-				motorBoard[i]->speedSet(motorNumber[i], (int8_t)speeds[i]);
+				speedOut(i, (int8_t)speeds[i]);
 			}
 		}
 	}
@@ -1013,14 +2061,15 @@ void MotorGroupStar::go(float speed, float angleDegrees, float rotation, uint8_t
 			//Serial.print("Rot err: " + (String)rotation + " ");
 			for (int i = 0; i < 4; i++){
 				if (maxSpeed > speedLimit) {
-					motorBoard[i]->speedSet(motorNumber[i], (int8_t)(speeds[i] / maxSpeed * speedLimit));
+					speedOut(i, (int8_t)(speeds[i] / maxSpeed * speedLimit));
 					//Serial.print("MAX ");
 				}
 				else {
-					motorBoard[i]->speedSet(motorNumber[i], (int8_t)speeds[i]);
+					speedOut(i, (int8_t)speeds[i]);
 					//Serial.print((String)speeds[i] + " ");
 				}
-				delayMs(1);
+				if (profileAcceleration <= 0)
+					delayMs(1);
 			}
 			//Serial.println();
 		}
@@ -1,13 +1,19 @@
 #pragma once
 
-#include <functional>
 #include "Arduino.h"
 #include "mrm-can-bus.h"
 #include "mrm-common.h"
 #include "mrm-pid.h"
+#include "mrm-board-bus.h"
+#include "mrm-board-error.h"
+#include "mrm-board-log.h"
+#include "mrm-board-topology.h"
+#include "mrm-board-transport.h"
+#include "mrm-board-trace.h"
 #include <cstring>
 #include <vector>
 #include <map>
+#include <new>
 
 // Addresses:
 // 0x0110 - 272 mrm-bldc2x125
@@ -67,6 +73,8 @@
 #define COMMAND_FPS_SENDING 0x31
 #define COMMAND_PNP_REQUEST 0x32
 #define COMMAND_PNP_SENDING 0x33
+#define COMMAND_TIME_SYNC_REQUEST 0x34
+#define COMMAND_TIME_SYNC_SENDING 0x35 // Bytes 1 - 4 device's micros() when sending, 5 - 6 us since the request arrived
 #define COMMAND_ID_CHANGE_REQUEST 0x40
 #define COMMAND_NOTIFICATION 0x41
 #define COMMAND_OSCILLATOR_TEST 0x43
@@ -75,10 +83,46 @@
 #define COMMAND_REPORT_ALIVE 0xFF
 
 #define MRM_MOTORS_INACTIVITY_ALLOWED_MS 10000
+#ifndef MRM_READING_MAX_AGE_MS
+#define MRM_READING_MAX_AGE_MS 100 // Default age after which a reading is stale, see Board::readingMaxAgeMs
+#endif
+
+#ifndef MRM_CHARACTERISATION_FRAMES
+#define MRM_CHARACTERISATION_FRAMES 256 // Encoder frames recorded per speed step by MotorBoard::characterise()
+#endif
+#ifndef MRM_CHARACTERISATION_REFRESH_MS
+#define MRM_CHARACTERISATION_REFRESH_MS 5
+#endif
+
+#ifndef MRM_TX_QUEUE_FRAMES
+#define MRM_TX_QUEUE_FRAMES 64 // Paced frames waiting, for all boards. Must be a power of 2.
+#endif
+#ifndef MRM_TX_GAP_US
+#define MRM_TX_GAP_US 1000 // Default gap between 2 paced frames. Devices of the same kind miss commands sent back to back.
+#endif
+#ifndef MRM_START_CONFIRM_MS
+#define MRM_START_CONFIRM_MS 50 // Batch start: wait this long for the first reading before retrying
+#endif
+#ifndef MRM_START_TRIES
+#define MRM_START_TRIES 4 // Batch start: frames per device before giving up
+#endif
 
 #define MAX_MOTORS_IN_GROUP 4
 #define PAUSE_MICRO_S_BETWEEN_DEVICE_SCANS 10000
 
+// Static-allocation mode. 1 - all the boards' storage is in fixed-size arrays inside the objects, no heap use after construction.
+#ifndef MRM_BOARD_STATIC
+#define MRM_BOARD_STATIC 0
+#endif
+// Maximum number of Board objects in a robot.
+#ifndef MRM_BOARD_MAX_BOARDS
+#define MRM_BOARD_MAX_BOARDS 32
+#endif
+// Maximum number of devices of a single Board in static-allocation mode.
+#ifndef MRM_BOARD_MAX_DEVICES
+#define MRM_BOARD_MAX_DEVICES 16
+#endif
+
 #ifndef toRad
 #define toRad(x) ((x) / 180.0 * PI) // Degrees to radians
 #endif
@@ -89,10 +133,198 @@
 class Robot;
 class Board;
 
+/** Vector-like container with capacity fixed at compile time. Storage is an arena inside the object, so there is no heap use.
+*/
+template <typename T, uint16_t N>
+class StaticVector{
+	alignas(T) uint8_t arena[N * sizeof(T)];
+	uint16_t count = 0;
+public:
+	StaticVector(){}
+	StaticVector(const StaticVector&) = delete;
+	StaticVector& operator=(const StaticVector&) = delete;
+	~StaticVector(){ clear(); }
+
+	/** Fill with copies of a value
+	@param n - number of elements, clipped to the capacity
+	@param value - value to copy
+	*/
+	void assign(uint16_t n, const T& value){
+		clear();
+		for (uint16_t i = 0; i < n && i < N; i++)
+			push_back(value);
+	}
+	T* begin(){ return reinterpret_cast<T*>(arena); }
+	uint16_t capacity() const { return N; }
+	void clear(){
+		for (uint16_t i = 0; i < count; i++)
+			begin()[i].~T();
+		count = 0;
+	}
+	T* end(){ return begin() + count; }
+	/** Append an element
+	@return - false if full
+	*/
+	bool push_back(const T& value){
+		if (count >= N)
+			return false;
+		new (begin() + count) T(value);
+		count++;
+		return true;
+	}
+	void reserve(uint16_t n){}
+	uint16_t size() const { return count; }
+	T& operator[](uint16_t i){ return begin()[i]; }
+};
+
+#if MRM_BOARD_STATIC
+template <typename T>
+using DeviceVector = StaticVector<T, MRM_BOARD_MAX_DEVICES>;
+#else
+template <typename T>
+using DeviceVector = std::vector<T>;
+#endif
+
+/** Host policy. The application (usually Robot) defines these functions, so all the boards reach the host without back-pointers.
+They are resolved at link time: a missing one is a build error, not a runtime exit, and hot calls like messageSend() and delayMs() 
+can be inlined by link-time optimization. In messageSend(), deviceNumber 0xFF marks a frame not sent by a known device, like a discovery ping.
+*/
+struct BoardHost{
+	static void delayMs(uint16_t ms);
+	static void end();
+	static void errorAdd(CANMessage& message, uint8_t errorCode, bool peripheral, bool printNow);
+	static void messagePrint(CANMessage& message, Board* board, uint8_t deviceNumber, bool outbound, bool clientInitiated, std::string postfix);
+	static void messageSend(CANMessage& message, uint8_t deviceNumber);
+	static void noLoopWithoutThis();
+	static uint16_t serialReadNumber(uint16_t timeoutFirst, uint16_t timeoutBetween, bool onlySingleDigitInput, uint16_t limit, bool printWarnings);
+	static bool setup();
+	static bool userBreak();
+};
+
+/** Called from decoding when a subscribed device's reading arrives, so it must be short
+@param board - board
+@param device - device
+@param subsensor - subsensor's number, like a single IR transistor in mrm-ref-can
+@param value - new reading
+@param context - passed to subscribe()
+*/
+typedef void (*ReadingCallback)(Board* board, Device& device, uint8_t subsensor, int32_t value, void* context);
+
+struct Subscription{
+	ReadingCallback callback; // NULL - free slot
+	void* context;
+#if defined(ESP32)
+	TaskHandle_t task; // Notified if not NULL
+#endif
+	uint32_t threshold; // Minimal change since the last delivered value, 0 - every reading
+	int32_t lastValue;
+	uint8_t deviceNumber;
+	uint8_t subsensor; // 0xFF - any
+	bool delivered; // lastValue valid
+};
+
+enum ReadingState {READING_NONE, READING_FRESH, READING_STALE}; // NONE - nothing received since the device was started, stop() clears readings' times
+
+/** A reading with its age, returned by non-blocking accessors
+*/
+template <typename T>
+struct Reading{
+	T value;
+	uint32_t ageMs; // Since the reading arrived, 0xFFFFFFFF if READING_NONE
+	ReadingState state;
+	uint32_t acquiredUs; // Estimated acquisition time in host's micros(), see Board::timeSync()
+
+	bool fresh() const { return state == READING_FRESH; }
+};
+
+#define MRM_MEASURING_MODES 3 // COMMAND_SENSORS_MEASURE_CONTINUOUS, _VERSION_2 and _VERSION_3
+#define MRM_LAYOUT_FIELDS 8 // Readings in one frame
+#define MRM_LAYOUT_FRAMES 4 // Frame kinds carrying readings in one measuring mode
+
+/** Where one reading lies in a frame. The value is assembled little-endian from the bytes, shifted right and masked to its bits.
+*/
+struct ReadingField{
+	uint8_t reading; // Index in the readings array
+	uint8_t byte; // First byte, 1 - 7
+	uint8_t bytes; // 1 - 4
+	uint8_t shift;
+	uint8_t bits; // 1 - 32
+	bool isSigned;
+};
+
+/** Readings carried by one frame kind
+*/
+struct FrameLayout{
+	uint8_t command; // data[0], 0 - unused entry
+	uint8_t fieldsCount;
+	ReadingField fields[MRM_LAYOUT_FIELDS];
+	uint8_t timeByte; // Low 16 bits of device's acquisition micros(), little-endian, if the frame is long enough to hold them. 0 - none.
+};
+
+/** Decode table for one measuring mode: all the frame kinds a device sends in it. Derived boards declare a static const array of MRM_MEASURING_MODES
+of these, defined in their .cpp, like MotorBoard::encoderLayouts.
+*/
+struct ModeLayout{
+	FrameLayout frames[MRM_LAYOUT_FRAMES];
+};
+
+struct CommandName{
+	uint8_t command;
+	const char* name;
+};
+
+#ifndef MRM_SUBSCRIPTIONS
+#define MRM_SUBSCRIPTIONS 4 // Reading subscriptions per Board
+#endif
+#define MRM_DUPLICATE_SIGNATURES 4 // Distinct echo payloads remembered per device by duplicatesScan()
+#define MRM_STATS_BUCKETS 8 // Inter-arrival histogram buckets: < 1, < 2, < 4, < 8, < 16, < 32, < 64 ms and the rest
+
+/** Always-on per-device bus counters
+*/
+struct DeviceStats{
+	uint32_t framesReceived = 0;
+	uint32_t framesSent = 0;
+	uint32_t decodeErrors = 0; // Frames with unknown commands
+	uint32_t interArrival[MRM_STATS_BUCKETS] = {}; // Histogram of gaps between 2 received frames
+	uint32_t startMs = 0; // When startBatch()'s frame was sent, 0 - confirmed by startPoll()
+	uint16_t startLatencyMs = 0xFFFF; // From startBatch()'s frame to the first reading after it, 0xFFFF - not measured yet
+};
+
+#define MRM_CLOCK_RTT_SLACK_US 200 // Sync samples with a round trip longer than twice the shortest plus this were queued, rejected
+#define MRM_CLOCK_DRIFT_SPAN_US 500000 // Shortest interval over which drift is measured
+
+/** An std::atomic that can be copied, as Device is when added to a board. Copying itself is not atomic.
+*/
+template <typename T>
+struct CopyableAtomic : std::atomic<T>{
+	CopyableAtomic(T value = T()) : std::atomic<T>(value){}
+	CopyableAtomic(const CopyableAtomic& other) : std::atomic<T>(other.load(std::memory_order_relaxed)){}
+	CopyableAtomic& operator=(const CopyableAtomic& other){
+		this->store(other.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		return *this;
+	}
+};
+
+/** Device's clock relative to host's micros(), estimated by Board::timeSync() exchanges
+*/
+struct DeviceClock{
+	int32_t offsetUs = 0; // Device's time minus host's at syncUs
+	float driftPpm = 0; // How much faster device's clock runs
+	uint32_t syncUs = 0; // Host's time of the last accepted sample, 0 - not synchronised
+	uint32_t baseUs = 0; // Drift is measured from this sample
+	int32_t baseOffsetUs = 0;
+	CopyableAtomic<uint32_t> requestUs; // When the outstanding request was sent, 0 - none. timeSync() sets it, the decoding thread takes it.
+	uint16_t rttMinUs = 0xFFFF; // Shortest round trip seen, twice the best one-way latency
+	uint16_t samples = 0; // Accepted
+	uint16_t driftMeasures = 0;
+	uint16_t rejected = 0;
+};
+
 struct Device{
 	public:
-	Device(const std::string& name, uint16_t canIdIn, uint16_t canIdOut, uint8_t number)
-		: name(name), readingsCount(0), canIdIn(canIdIn), canIdOut(canIdOut), lastMessageReceivedMs(0), lastReadingsMs(0), fpsLast(0xFFFF), number(number), alive(false), aliveOnce(false) {};
+	Device(const std::string& name, uint16_t canIdIn, uint16_t canIdOut, uint8_t number, uint8_t bus = 0)
+		: name(name), readingsCount(0), canIdIn(canIdIn), canIdOut(canIdOut), lastMessageReceivedMs(0), lastReadingsMs(0), fpsLast(0xFFFF), number(number), alive(false), aliveOnce(false),
+		bus(bus), duplicateEchoes(0), duplicateSignaturesCount(0) {};
 	std::string name;
 	uint8_t readingsCount;
 	uint16_t canIdIn;
@@ -103,6 +335,27 @@ struct Device{
 	uint8_t number;
 	bool alive;
 	bool aliveOnce;
+	uint8_t bus; // CAN Bus index, see BusRouter
+	DeviceStats stats;
+	uint8_t duplicateEchoes; // Echoes received in the last duplicatesScan()
+	uint8_t duplicateSignaturesCount; // Distinct echo payloads in the last duplicatesScan()
+	uint32_t duplicateSignatures[MRM_DUPLICATE_SIGNATURES];
+	uint8_t startTries = 0; // Batch start's frames queued so far, 0 - nothing pending
+	uint8_t measuringMode = 0; // Set by the last start(), selects the decode table
+	uint32_t startSentMs = 0; // When the last batch start frame left the paced queue, 0 - still queued
+	DeviceClock clock;
+	uint8_t pnp = 0xFF; // PnP state the device last reported, 0xFF - unknown
+	uint32_t readingsUs = 0; // Estimated acquisition time of the last readings, host's micros()
+};
+
+/** A frame waiting in the paced queue
+*/
+struct TxFrame{
+	Board* board;
+	uint8_t deviceNumber;
+	uint8_t dlc;
+	bool start; // Batch start frame, stamp the device when sent
+	uint8_t data[8];
 };
 
 /** Board is a class of all the boards of the same type, not a single board!
@@ -119,13 +372,16 @@ protected:
 	std::string _boardsName;
 	BoardType typeId; // To differentiate derived boards
 	uint8_t canData[8]; // Array used to store temporary CAN Bus data
-	static std::map<int, std::string>* commandNames;
+	static const CommandName commandNames[]; // Sorted by command
+	static const uint8_t commandNamesCount;
 	BoardId _id;
 	uint8_t maximumNumberOfBoards;
-	uint8_t measuringMode = 0;
-	uint8_t measuringModeLimit = 0;
+	uint8_t measuringMode = 0; // Requested by the last start() for all devices, each device keeps its own
+	uint8_t measuringModeLimit = 0; // Highest mode the product supports
 	uint8_t _message[29]; // Message a device sent.
 	int nextFree = -1;
+	Subscription subscriptions[MRM_SUBSCRIPTIONS] = {};
+	uint8_t subscriptionsCount = 0; // Used slots
 
 	/** Common part of message decoding
 	@param canId - CAN Bus id
@@ -135,22 +391,180 @@ protected:
 	*/
 	bool messageDecodeCommon(CANMessage& message, Device& device);
 
+	/** Common part of FD frames' decoding. Only frames longer than classic ones get here.
+	@param message - frame
+	@param device - device
+	@return - command found
+	*/
+	bool messageDecodeCommonFD(CANFDMessage& message, Device& device);
+
+	/** Bookkeeping for each received frame: aliveness time, counters, bus load and trace
+	@param message - frame, FD ones with their first 8 bytes
+	@param device - device
+	@param fdMessage - the whole FD frame, NULL - classic frame
+	*/
+	void messageReceived(CANMessage& message, Device& device, CANFDMessage* fdMessage = NULL);
+
+	static thread_local bool rxPacked; // Decoding the parts of a packed FD frame in this thread, already counted by messageReceived()
+
+	/** Derived classes call this for each decoded reading, to wake subscribers
+	@param device - device
+	@param subsensor - subsensor's number
+	@param value - reading
+	*/
+	void readingNotify(Device& device, uint8_t subsensor, int32_t value){
+		if (subscriptionsCount != 0)
+			subscriptionsNotify(device, subsensor, value);
+	}
+
+	void subscriptionsNotify(Device& device, uint8_t subsensor, int32_t value);
+
+	/** Estimate when readings were acquired
+	@param device - device
+	@param deviceTime - low 16 bits of device's acquisition time, -1 - not in the frame
+	@return - host's micros(). Without a timestamp, the decoding time less the best one-way latency. Without sync, the decoding time.
+	*/
+	uint32_t acquisitionUs(Device& device, int32_t deviceTime);
+
+	/** Take a COMMAND_TIME_SYNC_SENDING answer into the device's clock estimate
+	@param message - frame
+	@param device - device
+	*/
+	void timeSyncDecode(CANMessage& message, Device& device);
+
+	uint8_t startData[MRM_CAN_BUSES][3]; // Last batch start frame for each bus, for retries
+	uint8_t startDlc[MRM_CAN_BUSES] = {};
+	static TxFrame txQueue[MRM_TX_QUEUE_FRAMES];
+	static uint8_t txHead; // Next to send
+	static uint8_t txTail; // Next free
+	static uint32_t txLastUs;
+
+	/** Queue a batch start for all the alive devices and mark them pending
+	@param data - start frame
+	@param dlc - its length
+	@param bus - only devices on this bus, 0xFF - all
+	*/
+	void startBatchCommand(uint8_t* data, uint8_t dlc, uint8_t bus = 0xFF);
+
+	/** Build the frame start() sends
+	@param data - output, 3 bytes
+	@param measuringModeNow - Measuring mode id
+	@param refreshMs - 0 - device's default
+	@return - frame's length
+	*/
+	uint8_t startFrame(uint8_t* data, uint8_t measuringModeNow, uint16_t refreshMs);
+
+	/** Queue a frame for the paced sending, see txPump()
+	@param data - payload
+	@param dlc - length
+	@param deviceNumber - device
+	@param start - batch start frame
+	@return - false if the queue is full
+	*/
+	bool txEnqueue(uint8_t* data, uint8_t dlc, uint8_t deviceNumber, bool start = false);
+
+	/** Queue a frame for the paced sending, sending queued ones while the queue is full. Blocks, answers are decoded meanwhile.
+	@param data - payload
+	@param dlc - length
+	@param deviceNumber - device
+	*/
+	void txEnqueueWait(uint8_t* data, uint8_t dlc, uint8_t deviceNumber);
+
+	/** Send all the queued paced frames. Blocks, answers are decoded meanwhile.
+	*/
+	static void txFlush();
+
+	/** Derived classes call this when a frame with readings is decoded
+	@param device - device
+	@param deviceTime - low 16 bits of device's acquisition time, see FrameLayout::timeByte. -1 - not in the frame.
+	*/
+	void readingsReceived(Device& device, int32_t deviceTime = -1){
+		device.lastReadingsMs = millis();
+		device.readingsUs = acquisitionUs(device, deviceTime);
+	}
+
+	/** Decode readings by the device's measuring mode's table, indexed directly, without branching on the mode
+	@param modes - MRM_MEASURING_MODES tables
+	@param message - frame
+	@param device - device, its measuringMode selects the table
+	@param readings - output, indexed by ReadingField::reading
+	@param deviceTime - output, device's acquisition time's low 16 bits, -1 - not in the frame
+	@return - readings decoded, 0 - frame is not in the table
+	*/
+	static uint8_t readingsDecode(const ModeLayout* modes, const CANMessage& message, const Device& device, int32_t* readings, int32_t* deviceTime){
+		const ModeLayout& mode = modes[device.measuringMode];
+		for (uint8_t i = 0; i < MRM_LAYOUT_FRAMES && mode.frames[i].command != 0; i++) {
+			const FrameLayout& frame = mode.frames[i];
+			if (frame.command != message.data[0])
+				continue;
+			for (uint8_t j = 0; j < frame.fieldsCount; j++) {
+				const ReadingField& field = frame.fields[j];
+				uint32_t value = 0;
+				for (uint8_t k = 0; k < field.bytes; k++)
+					value |= (uint32_t)message.data[field.byte + k] << (8 * k);
+				value >>= field.shift;
+				if (field.bits < 32) {
+					value &= (1UL << field.bits) - 1;
+					if (field.isSigned && (value >> (field.bits - 1)))
+						value |= ~((1UL << field.bits) - 1);
+				}
+				readings[field.reading] = (int32_t)value;
+			}
+			*deviceTime = frame.timeByte != 0 && message.dlc >= frame.timeByte + 2 ?
+				message.data[frame.timeByte] | (message.data[frame.timeByte + 1] << 8) : -1;
+			return frame.fieldsCount;
+		}
+		return 0;
+	}
+
+	/** Wrap a stored value with its age and state, timed by the device's last readings frame. Never blocks.
+	@param device - device
+	@param value - last decoded value
+	@return - reading
+	*/
+	template <typename T>
+	Reading<T> readingMake(Device& device, T value){ return readingMake(device, value, device.lastReadingsMs, device.readingsUs); }
+
+	/** Wrap a stored value with its age and state, for values not in every readings frame. Never blocks.
+	@param device - device
+	@param value - last decoded value
+	@param receivedMs - when the value arrived, 0 - not since the device was started
+	@param acquiredUs - its acquisition time in host's micros()
+	@return - reading
+	*/
+	template <typename T>
+	Reading<T> readingMake(Device& device, T value, uint32_t receivedMs, uint32_t acquiredUs){
+		Reading<T> reading;
+		reading.value = value;
+		reading.acquiredUs = acquiredUs;
+		if (receivedMs == 0) {
+			reading.ageMs = 0xFFFFFFFF;
+			reading.state = READING_NONE;
+		}
+		else {
+			reading.ageMs = millis() - receivedMs;
+			reading.state = reading.ageMs > readingMaxAgeMs ? READING_STALE : READING_FRESH;
+		}
+		return reading;
+	}
+
 public:
-	std::vector<Device> devices; // List of devices on this board
+	static Board* boards[MRM_BOARD_MAX_BOARDS]; // All the constructed boards
+	static uint8_t boardsCount;
+	static BusLoad busLoad[MRM_CAN_BUSES]; // Estimated from sent and decoded frames, for each bus
+	static LatencyProbe latencyProbe; // Used by canTest()
+	static ErrorAggregator errors; // Errors from decoding, repeats coalesced
+	uint8_t busWeight = 1; // Share of bus bandwidth assigned by BusGovernor. 0 - not governed.
+	uint16_t readingMaxAgeMs = MRM_READING_MAX_AGE_MS; // Older readings are READING_STALE
+	static bool (*unclaimedDecode)(CANMessage& message); // If not NULL, gets frames no board claimed in messageDecodeAll()
+	static thread_local uint8_t rxBus; // Bus of the frame being decoded in this thread, 0xFF - unknown, devices on any bus take it
+	DeviceVector<Device> devices; // List of devices on this board
+	static FrameTrace* frameTrace; // If not NULL, all the sent and decoded frames are recorded here
+	static LogDeferred logDeferred; // Messages from the decoding path, printed later by logFlush()
+	static uint32_t logDroppedReported; // logDeferred.dropped() already printed by logFlush()
+	static bool logTaskStarted; // logTaskStart() flushes, delayMs() and noLoopWithoutThis() must not
 	uint8_t devicesOnABoard; // Number of devices on a single board
 	uint8_t number; // Index in vector
-
-	// In order to avoid back-pointers to Robot class
-	std::function<void (CANMessage& message, uint8_t errorCode, bool peripheral, bool printNow)> errorAddParent;
-	std::function<bool ()> userBreakParent;
-	std::function<bool ()> setupParent;
-	std::function<void()> endParent;
-	std::function<void (CANMessage& message, Board* board, uint8_t deviceNumber, bool outbound, bool clientInitiated, std::string postfix)> messagePrintParent;
-	std::function<void (CANMessage& message, uint8_t deviceNumber)> messageSendParent;
-	std::function<void (uint16_t)> delayMsParent;
-	std::function<void ()> noLoopWithoutThisParent;
-	std::function<uint16_t (uint16_t timeoutFirst, uint16_t timeoutBetween, bool onlySingleDigitInput, 
-		uint16_t limit, bool printWarnings)> serialReadNumberParent;
 	
 	/**
 	@param robot - robot containing this board
@@ -161,12 +575,15 @@ public:
 	*/
 	Board(uint8_t maxNumberOfBoards, uint8_t devicesOnABoard, std::string boardName, BoardType boardType, BoardId id);
 
+	virtual ~Board();
+
 	/** Add a device.
 	@param deviceName
 	@param canIn
 	@param canOut
+	@param bus - CAN Bus index
 	*/
-	void add(std::string deviceName, uint16_t canIn, uint16_t canOut);
+	void add(std::string deviceName, uint16_t canIn, uint16_t canOut, uint8_t bus = 0);
 
 	/** Did it respond to last ping? If not, try another ping and see if it responds.
 	@param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0. 0xFF - any alive.
@@ -178,6 +595,12 @@ public:
 
 	uint8_t aliveCount();
 
+	/** Ping all the devices of all the boards in one paced burst and collect the answers during a single window, instead of a scan per device
+	@param windowMs - collection time. 0 - one scan's time.
+	@return - number of alive devices
+	*/
+	static uint8_t aliveSweep(uint16_t windowMs = 0);
+
 	/** Set aliveness
 	@param yesOrNo
 	@param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
@@ -192,8 +615,37 @@ public:
 	*/
 	bool canGap();
 
+	/** Round-trip latency benchmark. Sends timestamped COMMAND_CAN_TEST frames, matches the echoes and prints min, median and 99th percentile,
+	overall and for each bus load quarter.
+	@param device - device, nullptr - all alive devices
+	@param probes - number of frames to send to each device, up to MRM_LATENCY_SAMPLES
+	@param betweenMs - pause between 2 frames
+	*/
+	void canTest(Device* device = nullptr, uint16_t probes = 100, uint16_t betweenMs = 5);
+
 	virtual std::string commandName(uint8_t byte);
 
+	/** Restore board-specific configuration saved by configSerialize()
+	@param buffer - data
+	@param length - number of bytes
+	@return - success
+	*/
+	virtual bool configDeserialize(const uint8_t* buffer, uint8_t length);
+
+	/** Check configuration saved by configSerialize() without applying it
+	@param buffer - data
+	@param length - number of bytes
+	@return - configDeserialize() would succeed
+	*/
+	virtual bool configValid(const uint8_t* buffer, uint8_t length);
+
+	/** Write board-specific configuration, like measuring mode, for Topology
+	@param buffer - output
+	@param size - buffer's size
+	@return - number of bytes written, 0xFF - no room
+	*/
+	virtual uint8_t configSerialize(uint8_t* buffer, uint8_t size);
+
 	static std::string commandNameCommon(uint8_t byte);
 
 	/** Did any device respond to last ping?
@@ -201,20 +653,56 @@ public:
 	*/
 	uint8_t count();
 
-	void delayMs(uint16_t ms);
+	/** Wait. Messages queued for logFlush() are printed first, unless logTaskStart() prints them.
+	@param ms - wait
+	*/
+	void delayMs(uint16_t ms){
+		if (!logTaskStarted)
+			logFlush();
+		BoardHost::delayMs(ms);
+	}
 
 	Device* deviceGet(uint8_t deviceNumber);
 
+	/** Convert a device's time to host's
+	@param device - device
+	@param deviceUs - device's micros()
+	@return - host's micros()
+	*/
+	uint32_t deviceToHostUs(Device& device, uint32_t deviceUs);
+
 	uint8_t deviceNumber(uint16_t msgId);
 
+	/** Bytes occupied by this board's object and its storage
+	@return - bytes
+	*/
+	virtual uint32_t memoryFootprint();
+
+	/** Measuring mode set by the last start()
+	@param device - device, nullptr - board's last requested mode
+	*/
+	uint8_t measuringModeGet(Device* device = nullptr){ return device == nullptr ? measuringMode : device->measuringMode; }
+
+	/** Print memory footprint
+	*/
+	void memoryFootprintPrint();
+
+	/** Detect devices sharing a CAN Bus id. Pings all the devices of all the boards in one paced burst, then collects echoes during a single window.
+	More than one echo for an id means more than one physical device uses it.
+	@param windowMs - collection time. 0 - one scan's time.
+	@return - number of conflicting ids
+	*/
+	static uint8_t duplicatesScan(uint16_t windowMs = 0);
+
 	/** Ping devices and refresh alive array
 	@param verbose - prints statuses
 	@param mask - bitwise, 16 bits - no more than 16 devices! Bit == 1 - scan, 0 - no scan.
 	*/
 	void devicesScan(uint16_t mask = 0xFFFF);
 
-	void end();
-	void errorAdd(CANMessage message, uint8_t errorCode, bool peripheral, bool printNow);
+	void end(){ BoardHost::end(); }
+
+	void errorAdd(CANMessage message, uint8_t errorCode, bool peripheral, bool printNow){ BoardHost::errorAdd(message, errorCode, peripheral, printNow); }
 
 	/** Request firmware version
 	@param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0. 0xFF - for all devices.
@@ -230,6 +718,44 @@ public:
 	*/
 	void fpsRequest(Device* device = nullptr);
 
+	/** Print messages queued by decoding and other time-critical functions, repeated errors' summaries and how many messages the full
+	queue lost. delayMs() and noLoopWithoutThis() call it; call it from the main loop too, or start logTaskStart(). Only one thread may call it.
+	@param maxEntries - stop after this many lines, errors' included
+	@return - number of lines printed
+	*/
+	static uint16_t logFlush(uint16_t maxEntries = 0xFFFF){
+		uint16_t printed = errors.flush(maxEntries > 0xFF ? 0xFF : maxEntries);
+		printed += logDeferred.flush(maxEntries - printed);
+		uint32_t dropped = logDeferred.dropped();
+		if (dropped != logDroppedReported && printed < maxEntries) {
+			print("%i log messages lost, queue full\n\r", dropped - logDroppedReported);
+			logDroppedReported = dropped;
+			printed++;
+		}
+		return printed;
+	}
+
+#if defined(ESP32)
+	/** Start a background task that does logFlush(), instead of the main loop
+	@param core - ESP32 core
+	@param priority - FreeRTOS priority, should be lower than CAN Bus decoding's
+	*/
+	static void logTaskStart(uint8_t core = 0, uint8_t priority = 1){
+		logTaskStarted = true;
+		logDeferred.taskStart(core, priority, logFlush);
+	}
+#endif
+
+	/** Convert host's time to a device's
+	@param device - device
+	@param hostUs - host's micros()
+	@return - device's micros()
+	*/
+	uint32_t hostToDeviceUs(Device& device, uint32_t hostUs){
+		DeviceClock& clock = device.clock;
+		return hostUs + clock.offsetUs + (int32_t)(clock.driftPpm * (int32_t)(hostUs - clock.syncUs) / 1e6f);
+	}
+
 	/** Board class id, not each device's
 	*/
 	BoardId id() { return _id; }
@@ -245,7 +771,7 @@ public:
 	*/
 	void info(Device* device = nullptr);
 
-	/** Is the frame addressed to this device's Arduino object?
+	/** Is the frame addressed to this device's Arduino object? Not if it came from another bus, see rxBus.
 	@param canIdOut - CAN Bus id.
 	@param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
 	@return - if true, it is
@@ -267,6 +793,28 @@ public:
 	*/
 	virtual bool messageDecode(CANMessage& message)= 0;
 
+	/** Offer a received frame to all the boards and, if none claims it, to unclaimedDecode. Host calls it for each received frame.
+	@param message - frame
+	@param bus - bus it came from, only devices on it take it. 0xFF - any.
+	@return - claimed
+	*/
+	static bool messageDecodeAll(CANMessage& message, uint8_t bus = 0xFF);
+
+	/** Offer a received FD frame to all the boards and, if none claims it, to unclaimedDecode
+	@param message - frame
+	@param bus - bus it came from, only devices on it take it. 0xFF - any.
+	@return - claimed
+	*/
+	static bool messageDecodeAllFD(CANFDMessage& message, uint8_t bus = 0xFF);
+
+	/** Read a CAN FD frame into local variables. FD payloads extend classic ones, so frames up to 8 bytes go to messageDecode(). A longer frame
+	that is not a common FD command packs classic frames back to back, 8 bytes each, command byte first, for example all of a sensor array's
+	readings frames; each part goes to messageDecode(), until a part with command 0 (padding).
+	@param message - frame
+	@return - true if canId for this class
+	*/
+	virtual bool messageDecodeFD(CANFDMessage& message);
+
 	/** Prints a frame
 	@param msgId - messageId
 	@param dlc - data length
@@ -281,14 +829,39 @@ public:
 	@param data - payload
 	@param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
 	*/
-	void messageSend(uint8_t* data, uint8_t dlc, uint8_t deviceNumber = 0);
+	void messageSend(uint8_t* data, uint8_t dlc, uint8_t deviceNumber = 0){
+		Device& device = devices[deviceNumber];
+		CANMessage message(device.canIdIn, data, dlc);
+		if (frameTrace != NULL)
+			frameTrace->record(message, true, device.bus);
+		device.stats.framesSent++;
+		busLoad[device.bus].add(dlc);
+		if (device.bus == 0 && !BusRouter::transportExists(0))
+			BoardHost::messageSend(message, deviceNumber);
+		else
+			BusRouter::transportSend(message, device.bus);
+	}
+
+	/** Send a CAN FD frame. Needs an FD-capable transport on the device's bus. Payloads up to 8 bytes fall back to classic frames.
+	@param data - payload
+	@param length - up to 64
+	@param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
+	@return - sent
+	*/
+	bool messageSendFD(uint8_t* data, uint8_t length, uint8_t deviceNumber = 0);
 
 	/** Returns device group's name
 	@return - name
 	*/
 	std::string name() {return _boardsName;}
 
-	void noLoopWithoutThis();
+	/** Messages queued for logFlush() are printed here too, unless logTaskStart() prints them
+	*/
+	void noLoopWithoutThis(){
+		if (!logTaskStarted)
+			logFlush();
+		BoardHost::noLoopWithoutThis();
+	}
 
 	/** Request notification
 	@param commandRequestingNotification
@@ -313,7 +886,7 @@ public:
 	void reset(Device* device = nullptr);
 
 	uint16_t serialReadNumber(uint16_t timeoutFirst, uint16_t timeoutBetween, bool onlySingleDigitInput, 
-		uint16_t limit, bool printWarnings);
+		uint16_t limit, bool printWarnings){ return BoardHost::serialReadNumber(timeoutFirst, timeoutBetween, onlySingleDigitInput, limit, printWarnings); }
 
 	bool setup();
 
@@ -324,6 +897,55 @@ public:
 	*/
 	void start(Device* device = nullptr, uint8_t measuringModeNow = 0, uint16_t refreshMs = 0);
 
+	/** Start all the alive devices without blocking: the frames leave through the paced queue. Follow with startPoll() until it returns 0.
+	@param measuringModeNow - Measuring mode id. Default 0.
+	@param refreshMs - gap between 2 CAN Bus messages to refresh local Arduino copy of device's data. 0 - device's default.
+	@param bus - only devices on this bus, 0xFF - all. Each bus keeps its own frame, so buses can have different refresh periods.
+	*/
+	void startBatch(uint8_t measuringModeNow = 0, uint16_t refreshMs = 0, uint8_t bus = 0xFF);
+
+	/** Advance a batch start: send paced frames, confirm devices by their first reading, retry the silent ones. Non-blocking.
+	A device is confirmed when its lastReadingsMs is not older than its start frame, so any board's decoder confirms it.
+	@return - devices still pending. Devices that exhausted MRM_START_TRIES are dropped from pending and reported in errorMessage.
+	*/
+	uint8_t startPoll();
+
+	/** Snapshot of a device's bus counters
+	@param device - device
+	@return - copy of the counters
+	*/
+	DeviceStats statsGet(Device& device){ return device.stats; }
+
+	/** Print all devices' bus counters
+	*/
+	void statsPrint();
+
+	/** Reset bus counters
+	@param device - device, nullptr - all devices
+	*/
+	void statsReset(Device* device = nullptr);
+
+	/** Subscribe to a device's new readings instead of polling
+	@param device - device
+	@param callback - called from decoding, see ReadingCallback
+	@param context - passed to callback
+	@param threshold - only if the reading changed at least this much since the last delivered one. 0 - each reading.
+	@param subsensor - subsensor's number, 0xFF - any
+	@return - handle for unsubscribe(), 0xFF - no free slot
+	*/
+	uint8_t subscribe(Device& device, ReadingCallback callback, void* context = NULL, uint32_t threshold = 0, uint8_t subsensor = 0xFF);
+
+#if defined(ESP32)
+	/** Subscribe a FreeRTOS task, which will be notified (xTaskNotifyGive()) on a new reading
+	@param device - device
+	@param task - task to wake
+	@param threshold - only if the reading changed at least this much since the last delivered one. 0 - each reading.
+	@param subsensor - subsensor's number, 0xFF - any
+	@return - handle for unsubscribe(), 0xFF - no free slot
+	*/
+	uint8_t subscribeTask(Device& device, TaskHandle_t task, uint32_t threshold = 0, uint8_t subsensor = 0xFF);
+#endif
+
 	/** add() assigns device numbers one after another. swap() changes the sequence later. Therefore, add(); add(); will assign number 0 to a device with the smallest CAN Bus id and 1 to the one with the next smallest. 
 	If we want to change the order so that now the device 1 is the one with the smalles CAN Bus id, we will call swap(0, 1); after the the add() commands.
 	@param deviceNumber1 - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
@@ -336,21 +958,48 @@ public:
 	*/
 	void stop(Device* device = nullptr);
 
+	/** Stop all the alive devices through the paced queue, without blocking. Frames leave in txPump() or startPoll().
+	*/
+	void stopBatch();
+
 	/**Test
 	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0. 0xFF - all devices.
 	@param betweenTestsMs - time in ms between 2 tests. 0 - default.
 	*/
 	virtual void test(Device * device = nullptr, uint16_t betweenTestsMs = 0) {}
 
-	bool userBreak();
+	/** Gap between paced frames, us
+	*/
+	static uint16_t txGapUs;
+
+	/** Send the paced frames that are due. Non-blocking, call it from the loop while startBatch() or stopBatch() frames are queued.
+	@return - frames still queued
+	*/
+	static uint8_t txPump();
+
+	/** Send time sync requests. Each answer refines the device's clock offset and, over repeated calls, its drift. Call it periodically,
+	like every second, preferably when the bus is quiet: answers delayed in queues are detected by their round trip and rejected.
+	@param device - device, nullptr - all the alive ones
+	*/
+	void timeSync(Device* device = nullptr);
+
+	/** Cancel a subscription
+	@param handle - returned by subscribe()
+	*/
+	void unsubscribe(uint8_t handle);
+
+	bool userBreak(){ return BoardHost::userBreak(); }
 };
 
 
 class MotorBoard : public Board {
 protected:
-	std::vector<uint32_t>* encoderCount; // Encoder count
-	std::vector<bool>* reversed; // Change rotation
-	std::vector<int8_t>* lastSpeed;
+	DeviceVector<uint32_t> encoderCount; // Encoder count
+	DeviceVector<int32_t> encoderVelocity; // Only from CAN FD bundles
+	DeviceVector<uint32_t> velocityMs; // When the last bundle arrived, 0 - none. Classic frames do not refresh velocity.
+	DeviceVector<uint32_t> velocityUs; // Bundle's acquisition time in host's micros()
+	DeviceVector<bool> reversed; // Change rotation
+	DeviceVector<int8_t> lastSpeed;
 
 	/** If sensor not started, start it and wait for 1. message
 	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
@@ -371,11 +1020,44 @@ public:
 
 	~MotorBoard();
 
+	/** Non-interactive characterisation, for regression benchmarks across robots. For each motor: a speed sweep, a dead-band search and a step response,
+	recording every encoder frame with its arrival time. CSV columns: record, motor, speed, us, value. Records:
+	frame - us is arrival time, value encoder count; rate - value counts/s after settling; dead-band - the smallest moving speed, for each direction;
+	latency - us from the step command to the first changed count; rise - us to 63 % of the step's final rate.
+	@param device - motor, NULL - all alive
+	@param fileName - CSV output
+	@param speedStep - sweep's step, 1 - 127
+	@param settleMs - wait after each speed change before measuring the rate, also the rate's window
+	@return - success
+	*/
+	bool characterise(Device* device, const char* fileName, uint8_t speedStep = 8, uint16_t settleMs = 200);
+
 	/** Changes rotation's direction
 	@param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
 	*/
 	void directionChange(Device& device);
 
+	/** Restore configuration saved by configSerialize()
+	@param buffer - data
+	@param length - number of bytes
+	@return - success
+	*/
+	bool configDeserialize(const uint8_t* buffer, uint8_t length);
+
+	/** Check configuration saved by configSerialize() without applying it
+	@param buffer - data
+	@param length - number of bytes
+	@return - configDeserialize() would succeed
+	*/
+	bool configValid(const uint8_t* buffer, uint8_t length);
+
+	/** Write configuration, measuring mode and reversed motors, for Topology
+	@param buffer - output
+	@param size - buffer's size
+	@return - number of bytes written, 0xFF - no room
+	*/
+	uint8_t configSerialize(uint8_t* buffer, uint8_t size);
+
 	/** Read CAN Bus message into local variables
 	@param canId - CAN Bus id
 	@param data - 8 bytes from CAN Bus message.
@@ -384,12 +1066,32 @@ public:
 	*/
 	bool messageDecode(CANMessage& message);
 
+	static const ModeLayout encoderLayouts[MRM_MEASURING_MODES]; // Encoder count in bytes 1 - 4, in every mode
+
+	/** Read a CAN FD frame. Besides classic frames, decodes an encoder and velocity bundle: COMMAND_SENSORS_MEASURE_SENDING, 
+	bytes 1 - 4 encoder count, 5 - 8 signed velocity.
+	@param message - frame
+	@return - true if canId for this class
+	*/
+	bool messageDecodeFD(CANFDMessage& message);
+
+	/** Bytes occupied by this board's object and its storage
+	@return - bytes
+	*/
+	uint32_t memoryFootprint();
+
 	/** Encoder readings
 	@param deviceNumber - Devices's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0.
 	@return - encoder value
 	*/
 	uint16_t reading(Device& device);
 
+	/** Encoder reading without blocking: no scanning and no starting, unlike reading()
+	@param device - device
+	@return - encoder value, its age and state
+	*/
+	Reading<uint32_t> readingGet(Device& device){ return readingMake(device, encoderCount[device.number]); }
+
 	/** Print all readings in a line
 	*/
 	void readingsPrint();
@@ -404,6 +1106,20 @@ public:
 	*/
 	void stop();
 
+	/** Encoder velocity, only sent by devices streaming CAN FD bundles
+	@param device - device
+	@return - velocity, in encoder counts per device's time unit
+	*/
+	int32_t velocity(Device& device);
+
+	/** Encoder velocity without blocking. Its age counts from the last CAN FD bundle, not from classic encoder frames.
+	@param device - device
+	@return - velocity, its age and state
+	*/
+	Reading<int32_t> velocityGet(Device& device){
+		return readingMake(device, encoderVelocity[device.number], device.lastReadingsMs == 0 ? 0 : velocityMs[device.number], velocityUs[device.number]);
+	}
+
 	/**Test
 	@param deviceNumber - Device's ordinal number. Each call of function add() assigns a increasing number to the device, starting with 0. 0xFF - all devices.
 	@param betweenTestsMs - time in ms between 2 tests. 0 - default.
@@ -433,6 +1149,10 @@ public:
 	*/
 	void continuousReadingCalculatedDataStart(Device* device);
 
+	/** Batch version of continuousReadingCalculatedDataStart() for all the alive devices, without blocking. Follow with startPoll() until it returns 0.
+	*/
+	void continuousReadingCalculatedDataStartBatch();
+
 	/** Read CAN Bus message into local variables
 	@param canId - CAN Bus id
 	@param data - 8 bytes from CAN Bus message.
@@ -453,16 +1173,55 @@ public:
 
 //typedef void (*SpeedSetFunction)(uint8_t motorNumber, int8_t speed);
 
+/** Setpoint generator state for one motor
+*/
+struct MotionProfile{
+	float speed = 0; // Current setpoint, -127 to 127
+	float acceleration = 0; // Current rate of change, per s. Used only by S-curves.
+	int8_t target = 0;
+};
+
 class MotorGroup {
 protected:
 	MotorBoard* motorBoard[MAX_MOTORS_IN_GROUP] = { NULL, NULL, NULL, NULL }; // Motor board for each wheel. It can the same, but need not be.
 	uint8_t motorNumber[MAX_MOTORS_IN_GROUP];
-public:
-	std::function<void (uint16_t)> delayMs;
+	MotionProfile profiles[MAX_MOTORS_IN_GROUP];
+	float profileAcceleration = 0; // Speed units per s, 0 - no profiling, speeds are sent at once
+	float profileJerk = 0; // Speed units per s^2, 0 - trapezoidal profile
+	uint16_t profileTickMs = 10;
+	uint32_t profileLastMs = 0;
+	bool profileMoving = false; // Any wheel still approaching its target, as of the last tick or target change
+
+	/** Command a wheel: directly or, if profiling, as the profile's target
+	@param i - wheel
+	@param speed - -127 to 127
+	*/
+	void speedOut(uint8_t i, int8_t speed);
 
+public:
 	MotorGroup();
 
-	/** Stop motors
+	void delayMs(uint16_t ms){ BoardHost::delayMs(ms); }
+
+	/** Enable motion profiles. After this, go() only sets targets, which profileTick() approaches and sends.
+	@param acceleration - maximum change of speed, in speed units (127 - full) per s. 0 - disable profiles.
+	@param jerk - maximum change of acceleration, per s^2, giving an S-curve. 0 - trapezoidal.
+	@param tickMs - setpoints' period
+	*/
+	void profileSet(float acceleration, float jerk = 0, uint16_t tickMs = 10);
+
+	/** Advance all the profiles if a tick elapsed and send the wheels whose rounded speed changed, in one burst. Non-blocking, call it from the loop.
+	@return - true while any wheel is still approaching its target
+	*/
+	bool profileTick();
+
+	/** Set a wheel's target speed, reached by profileTick()
+	@param i - wheel, in the group's order
+	@param speed - -127 to 127
+	*/
+	void targetSet(uint8_t i, int8_t speed);
+
+	/** Stop motors at once, also ending any profile
 	*/
 	void stop();
 };